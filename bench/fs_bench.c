@@ -0,0 +1,698 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fat32.h"
+#include "image_io.h"
+
+// benchmark suite for the filesystem code.
+//
+//   fs_bench gen [options] <image>       build a populated image
+//   fs_bench run [options]               run the microbenchmarks, write JSON
+//   fs_bench compare <base> <current>    compare two JSON result files
+//
+// every benchmark times single shell-level operations, so latencies are
+// per call. syscall counts are the image reads/writes done by the library.
+
+#define SECTOR_SIZE  512
+#define RESERVED     32
+#define NUM_FATS     2
+#define MAX_RESULTS  256
+#define BENCH_REPEAT 50     // runs of the whole-image benchmarks (mount, ls)
+
+// file size distribution of generated images
+enum { DIST_FIXED, DIST_UNIFORM, DIST_LOG2 };
+
+typedef struct {
+    int kind;
+    unsigned long a, b;
+} SIZE_DIST;
+
+// what `gen` builds: every directory holds `files` files and, above the
+// last level, `fanout` subdirectories D0, D1, ...
+typedef struct {
+    unsigned long size_mb;
+    unsigned int cluster_kb;
+    unsigned int fanout;
+    unsigned int depth;
+    unsigned int files;
+    SIZE_DIST dist;
+    unsigned long seed;
+} GEN_SPEC;
+
+typedef struct {
+    char bench[32];
+    unsigned long scale;
+    unsigned long ops;
+    double ops_per_sec;
+    double p50_us;
+    double p99_us;
+    double syscalls_per_op;
+} RESULT;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long next_rand(unsigned long *state) {
+    // xorshift64
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+//image generator
+
+// parses fixed:BYTES, uniform:MIN:MAX or log2:MIN:MAX. log2 picks a
+// power-of-two size class uniformly and a size inside it, so small files
+// are common and large ones rare, as on real volumes.
+static int parse_dist(const char *s, SIZE_DIST *d) {
+    char kind[16];
+    d->a = d->b = 0;
+    int n = sscanf(s, "%15[a-z0-9]:%lu:%lu", kind, &d->a, &d->b);
+    if (n >= 2 && strcmp(kind, "fixed") == 0) {
+        d->kind = DIST_FIXED;
+        d->b = d->a;
+        return 0;
+    }
+    if (n == 3 && d->a <= d->b && strcmp(kind, "uniform") == 0) {
+        d->kind = DIST_UNIFORM;
+        return 0;
+    }
+    if (n == 3 && d->a > 0 && d->a <= d->b && strcmp(kind, "log2") == 0) {
+        d->kind = DIST_LOG2;
+        return 0;
+    }
+    return -1;
+}
+
+static unsigned long draw_size(const SIZE_DIST *d, unsigned long *rng) {
+    switch (d->kind) {
+    case DIST_UNIFORM:
+        return d->a + next_rand(rng) % (d->b - d->a + 1);
+    case DIST_LOG2: {
+        unsigned int classes = 0;
+        while ((d->a << classes) < d->b) classes++;
+        unsigned long lo = d->a << (next_rand(rng) % (classes + 1));
+        unsigned long hi = lo * 2 < d->b ? lo * 2 : d->b;
+        if (lo > hi) lo = hi;
+        return lo + next_rand(rng) % (hi - lo + 1);
+    }
+    default:
+        return d->a;
+    }
+}
+
+static unsigned long dist_max(const SIZE_DIST *d) {
+    return d->b;
+}
+
+// writes an empty FAT32 volume: boot sector and its backup, FSInfo, two
+// FATs and a zeroed root directory. the file is sparse, so volumes of up
+// to 2 TB can be generated on small disks.
+static int format_image(const char *path, unsigned long size_mb, unsigned int cluster_kb) {
+    unsigned int spc = cluster_kb * 1024 / SECTOR_SIZE;
+    uint64_t total = (uint64_t)size_mb * 1024 * 1024 / SECTOR_SIZE;
+    if (spc == 0 || (spc & (spc - 1)) != 0 || spc > 128 || total > 0xFFFFFFFFul) {
+        return -1;
+    }
+
+    unsigned long clusters = total / spc;
+    unsigned int fatsz = (unsigned int)((clusters * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    unsigned long first_data = RESERVED + NUM_FATS * (unsigned long)fatsz;
+    if (total <= first_data + spc) return -1;
+    unsigned long data_clusters = (total - first_data) / spc;
+    if (data_clusters > 0x0FFFFFF5) return -1;
+
+    unsigned char sector[SECTOR_SIZE];
+    memset(sector, 0, sizeof(sector));
+    BPB *bpb = (BPB *)sector;
+    memcpy(bpb->BS_jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(bpb->BS_OEMName, "MSWIN4.1", 8);
+    bpb->BPB_BytsPerSec = SECTOR_SIZE;
+    bpb->BPB_SecPerClus = (unsigned char)spc;
+    bpb->BPB_RsvdSecCnt = RESERVED;
+    bpb->BPB_NumFATs = NUM_FATS;
+    bpb->BPB_Media = 0xF8;
+    bpb->BPB_SecPerTrk = 63;
+    bpb->BPB_NumHeads = 255;
+    bpb->BPB_TotSec32 = (unsigned int)total;
+    bpb->BPB_FATSz32 = fatsz;
+    bpb->BPB_RootClus = 2;
+    bpb->BPB_FSInfo = 1;
+    bpb->BPB_BkBootSec = 6;
+    bpb->BS_DrvNum = 0x80;
+    bpb->BS_BootSig = 0x29;
+    bpb->BS_VolID = 0x20240101;
+    memcpy(bpb->BS_VolLab, "NO NAME    ", 11);
+    memcpy(bpb->BS_FilSysType, "FAT32   ", 8);
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return -1;
+
+    int err = 0;
+    err |= fseeko(fp, (off_t)(total * SECTOR_SIZE - 1), SEEK_SET) != 0 || fputc(0, fp) == EOF;
+    err |= fseeko(fp, 0, SEEK_SET) != 0 || fwrite(sector, SECTOR_SIZE, 1, fp) != 1;
+    err |= fseeko(fp, 6 * SECTOR_SIZE, SEEK_SET) != 0 || fwrite(sector, SECTOR_SIZE, 1, fp) != 1;
+
+    // FSInfo: the root directory takes cluster 2
+    unsigned int fsi[SECTOR_SIZE / 4];
+    memset(fsi, 0, sizeof(fsi));
+    fsi[0] = 0x41615252;
+    fsi[121] = 0x61417272;
+    fsi[122] = (unsigned int)data_clusters - 1;
+    fsi[123] = 3;
+    fsi[127] = 0xAA550000;
+    err |= fseeko(fp, SECTOR_SIZE, SEEK_SET) != 0 || fwrite(fsi, SECTOR_SIZE, 1, fp) != 1;
+
+    unsigned int fat_head[3] = { 0x0FFFFFF8, 0x0FFFFFFF, 0x0FFFFFFF };
+    for (int i = 0; i < NUM_FATS; i++) {
+        off_t off = (off_t)(RESERVED + (unsigned long)i * fatsz) * SECTOR_SIZE;
+        err |= fseeko(fp, off, SEEK_SET) != 0 || fwrite(fat_head, sizeof(fat_head), 1, fp) != 1;
+    }
+
+    err |= fclose(fp) != 0;
+    return err ? -1 : 0;
+}
+
+// fills the current directory and, depth levels down, its subdirectories
+static int populate(fat32_fs *fs, const GEN_SPEC *spec, unsigned int depth,
+                    unsigned char *data, unsigned long *rng) {
+    char name[16];
+    for (unsigned int i = 0; i < spec->files; i++) {
+        snprintf(name, sizeof(name), "F%u", i);
+        creat_cmd(fs, name);
+
+        unsigned long size = draw_size(&spec->dist, rng);
+        if (size == 0) continue;
+        int h = fat32_open(fs, name, FAT32_O_WRONLY);
+        if (h < 0) return -1;
+        long n = fat32_pwrite(fs, h, data, size, 0);
+        fat32_close(fs, h);
+        if (n != (long)size) return -1;
+    }
+
+    if (depth == 0) return 0;
+    for (unsigned int i = 0; i < spec->fanout; i++) {
+        snprintf(name, sizeof(name), "D%u", i);
+        mkdir_cmd(fs, name);
+        cd_cmd(fs, name);
+        int err = populate(fs, spec, depth - 1, data, rng);
+        cd_cmd(fs, "..");
+        if (err) return -1;
+    }
+    return 0;
+}
+
+static int generate(const char *path, const GEN_SPEC *spec) {
+    if (format_image(path, spec->size_mb, spec->cluster_kb) != 0) {
+        fprintf(stderr, "Error: cannot create a %lu MB image with %u KB clusters at %s.\n",
+                spec->size_mb, spec->cluster_kb, path);
+        return -1;
+    }
+
+    fat32_fs *fs = fat32_mount(path, 0);
+    unsigned long max = dist_max(&spec->dist);
+    unsigned char *data = malloc(max ? max : 1);
+    if (!fs || !data) {
+        fprintf(stderr, "Error: cannot populate %s.\n", path);
+        if (fs) fat32_unmount(fs);
+        free(data);
+        return -1;
+    }
+    for (unsigned long i = 0; i < max; i++) {
+        data[i] = (unsigned char)(i * 31 + 7);
+    }
+
+    unsigned long rng = spec->seed ? spec->seed : 88172645463325252ul;
+    int err = populate(fs, spec, spec->depth, data, &rng);
+    fat32_unmount(fs);
+    free(data);
+    if (err) {
+        fprintf(stderr, "Error: %s ran out of space while populating.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned long tree_dirs(const GEN_SPEC *spec) {
+    unsigned long dirs = 1, level = 1;
+    for (unsigned int i = 0; i < spec->depth; i++) {
+        level *= spec->fanout;
+        dirs += level;
+    }
+    return dirs;
+}
+
+static int gen_main(int argc, char *argv[]) {
+    GEN_SPEC spec = { 64, 1, 4, 2, 20, { DIST_LOG2, 512, 65536 }, 0 };
+    const char *image = NULL;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            spec.size_mb = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            spec.cluster_kb = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            spec.fanout = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            spec.depth = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            spec.files = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc) {
+            if (parse_dist(argv[++i], &spec.dist) != 0) {
+                image = NULL;
+                break;
+            }
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            spec.seed = strtoul(argv[++i], NULL, 10);
+        } else if (!image && argv[i][0] != '-') {
+            image = argv[i];
+        } else {
+            image = NULL;
+            break;
+        }
+    }
+
+    if (!image) {
+        fprintf(stderr, "Usage: fs_bench gen [-s size_mb] [-k cluster_kb] [-f fanout] "
+                        "[-d depth] [-n files_per_dir] [-z fixed:B|uniform:MIN:MAX|log2:MIN:MAX] "
+                        "[-r seed] <image>\n");
+        return 1;
+    }
+    if (generate(image, &spec) != 0) return 1;
+    printf("%s: %lu directories, %lu files\n", image, tree_dirs(&spec),
+           tree_dirs(&spec) * spec.files);
+    return 0;
+}
+
+//microbenchmarks
+
+// latencies of one benchmark, in seconds
+typedef struct {
+    double *lat;
+    unsigned long n;
+    unsigned long cap;
+    unsigned long calls;
+    double start;
+} TIMING;
+
+static void timing_begin(TIMING *t, unsigned long ops) {
+    t->lat = malloc((ops ? ops : 1) * sizeof(double));
+    t->cap = t->lat ? ops : 0;
+    t->n = 0;
+    t->calls = io_syscalls();
+}
+
+static void op_begin(TIMING *t) {
+    t->start = now();
+}
+
+static void op_end(TIMING *t) {
+    double d = now() - t->start;
+    if (t->n < t->cap) t->lat[t->n++] = d;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void timing_end(TIMING *t, const char *bench, unsigned long scale,
+                       RESULT *results, int *nresults) {
+    unsigned long calls = io_syscalls() - t->calls;
+    if (t->n == 0 || *nresults >= MAX_RESULTS) {
+        free(t->lat);
+        return;
+    }
+
+    double total = 0;
+    for (unsigned long i = 0; i < t->n; i++) total += t->lat[i];
+    qsort(t->lat, t->n, sizeof(double), cmp_double);
+
+    RESULT *r = &results[(*nresults)++];
+    snprintf(r->bench, sizeof(r->bench), "%s", bench);
+    r->scale = scale;
+    r->ops = t->n;
+    r->ops_per_sec = total > 0 ? t->n / total : 0;
+    r->p50_us = t->lat[t->n / 2] * 1e6;
+    r->p99_us = t->lat[(t->n * 99) / 100 < t->n ? (t->n * 99) / 100 : t->n - 1] * 1e6;
+    r->syscalls_per_op = (double)calls / t->n;
+    free(t->lat);
+
+    fprintf(stderr, "  %-8s %10.0f ops/s  p50 %9.1f us  p99 %9.1f us  %7.2f syscalls/op\n",
+            r->bench, r->ops_per_sec, r->p50_us, r->p99_us, r->syscalls_per_op);
+}
+
+// runs every microbenchmark on an image holding `scale` files. the busy
+// directory is /D0, which holds about scale / directories entries.
+static int run_scale(const char *image, unsigned long scale, unsigned int ops,
+                     int mount_flags, FILE *devnull, RESULT *results, int *nresults) {
+    GEN_SPEC spec = { 0, 4, 4, 2, 0, { DIST_LOG2, 512, 16384 }, scale };
+    unsigned long dirs = tree_dirs(&spec);
+    spec.files = (unsigned int)((scale + dirs - 1) / dirs);
+    // room for the data (16 KB at most per file), slack and the FATs
+    spec.size_mb = 64 + (scale * 20) / 1024 + scale / 256;
+
+    fprintf(stderr, "scale %lu: %lu directories x %u files, %lu MB image\n",
+            scale, dirs, spec.files, spec.size_mb);
+    if (generate(image, &spec) != 0) return -1;
+
+    TIMING t;
+    char name[16];
+    char other[16];
+    unsigned long rng = 2463534242ul + scale;
+
+    // the first mounts after generating pay for page cache misses and
+    // for malloc settling on how to serve the FAT-sized allocations
+    for (int i = 0; i < 3; i++) {
+        fat32_fs *m = fat32_mount(image, mount_flags);
+        if (!m) return -1;
+        fat32_unmount(m);
+    }
+
+    timing_begin(&t, BENCH_REPEAT);
+    for (int i = 0; i < BENCH_REPEAT; i++) {
+        op_begin(&t);
+        fat32_fs *m = fat32_mount(image, mount_flags);
+        if (!m) return -1;
+        fat32_unmount(m);
+        op_end(&t);
+    }
+    timing_end(&t, "mount", scale, results, nresults);
+
+    fat32_fs *fs = fat32_mount(image, mount_flags);
+    if (!fs) return -1;
+    cd_cmd(fs, "D0");
+
+    // ls prints to stdout, which points at /dev/null while benchmarking
+    timing_begin(&t, BENCH_REPEAT);
+    for (int i = 0; i < BENCH_REPEAT; i++) {
+        op_begin(&t);
+        ls_cmd(fs, NULL);
+        op_end(&t);
+    }
+    timing_end(&t, "ls", scale, results, nresults);
+
+    timing_begin(&t, ops);
+    for (unsigned int i = 0; i < ops; i += 2) {
+        op_begin(&t);
+        cd_cmd(fs, "D0");
+        op_end(&t);
+        op_begin(&t);
+        cd_cmd(fs, "..");
+        op_end(&t);
+    }
+    timing_end(&t, "cd", scale, results, nresults);
+
+    timing_begin(&t, ops);
+    for (unsigned int i = 0; i < ops; i++) {
+        snprintf(name, sizeof(name), "N%u", i);
+        op_begin(&t);
+        creat_cmd(fs, name);
+        op_end(&t);
+    }
+    timing_end(&t, "creat", scale, results, nresults);
+
+    timing_begin(&t, ops);
+    for (unsigned int i = 0; i < ops; i++) {
+        snprintf(name, sizeof(name), "M%u", i);
+        op_begin(&t);
+        mkdir_cmd(fs, name);
+        op_end(&t);
+    }
+    timing_end(&t, "mkdir", scale, results, nresults);
+
+    timing_begin(&t, ops);
+    for (unsigned int i = 0; i < ops; i++) {
+        snprintf(name, sizeof(name), "F%lu", next_rand(&rng) % spec.files);
+        op_begin(&t);
+        open_cmd(fs, name, "-r");
+        op_end(&t);
+        close_cmd(fs, name);
+    }
+    timing_end(&t, "open", scale, results, nresults);
+
+    // read/write/lseek work on one 1 MB file
+    unsigned long data_size = 1ul << 20;
+    unsigned char *data = calloc(1, data_size);
+    int h = -1;
+    if (data) {
+        creat_cmd(fs, "BENCHDAT");
+        h = open_cmd(fs, "BENCHDAT", "-rw");
+        if (h >= 0) fat32_pwrite(fs, h, data, data_size, 0);
+    }
+    free(data);
+    if (h < 0) {
+        fat32_unmount(fs);
+        return -1;
+    }
+
+    timing_begin(&t, ops);
+    for (unsigned int i = 0; i < ops; i++) {
+        lseek_cmd(fs, "BENCHDAT", (unsigned int)(next_rand(&rng) % (data_size / 4096)) * 4096);
+        op_begin(&t);
+        read_cmd(fs, "BENCHDAT", 4096, devnull);
+        op_end(&t);
+    }
+    timing_end(&t, "read", scale, results, nresults);
+
+    timing_begin(&t, ops);
+    for (unsigned int i = 0; i < ops; i++) {
+        lseek_cmd(fs, "BENCHDAT", (unsigned int)(next_rand(&rng) % (data_size - 64)));
+        op_begin(&t);
+        write_cmd(fs, "BENCHDAT", "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+        op_end(&t);
+    }
+    timing_end(&t, "write", scale, results, nresults);
+
+    timing_begin(&t, ops);
+    for (unsigned int i = 0; i < ops; i++) {
+        unsigned int off = (unsigned int)(next_rand(&rng) % data_size);
+        op_begin(&t);
+        lseek_cmd(fs, "BENCHDAT", off);
+        op_end(&t);
+    }
+    timing_end(&t, "lseek", scale, results, nresults);
+    close_cmd(fs, "BENCHDAT");
+
+    timing_begin(&t, ops);
+    for (unsigned int i = 0; i < ops; i++) {
+        snprintf(name, sizeof(name), "N%u", i);
+        snprintf(other, sizeof(other), "R%u", i);
+        op_begin(&t);
+        mv_cmd(fs, name, other);
+        op_end(&t);
+    }
+    timing_end(&t, "mv", scale, results, nresults);
+
+    timing_begin(&t, ops);
+    for (unsigned int i = 0; i < ops; i++) {
+        snprintf(name, sizeof(name), "R%u", i);
+        op_begin(&t);
+        rm_cmd(fs, name);
+        op_end(&t);
+    }
+    timing_end(&t, "rm", scale, results, nresults);
+
+    timing_begin(&t, ops);
+    for (unsigned int i = 0; i < ops; i++) {
+        snprintf(name, sizeof(name), "M%u", i);
+        op_begin(&t);
+        rmdir_cmd(fs, name);
+        op_end(&t);
+    }
+    timing_end(&t, "rmdir", scale, results, nresults);
+
+    fat32_unmount(fs);
+    return 0;
+}
+
+static int write_json(const char *path, const RESULT *results, int n) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+
+    // one result per line, which is what compare reads back
+    fprintf(fp, "{\n  \"version\": 1,\n  \"results\": [\n");
+    for (int i = 0; i < n; i++) {
+        const RESULT *r = &results[i];
+        fprintf(fp, "    {\"bench\": \"%s\", \"scale\": %lu, \"ops\": %lu, "
+                    "\"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+                    "\"syscalls_per_op\": %.3f}%s\n",
+                r->bench, r->scale, r->ops, r->ops_per_sec, r->p50_us, r->p99_us,
+                r->syscalls_per_op, i + 1 < n ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    return fclose(fp) != 0 ? -1 : 0;
+}
+
+static int run_main(int argc, char *argv[]) {
+    const char *out = "bench.json";
+    const char *image = "fs_bench.img";
+    unsigned long scales[16] = { 1000, 10000, 100000 };
+    int nscales = 3;
+    int custom = 0;
+    unsigned int ops = 1000;
+    int mount_flags = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            ops = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            mount_flags |= FAT32_MOUNT_MMAP;
+        } else if (argv[i][0] != '-' && (!custom || nscales < 16)) {
+            if (!custom) nscales = 0;
+            custom = 1;
+            scales[nscales++] = strtoul(argv[i], NULL, 10);
+        } else {
+            ops = 0;
+            break;
+        }
+    }
+    if (ops == 0) {
+        fprintf(stderr, "Usage: fs_bench run [-o out.json] [-i scratch_image] [-n ops] [-m] "
+                        "[scale ...]\n");
+        return 1;
+    }
+
+    // commands print (ls, errors); keep that out of the way
+    FILE *devnull = fopen("/dev/null", "w");
+    if (!devnull || !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "Error: cannot open /dev/null.\n");
+        return 1;
+    }
+
+    RESULT results[MAX_RESULTS];
+    int nresults = 0;
+    int err = 0;
+    for (int i = 0; i < nscales && !err; i++) {
+        if (scales[i] == 0) continue;
+        err = run_scale(image, scales[i], ops, mount_flags, devnull, results, &nresults);
+    }
+    remove(image);
+    fclose(devnull);
+
+    if (err) {
+        fprintf(stderr, "Error: benchmark failed.\n");
+        return 1;
+    }
+    if (write_json(out, results, nresults) != 0) {
+        fprintf(stderr, "Error: cannot write %s.\n", out);
+        return 1;
+    }
+    fprintf(stderr, "results written to %s\n", out);
+    return 0;
+}
+
+//comparison
+
+static int read_json(const char *path, RESULT *results, int *n) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    char line[512];
+    *n = 0;
+    while (fgets(line, sizeof(line), fp) && *n < MAX_RESULTS) {
+        RESULT *r = &results[*n];
+        if (sscanf(line, " {\"bench\": \"%31[^\"]\", \"scale\": %lu, \"ops\": %lu, "
+                         "\"ops_per_sec\": %lf, \"p50_us\": %lf, \"p99_us\": %lf, "
+                         "\"syscalls_per_op\": %lf",
+                   r->bench, &r->scale, &r->ops, &r->ops_per_sec, &r->p50_us,
+                   &r->p99_us, &r->syscalls_per_op) == 7) {
+            (*n)++;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// a benchmark regresses when its median latency grows by more than
+// `tolerance` percent (and by more than the timer noise of a couple of
+// microseconds) or it needs noticeably more syscalls per operation. the
+// median is used rather than ops/s because a single preempted operation
+// can halve the mean; syscall counts do not vary between runs, so they
+// get a tight bound.
+static int compare_main(int argc, char *argv[]) {
+    double tolerance = 50.0;
+    const char *paths[2] = { NULL, NULL };
+    int npaths = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (npaths < 2) {
+            paths[npaths++] = argv[i];
+        } else {
+            npaths = 0;
+            break;
+        }
+    }
+    if (npaths != 2) {
+        fprintf(stderr, "Usage: fs_bench compare [-t tolerance_pct] <baseline.json> <current.json>\n");
+        return 2;
+    }
+
+    static RESULT base[MAX_RESULTS], cur[MAX_RESULTS];
+    int nbase, ncur;
+    for (int i = 0; i < 2; i++) {
+        if (read_json(paths[i], i ? cur : base, i ? &ncur : &nbase) != 0) {
+            fprintf(stderr, "Error: cannot read %s.\n", paths[i]);
+            return 2;
+        }
+    }
+
+    printf("%-8s %8s %12s %12s %10s %10s %8s %10s %10s\n", "bench", "scale", "base ops/s",
+           "ops/s", "base p50", "p50", "change", "base sc/op", "sc/op");
+    int regressions = 0;
+    for (int i = 0; i < ncur; i++) {
+        const RESULT *c = &cur[i];
+        const RESULT *b = NULL;
+        for (int j = 0; j < nbase && !b; j++) {
+            if (base[j].scale == c->scale && strcmp(base[j].bench, c->bench) == 0) b = &base[j];
+        }
+        if (!b) {
+            printf("%-8s %8lu %12s %12.0f %10s %10.1f %8s %10s %10.2f  new\n", c->bench,
+                   c->scale, "-", c->ops_per_sec, "-", c->p50_us, "-", "-", c->syscalls_per_op);
+            continue;
+        }
+
+        double change = b->p50_us > 0 ? (c->p50_us / b->p50_us - 1) * 100 : 0;
+        int slower = change > tolerance && c->p50_us - b->p50_us > 2.0;
+        int more_io = c->syscalls_per_op > b->syscalls_per_op * 1.1 + 0.5;
+        printf("%-8s %8lu %12.0f %12.0f %10.1f %10.1f %+7.1f%% %10.2f %10.2f  %s\n", c->bench,
+               c->scale, b->ops_per_sec, c->ops_per_sec, b->p50_us, c->p50_us, change,
+               b->syscalls_per_op, c->syscalls_per_op,
+               slower ? "SLOWER" : more_io ? "MORE I/O" : "");
+        regressions += slower || more_io;
+    }
+
+    if (regressions) {
+        printf("%d regression(s) against %s\n", regressions, paths[0]);
+        return 1;
+    }
+    printf("no regressions against %s\n", paths[0]);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "gen") == 0) return gen_main(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "run") == 0) return run_main(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "compare") == 0) return compare_main(argc - 2, argv + 2);
+
+    fprintf(stderr, "Usage: %s gen|run|compare ...\n", argv[0]);
+    return 1;
+}
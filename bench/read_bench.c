@@ -0,0 +1,213 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "fat32.h"
+
+// multithreaded read throughput: every thread opens its own handle on one
+// file and reads random blocks with fat32_pread() for a fixed time. the
+// run is repeated with 1, 2, 4, ... threads to show how reads scale.
+
+#define BENCH_FILE "RBENCH"
+
+typedef struct {
+    fat32_fs *fs;
+    unsigned long file_size;
+    unsigned long block;
+    double deadline;
+    unsigned int seed;
+    unsigned long bytes;
+    unsigned long reads;
+    int bad;
+} WORKER;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// contents of the benchmark file, so readers can check what they got
+static unsigned char pattern(unsigned long offset) {
+    return (unsigned char)((offset * 2654435761u) >> 24);
+}
+
+static unsigned int next_rand(unsigned int *state) {
+    // xorshift32
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int prepare_file(fat32_fs *fs, unsigned long size) {
+    DIR_ENTRY entry;
+    if (!find_entry(fs, BENCH_FILE, &entry)) {
+        creat_cmd(fs, BENCH_FILE);
+    }
+    int h = fat32_open(fs, BENCH_FILE, FAT32_O_RDWR);
+    if (h < 0) return -1;
+    if ((unsigned long)fat32_size(fs, h) >= size) {
+        fat32_close(fs, h);
+        return 0;
+    }
+
+    unsigned long chunk = 1ul << 20;
+    unsigned char *buf = malloc(chunk);
+    if (!buf) {
+        fat32_close(fs, h);
+        return -1;
+    }
+    for (unsigned long off = 0; off < size; off += chunk) {
+        unsigned long n = (size - off < chunk) ? size - off : chunk;
+        for (unsigned long i = 0; i < n; i++) {
+            buf[i] = pattern(off + i);
+        }
+        if (fat32_pwrite(fs, h, buf, n, off) != (long)n) {
+            free(buf);
+            fat32_close(fs, h);
+            return -1;
+        }
+    }
+    free(buf);
+    fat32_close(fs, h);
+    fat32_sync(fs);
+    return 0;
+}
+
+static void *reader(void *arg) {
+    WORKER *w = arg;
+    unsigned char *buf = malloc(w->block);
+    int h = fat32_open(w->fs, BENCH_FILE, FAT32_O_RDONLY);
+    if (!buf || h < 0) {
+        w->bad = 1;
+        free(buf);
+        return NULL;
+    }
+
+    unsigned long blocks = w->file_size / w->block;
+    while (now() < w->deadline) {
+        // a batch between clock reads keeps the timing overhead small
+        for (int i = 0; i < 64; i++) {
+            unsigned long off = (next_rand(&w->seed) % blocks) * w->block;
+            long n = fat32_pread(w->fs, h, buf, w->block, off);
+            if (n != (long)w->block ||
+                buf[0] != pattern(off) || buf[n - 1] != pattern(off + n - 1)) {
+                w->bad = 1;
+            }
+            w->bytes += (unsigned long)n;
+            w->reads++;
+        }
+    }
+
+    fat32_close(w->fs, h);
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const char *image = NULL;
+    int flags = 0;
+    unsigned long size_mb = 64;
+    unsigned long block_kb = 64;
+    double seconds = 2.0;
+    int max_threads = 8;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) {
+            flags |= FAT32_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            size_mb = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            block_kb = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            max_threads = atoi(argv[++i]);
+        } else if (!image) {
+            image = argv[i];
+        } else {
+            image = NULL;
+            break;
+        }
+    }
+
+    if (!image || size_mb == 0 || block_kb == 0 || max_threads < 1 ||
+        block_kb > size_mb * 1024) {
+        fprintf(stderr, "Usage: %s [-m] [-s file_mb] [-b block_kb] [-d seconds] "
+                        "[-t max_threads] <fat32 image>\n", argv[0]);
+        return 1;
+    }
+
+    fat32_fs *fs = fat32_mount(image, flags);
+    if (!fs) {
+        fprintf(stderr, "Error: failed to open FAT32 image.\n");
+        return 1;
+    }
+
+    unsigned long file_size = size_mb << 20;
+    if (prepare_file(fs, file_size) != 0) {
+        fprintf(stderr, "Error: could not create the %lu MB benchmark file.\n", size_mb);
+        fat32_unmount(fs);
+        return 1;
+    }
+
+    printf("file %lu MB, block %lu KB, %.1f s per run%s\n",
+           size_mb, block_kb, seconds, (flags & FAT32_MOUNT_MMAP) ? ", mmap" : "");
+    printf("%8s %12s %12s %9s\n", "threads", "MB/s", "reads/s", "speedup");
+
+    double base = 0;
+    int failed = 0;
+    for (int n = 1; n <= max_threads; n *= 2) {
+        WORKER *w = calloc(n, sizeof(WORKER));
+        pthread_t *tid = calloc(n, sizeof(pthread_t));
+        if (!w || !tid) {
+            free(w);
+            free(tid);
+            failed = 1;
+            break;
+        }
+
+        double start = now();
+        for (int i = 0; i < n; i++) {
+            w[i].fs = fs;
+            w[i].file_size = file_size;
+            w[i].block = block_kb << 10;
+            w[i].deadline = start + seconds;
+            w[i].seed = 2463534242u + 7919u * (unsigned int)i;
+            pthread_create(&tid[i], NULL, reader, &w[i]);
+        }
+
+        unsigned long bytes = 0;
+        unsigned long reads = 0;
+        for (int i = 0; i < n; i++) {
+            pthread_join(tid[i], NULL);
+            bytes += w[i].bytes;
+            reads += w[i].reads;
+            failed |= w[i].bad;
+        }
+        double elapsed = now() - start;
+
+        double mbps = bytes / elapsed / (1 << 20);
+        if (n == 1) base = mbps;
+        printf("%8d %12.1f %12.0f %8.2fx\n", n, mbps, reads / elapsed,
+               base > 0 ? mbps / base : 0);
+        fflush(stdout);
+
+        free(w);
+        free(tid);
+    }
+
+    fat32_unmount(fs);
+    if (failed) {
+        fprintf(stderr, "Error: some reads returned wrong data.\n");
+        return 1;
+    }
+    return 0;
+}
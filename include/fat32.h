@@ -1,100 +1,242 @@
-#ifndef FAT32_H
-#define FAT32_H
-
-#include <stdio.h>
-
-// FAT32 BPB structure
-#pragma pack(push, 1)
-typedef struct __attribute__((packed)) {
-    unsigned char  BS_jmpBoot[3];
-    unsigned char  BS_OEMName[8];
-    unsigned short BPB_BytsPerSec;
-    unsigned char  BPB_SecPerClus;
-    unsigned short BPB_RsvdSecCnt;
-    unsigned char  BPB_NumFATs;
-    unsigned short BPB_RootEntCnt;
-    unsigned short BPB_TotSec16;
-    unsigned char  BPB_Media;
-    unsigned short BPB_FATSz16;
-    unsigned short BPB_SecPerTrk;
-    unsigned short BPB_NumHeads;
-    unsigned int   BPB_HiddSec;
-    unsigned int   BPB_TotSec32;
-
-    // FAT32 extended BPB
-    unsigned int   BPB_FATSz32;
-    unsigned short BPB_ExtFlags;
-    unsigned short BPB_FSVer;
-    unsigned int   BPB_RootClus;
-    unsigned short BPB_FSInfo;
-    unsigned short BPB_BkBootSec;
-    unsigned char  BPB_Reserved[12];
-    unsigned char  BS_DrvNum;
-    unsigned char  BS_Reserved1;
-    unsigned char  BS_BootSig;
-    unsigned int   BS_VolID;
-    unsigned char  BS_VolLab[11];
-    unsigned char  BS_FilSysType[8];
-} BPB;
-#pragma pack(pop)
-
-// FAT32 Directory Entry (short name version)
-typedef struct __attribute__((packed)) {
-    unsigned char  DIR_Name[11];
-    unsigned char  DIR_Attr;
-    unsigned char  DIR_NTRes;
-    unsigned char  DIR_CrtTimeTenth;
-    unsigned short DIR_CrtTime;
-    unsigned short DIR_CrtDate;
-    unsigned short DIR_LstAccDate;
-    unsigned short DIR_FstClusHI;
-    unsigned short DIR_WrtTime;
-    unsigned short DIR_WrtDate;
-    unsigned short DIR_FstClusLO;
-    unsigned int   DIR_FileSize;
-} DIR_ENTRY;
-
-// for opened files
-typedef struct {
-    int using;
-    char name[12];         
-    unsigned int cluster;   
-    unsigned int offset;    
-    int mode;               
-    char path[256];         
-} OPEN_FILE;
-
-// helper functions
-const char* get_image_name();
-const char* get_current_path();
-unsigned int cluster_size();
-unsigned int first_data_sector();
-unsigned int cluster_to_sector(unsigned int cluster);
-void read_cluster(unsigned int cluster, unsigned char *buffer);
-int is_valid_entry(DIR_ENTRY *entry);
-DIR_ENTRY* find_entry(const char *target);
-unsigned int get_parent_cluster();
-
-// main filesystem interface
-int fat32_mount(const char *filename);
-void fat32_unmount();
-void info();
-void ls();
-void cd(char *name);
-void creat(char * filename);
-void mkdir(char * dirname);
-
-void open(char *filename, char *flags);
-void close(char *filename);
-void lsof(void);
-void lseek(char *filename, unsigned int offset);
-
-// Part 5 (Update)
-void write_cmd(char *filename, const char *string);
-void mv_cmd(char *src, char *dst);
-
-// Part 6 (Delete)
-void rm_cmd(char *filename);
-void rmdir_cmd(char *dirname);
-
-#endif
+#ifndef FAT32_H
+#define FAT32_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// FAT32 BPB structure
+#pragma pack(push, 1)
+typedef struct __attribute__((packed)) {
+    unsigned char  BS_jmpBoot[3];
+    unsigned char  BS_OEMName[8];
+    unsigned short BPB_BytsPerSec;
+    unsigned char  BPB_SecPerClus;
+    unsigned short BPB_RsvdSecCnt;
+    unsigned char  BPB_NumFATs;
+    unsigned short BPB_RootEntCnt;
+    unsigned short BPB_TotSec16;
+    unsigned char  BPB_Media;
+    unsigned short BPB_FATSz16;
+    unsigned short BPB_SecPerTrk;
+    unsigned short BPB_NumHeads;
+    unsigned int   BPB_HiddSec;
+    unsigned int   BPB_TotSec32;
+
+    // FAT32 extended BPB
+    unsigned int   BPB_FATSz32;
+    unsigned short BPB_ExtFlags;
+    unsigned short BPB_FSVer;
+    unsigned int   BPB_RootClus;
+    unsigned short BPB_FSInfo;
+    unsigned short BPB_BkBootSec;
+    unsigned char  BPB_Reserved[12];
+    unsigned char  BS_DrvNum;
+    unsigned char  BS_Reserved1;
+    unsigned char  BS_BootSig;
+    unsigned int   BS_VolID;
+    unsigned char  BS_VolLab[11];
+    unsigned char  BS_FilSysType[8];
+} BPB;
+#pragma pack(pop)
+
+// FAT32 Directory Entry (short name version)
+typedef struct __attribute__((packed)) {
+    unsigned char  DIR_Name[11];
+    unsigned char  DIR_Attr;
+    unsigned char  DIR_NTRes;
+    unsigned char  DIR_CrtTimeTenth;
+    unsigned short DIR_CrtTime;
+    unsigned short DIR_CrtDate;
+    unsigned short DIR_LstAccDate;
+    unsigned short DIR_FstClusHI;
+    unsigned short DIR_WrtTime;
+    unsigned short DIR_WrtDate;
+    unsigned short DIR_FstClusLO;
+    unsigned int   DIR_FileSize;
+} DIR_ENTRY;
+
+// a mounted image. every call below works on the image passed to it, so
+// several images can be mounted in one process. calls may be made from
+// many threads at once, except cd_cmd and mv_cmd, which change the
+// current directory the others resolve relative paths in.
+typedef struct fat32_fs fat32_fs;
+
+// fat32_mount flags
+#define FAT32_MOUNT_MMAP 0x1        // map the whole image instead of stdio
+
+// fat32_open modes
+#define FAT32_O_RDONLY 0
+#define FAT32_O_WRONLY 1
+#define FAT32_O_RDWR   2
+
+// helper functions
+void set_error_line(fat32_fs *fs, unsigned long line);
+void report_error(fat32_fs *fs, const char *fmt, ...);
+const char* get_image_name(fat32_fs *fs);
+const char* get_current_path(fat32_fs *fs);
+unsigned int cluster_size(fat32_fs *fs);
+unsigned int first_data_sector(fat32_fs *fs);
+unsigned int cluster_to_sector(fat32_fs *fs, unsigned int cluster);
+int read_cluster(fat32_fs *fs, unsigned int cluster, unsigned char *buffer);
+int store_cluster(fat32_fs *fs, unsigned int cluster, const unsigned char *buffer);
+int find_entry(fat32_fs *fs, const char *target, DIR_ENTRY *out);
+unsigned int get_parent_cluster(fat32_fs *fs);
+
+// I/O and allocator counters of a mount, since it was mounted or the
+// counters were last reset. image reads/writes are pread/pwrite calls
+// (memory copies in mmap mode); sendfile calls are counted as reads.
+typedef struct {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    unsigned long fat_lookups;      // FAT entries looked up
+    unsigned long cluster_reads;    // clusters loaded from the image
+    unsigned long cluster_allocs;   // clusters taken from the free pool
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long file_bytes;       // file data handed to write/pwrite
+    unsigned long dirty_bytes;      // cached, not yet written to the image
+} FAT32_STATS;
+
+void fat32_get_stats(fat32_fs *fs, FAT32_STATS *st);
+void fat32_reset_stats(fat32_fs *fs);
+
+// command latencies of a mount, one slot per command of the caller's
+// choosing (the shell numbers its commands). hist[i] counts commands that
+// finished in under 2^i microseconds, the last bucket everything slower.
+// fat32_reset_stats() clears them as well.
+#define FAT32_LAT_BUCKETS 32
+#define FAT32_CMD_SLOTS   32
+
+typedef struct {
+    unsigned long calls;
+    double total;                   // seconds
+    double max;
+    unsigned long hist[FAT32_LAT_BUCKETS];
+} FAT32_CMD_STATS;
+
+void fat32_record_command(fat32_fs *fs, unsigned int slot, double seconds);
+void fat32_get_command_stats(fat32_fs *fs, unsigned int slot, FAT32_CMD_STATS *st);
+
+// tracing: while a trace is open, every physical image access and every
+// command passed to fat32_trace_command() is appended to it with a
+// timestamp. the file starts with FAT32_TRACE_MAGIC and a 32-bit version,
+// followed by 20-byte records (little endian):
+//   u64 time_ns    since the trace started
+//   u64 offset     image offset; for COMMAND_END the duration in us
+//   u32 info       low 28 bits length, top 4 bits record type
+// a COMMAND record is followed by `length` bytes of command line.
+#define FAT32_TRACE_MAGIC   "FAT32TRC"
+#define FAT32_TRACE_VERSION 2
+
+enum {
+    FAT32_TRACE_READ = 1,
+    FAT32_TRACE_WRITE,
+    FAT32_TRACE_SENDFILE,
+    FAT32_TRACE_COMMAND,
+    FAT32_TRACE_COMMAND_END,
+};
+
+typedef struct {
+    int type;
+    unsigned long time_ns;
+    uint64_t offset;
+    unsigned int length;
+} FAT32_TRACE_EVENT;
+
+int fat32_trace_start(fat32_fs *fs, const char *path);
+void fat32_trace_stop(fat32_fs *fs);
+void fat32_trace_command(fat32_fs *fs, const char *line);
+void fat32_trace_command_end(fat32_fs *fs);
+
+// reading a trace back: open checks the header; next returns 1 with the
+// next event (and a command's text, cut to cap - 1 bytes, in text), 0 at
+// the end and -1 on a damaged trace
+FILE *fat32_trace_open(const char *path);
+int fat32_trace_next(FILE *trace, FAT32_TRACE_EVENT *ev, char *text, size_t cap);
+
+// cluster cache
+void cache_set_capacity(fat32_fs *fs, unsigned int slots);
+void cache_get_stats(fat32_fs *fs, unsigned long *hits, unsigned long *misses);
+int cache_flush(fat32_fs *fs);
+
+// main filesystem interface
+fat32_fs *fat32_mount(const char *filename, int flags);
+// unmount and sync return -1 when something could not be written back
+int fat32_unmount(fat32_fs *fs);
+int fat32_sync(fat32_fs *fs);
+int fat_flush(fat32_fs *fs);
+
+// fsck: checks chains, sizes and FAT copies with `threads` workers
+// (0 = one per CPU), printing what it finds to out. returns the number
+// of problems, -1 when the check could not run.
+#define FAT32_FSCK_REPAIR 0x1       // also fix what was found
+#define FAT32_FSCK_VERBOSE 0x2      // also list files with preallocated clusters
+int fat32_fsck(fat32_fs *fs, int flags, unsigned int threads, FILE *out);
+
+// defrag: moves fragmented chains into contiguous free space, printing a
+// summary to out. returns the number of files and directories left
+// fragmented, -1 when it could not run. all files must be closed.
+#define FAT32_DEFRAG_DRY_RUN 0x1    // list fragmented files and plan only
+#define FAT32_DEFRAG_COMPACT 0x2    // pack everything at the start, free space at the end
+int fat32_defrag(fat32_fs *fs, int flags, FILE *out);
+
+// file handles: pread/pwrite-style access to files by path. data goes
+// to and from caller buffers; nothing is printed except through
+// report_error. return -1 on failure.
+int fat32_open(fat32_fs *fs, const char *filename, int mode);
+int fat32_close(fat32_fs *fs, int handle);
+long fat32_pread(fat32_fs *fs, int handle, void *buf, unsigned long len,
+                 unsigned long offset);
+long fat32_pwrite(fat32_fs *fs, int handle, const void *buf, unsigned long len,
+                  unsigned long offset);
+long fat32_size(fat32_fs *fs, int handle);
+
+// shell commands. file and directory names may be absolute or relative
+// paths ("/a/b/c", "../x"); close, lseek, read and write also take "#N"
+// or the bare name of an open file.
+void info_cmd(fat32_fs *fs);
+void ls_cmd(fat32_fs *fs, char *path);
+void cd_cmd(fat32_fs *fs, char *name);
+void creat_cmd(fat32_fs *fs, char *filename);
+void mkdir_cmd(fat32_fs *fs, char *dirname);
+
+// recursive commands over the tree below a directory (NULL = the current
+// one), walked by one thread per CPU; output comes a directory at a time
+// in no particular order. sizes are counted from cluster chains.
+void tree_cmd(fat32_fs *fs, char *path);
+void find_cmd(fat32_fs *fs, char *pattern, char *path);
+void du_cmd(fat32_fs *fs, char *path);
+
+int open_cmd(fat32_fs *fs, char *filename, char *flags);
+void close_cmd(fat32_fs *fs, char *filename);
+void lsof_cmd(fat32_fs *fs);
+void lseek_cmd(fat32_fs *fs, char *filename, unsigned int offset);
+void read_cmd(fat32_fs *fs, char *filename, unsigned int size, FILE *out);
+void fallocate_cmd(fat32_fs *fs, char *filename, unsigned int bytes);
+
+// binary copies between host files and files of the image, in large
+// chunks; each prints its throughput
+void put_cmd(fat32_fs *fs, char *host, char *name);
+void get_cmd(fat32_fs *fs, char *name, char *host);
+// copies a host directory tree into a directory of the image (NULL = the
+// current one): host files are read by parallel threads while one thread
+// allocates, writes and adds the entries
+void import_cmd(fat32_fs *fs, char *host, char *path);
+
+// Part 5 (Update)
+void write_cmd(fat32_fs *fs, char *filename, const char *string);
+void mv_cmd(fat32_fs *fs, char *src, char *dst);
+
+// Part 6 (Delete)
+void rm_cmd(fat32_fs *fs, char *filename);
+void rmdir_cmd(fat32_fs *fs, char *dirname);
+// packs a directory's entries and frees the clusters left empty (NULL =
+// the current directory); removals do this on their own past a threshold
+void compact_cmd(fat32_fs *fs, char *path);
+
+void fsck_cmd(fat32_fs *fs, char *arg);
+void defrag_cmd(fat32_fs *fs, char *arg1, char *arg2);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// positional I/O on the image file descriptor. these live in their own
+// translation unit because <unistd.h> clashes with the command names
+// declared in fat32.h (open, close, lseek, ...).
+//
+// offsets are 64-bit so images past 4 GB are addressed correctly. both
+// calls retry on short transfers and return 0 once all `len` bytes
+// were moved, -1 otherwise.
+int io_pread(int fd, void *buf, size_t len, uint64_t offset);
+int io_pwrite(int fd, const void *buf, size_t len, uint64_t offset);
+
+// copies len bytes at offset of in_fd to out_fd inside the kernel.
+// returns the number of bytes sent, or -1 if nothing could be sent (e.g.
+// the target does not support it) so the caller can fall back.
+long io_sendfile(int out_fd, int in_fd, size_t len, uint64_t offset);
+
+// copies len bytes of fd from offset from to offset to, inside the
+// kernel with copy_file_range() where it can and through a buffer
+// otherwise. the ranges must not overlap. returns 0 on success.
+int io_copy_range(int fd, uint64_t from, uint64_t to, size_t len);
+
+// size of the file behind fd in *size. returns 0 on success, -1 otherwise.
+int io_size(int fd, uint64_t *size);
+
+// copies the whole file behind in_fd to out_fd, skipping holes so sparse
+// images stay sparse. returns 0 on success, -1 otherwise.
+int io_copy_sparse(int in_fd, int out_fd);
+
+// number of system calls made so far by the functions above, across all
+// mounts
+unsigned long io_syscalls(void);
+
+// 1 when fd refers to a terminal
+int io_is_terminal(int fd);
+
+// number of online CPUs, at least 1
+unsigned int io_cpu_count(void);
+
+#endif
@@ -1,15 +1,18 @@
-#pragma once
-
-#include <stdlib.h>
-#include <stdbool.h>
-
-typedef struct {
-    char ** items;
-    size_t size;
-} tokenlist;
-
-char * get_input(void);
-tokenlist * get_tokens(char *input);
-tokenlist * new_tokenlist(void);
-void add_token(tokenlist *tokens, char *item);
-void free_tokens(tokenlist *tokens);
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+typedef struct {
+    char ** items;
+    size_t size;
+} tokenlist;
+
+char * get_input(void);
+long read_line(FILE *in, char **buffer, size_t *cap);
+bool is_interactive(FILE *in);
+tokenlist * get_tokens(char *input);
+tokenlist * new_tokenlist(void);
+void add_token(tokenlist *tokens, char *item);
+void free_tokens(tokenlist *tokens);
@@ -0,0 +1,20 @@
+#ifndef SHELL_H
+#define SHELL_H
+
+#include <stdio.h>
+#include "fat32.h"
+
+// the command interpreter behind the filesys prompt. every command is
+// timed into a per-command latency histogram kept with the mount, and
+// recorded in the mount's trace when one is open.
+
+// runs one input line. returns 1 when the line was "exit", 0 otherwise.
+int shell_execute(fat32_fs *fs, char *line);
+
+// I/O counters of the mount plus the command latency table, as text or
+// as JSON; reset clears both
+void shell_stats_print(fat32_fs *fs, FILE *out);
+void shell_stats_dump(fat32_fs *fs, FILE *out);
+void shell_stats_reset(fat32_fs *fs);
+
+#endif
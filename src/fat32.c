@@ -1,1232 +1,6183 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <ctype.h>
-#include "fat32.h"
-
-#define ATTR_DIRECTORY 0x10
-#define ATTR_ARCHIVE   0x20
-#define FAT32_EOC      0x0FFFFFFF
-
-static FILE *fp = NULL;
-static char *fp_name = NULL;
-static BPB bpb;
-static long image_size = 0;
-static unsigned int current_cluster = 0;
-static char current_path[256] = "/";
-
-OPEN_FILE open_files_table[10];
-
-static unsigned int fat_start_off = 0;
-
-//helpers
-
-const char* get_image_name() {
-    return fp_name;
-}
-
-const char* get_current_path() {
-    return current_path;
-}
-
-unsigned int cluster_size() {
-    return bpb.BPB_BytsPerSec * bpb.BPB_SecPerClus;
-}
-
-unsigned int first_data_sector() {
-    return bpb.BPB_RsvdSecCnt + (bpb.BPB_NumFATs * bpb.BPB_FATSz32);
-}
-
-unsigned int cluster_to_sector(unsigned int cluster) {
-    return first_data_sector() + (cluster - 2) * bpb.BPB_SecPerClus;
-}
-
-void read_cluster(unsigned int cluster, unsigned char *buffer) {
-    unsigned int sector = cluster_to_sector(cluster);
-    unsigned int clusterSize = cluster_size();
-    unsigned int offset = sector * bpb.BPB_BytsPerSec;
-
-    fseek(fp, offset, SEEK_SET);
-    fread(buffer, clusterSize, 1, fp);
-}
-
-static void make_short_name(const char *src, unsigned char dest[11]) {
-    for (int i = 0; i < 11; i++) {
-        dest[i] = ' ';
-    }
-    int i = 0;
-    while (src[i] != '\0' && i < 11) {
-        dest[i] = (unsigned char)toupper((unsigned char)src[i]);
-        i++;
-    }
-}
-
-//fat helpers
-
-static unsigned int fat_get(unsigned int cluster) {
-    unsigned int val;
-    unsigned int offset = fat_start_off + (cluster * 4);
-
-    fseek(fp, offset, SEEK_SET);
-    fread(&val, 4, 1, fp);
-
-    return val & 0x0FFFFFFF;
-}
-
-static void write_cluster(unsigned int cluster, unsigned int next) {
-    // write to all FAT copies
-    for (int i = 0; i < bpb.BPB_NumFATs; i++) {
-        unsigned int fat_base_off =
-            fat_start_off + (i * bpb.BPB_FATSz32 * bpb.BPB_BytsPerSec);
-        unsigned int off = fat_base_off + (cluster * 4);
-        fseek(fp, off, SEEK_SET);
-        fwrite(&next, 4, 1, fp);
-    }
-}
-
-static void fat_free_chain(unsigned int start) {
-    unsigned int cluster = start;
-
-    while (cluster >= 2) {
-        unsigned int next = fat_get(cluster);
-        // mark as free
-        write_cluster(cluster, 0x00000000);
-
-        if (next == 0 || next >= 0x0FFFFFF8) {
-            break;
-        }
-        cluster = next;
-    }
-}
-
-// find a free FAT entry (cluster >= 2), returns 0 if none
-unsigned int find_new_cluster() {
-    unsigned int bytes_per_fat = bpb.BPB_FATSz32 * bpb.BPB_BytsPerSec;
-    unsigned int entries = bytes_per_fat / 4;
-
-    for (unsigned int i = 2; i < entries; i++) {
-        unsigned int offset = fat_start_off + (i * 4);
-        unsigned int val;
-        fseek(fp, offset, SEEK_SET);
-        fread(&val, 4, 1, fp);
-
-        if ((val & 0x0FFFFFFF) == 0) {
-            return i;
-        }
-    }
-    return 0;
-}
-
-//directory helpers
-
-int is_valid_entry(DIR_ENTRY *entry) {
-    if (entry->DIR_Name[0] == 0x00) {
-        return 0;
-    }
-    if (entry->DIR_Attr == 0x0F) { 
-        return 0;
-    }
-    if (entry->DIR_Name[0] == 0xE5) { 
-        return 0;
-    }
-    if (entry->DIR_Name[0] == 0x5E) { 
-        return 0;
-    }
-    return 1;
-}
-
-DIR_ENTRY* find_entry(const char *target) {
-    unsigned int size = cluster_size();
-    unsigned char *buffer = malloc(size);
-    if (!buffer) return NULL;
-
-    read_cluster(current_cluster, buffer);
-    DIR_ENTRY *entries = (DIR_ENTRY *)buffer;
-    int num = size / (int)sizeof(DIR_ENTRY);
-
-    static DIR_ENTRY result;
-
-    for (int i = 0; i < num; i++) {
-        if (!is_valid_entry(&entries[i])) continue;
-
-        char name[12];
-        memcpy(name, entries[i].DIR_Name, 11);
-        name[11] = '\0';
-
-        for (int j = 10; j >= 0; j--) {
-            if (name[j] == ' ') name[j] = '\0';
-            else break;
-        }
-
-        if (strcmp(name, target) == 0) {
-            memcpy(&result, &entries[i], sizeof(DIR_ENTRY));
-            free(buffer);
-            return &result;
-        }
-    }
-
-    free(buffer);
-    return NULL;
-}
-
-unsigned int get_parent_cluster() {
-    unsigned int size = cluster_size();
-    unsigned char *buffer = malloc(size);
-    if (!buffer) return 0;
-
-    read_cluster(current_cluster, buffer);
-    DIR_ENTRY *entries = (DIR_ENTRY *)buffer;
-    DIR_ENTRY *parent_entry = &entries[1]; 
-    unsigned int parent_cluster =
-        ((unsigned int) parent_entry->DIR_FstClusHI << 16) |
-         parent_entry->DIR_FstClusLO;
-
-    free(buffer);
-    if (parent_cluster == 0) {
-        return bpb.BPB_RootClus;
-    }
-    return parent_cluster;
-}
-
-//mount
-
-int fat32_mount(const char *filename) {
-    if ((fp = fopen(filename, "rb+")) == NULL) {
-        return -1;
-    }
-
-    fp_name = malloc(strlen(filename) + 1);
-    if (!fp_name) {
-        fclose(fp);
-        fp = NULL;
-        return -1;
-    }
-    strcpy(fp_name, filename);
-
-    // read BPB
-    fseek(fp, 0, SEEK_END);
-    image_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    fread(&bpb, sizeof(BPB), 1, fp);
-
-    // set current directory to root
-    current_cluster = bpb.BPB_RootClus;
-    fat_start_off = bpb.BPB_RsvdSecCnt * bpb.BPB_BytsPerSec;
-
-    // initialize open file table
-    for (int i = 0; i < 10; i++) {
-        open_files_table[i].using = 0;
-        memset(open_files_table[i].name, 0, sizeof(open_files_table[i].name));
-        open_files_table[i].cluster = 0;
-        open_files_table[i].offset = 0;
-        open_files_table[i].mode = 0;
-        memset(open_files_table[i].path, 0, sizeof(open_files_table[i].path));
-    }
-
-    return 0;
-}
-
-void fat32_unmount() {
-    if (fp) {
-        fclose(fp);
-        fp = NULL;
-    }
-    if (fp_name) {
-        free(fp_name);
-        fp_name = NULL;
-    }
-}
-
-//commands
-
-void info() {
-    printf("Root cluster: %u\n", bpb.BPB_RootClus);
-    printf("Bytes per sector: %u\n", bpb.BPB_BytsPerSec);
-    printf("Sectors per cluster: %u\n", bpb.BPB_SecPerClus);
-
-    int dataSectors =
-        (int)bpb.BPB_TotSec32 -
-        (int)(bpb.BPB_RsvdSecCnt + bpb.BPB_NumFATs * bpb.BPB_FATSz32);
-    int totalClusters = dataSectors / bpb.BPB_SecPerClus;
-    printf("Total clusters in data region: %u\n", totalClusters);
-
-    unsigned int entriesPerFAT =
-        (bpb.BPB_FATSz32 * bpb.BPB_BytsPerSec) / 4;
-    printf("# of entries in one FAT: %u\n", entriesPerFAT);
-
-    printf("Size of image (bytes): %ld\n", image_size);
-}
-
-void ls() {
-    unsigned int size = cluster_size();
-    unsigned char *buffer = malloc(size);
-    if (!buffer) {
-        printf("Error: could not allocate memory for ls.\n");
-        return;
-    }
-
-    read_cluster(current_cluster, buffer);
-    DIR_ENTRY *entries = (DIR_ENTRY *)buffer;
-    int num = size / (int)sizeof(DIR_ENTRY);
-
-    for (int i = 0; i < num; i++) {
-        if (!is_valid_entry(&entries[i])) continue;
-
-        char name[12];
-        memcpy(name, entries[i].DIR_Name, 11);
-        name[11] = '\0';
-
-        for (int j = 10; j >= 0; j--) {
-            if (name[j] == ' ') name[j] = '\0';
-            else break;
-        }
-
-        printf("%s\n", name);
-    }
-
-    free(buffer);
-}
-
-void cd(char *name) {
-    if (!name) {
-        printf("Error: cd needs a directory name.\n");
-        return;
-    }
-
-    if (strcmp(name, "..") == 0) {
-        if (current_cluster == bpb.BPB_RootClus) {
-            return;
-        }
-
-        unsigned int parent = get_parent_cluster();
-        current_cluster = parent;
-
-        int len = (int)strlen(current_path);
-        if (len > 1 && current_path[len - 1] == '/') {
-            current_path[len - 1] = '\0';
-            len--;
-        }
-
-        for (int i = len - 1; i >= 0; i--) {
-            if (current_path[i] == '/') {
-                current_path[i + 1] = '\0';
-                break;
-            }
-        }
-        return;
-    }
-
-    DIR_ENTRY *e = find_entry(name);
-    if (!e) {
-        printf("Error: directory not found.\n");
-        return;
-    }
-
-    if ((e->DIR_Attr & ATTR_DIRECTORY) == 0) {
-        printf("Error: %s is not a directory.\n", name);
-        return;
-    }
-
-    unsigned int clus =
-        ((unsigned int)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO;
-
-    if (clus == 0) {
-        printf("Error: invalid directory.\n");
-        return;
-    }
-
-    current_cluster = clus;
-    strcat(current_path, name);
-    strcat(current_path, "/");
-}
-
-void mkdir(char *dirname) {
-    if (!dirname) {
-        printf("Error: mkdir needs a name.\n");
-        return;
-    }
-
-    unsigned int size = cluster_size();
-    unsigned char *buffer = malloc(size);
-    if (!buffer) {
-        printf("Error: could not allocate memory for mkdir.\n");
-        return;
-    }
-
-    read_cluster(current_cluster, buffer);
-    DIR_ENTRY *entries = (DIR_ENTRY *)buffer;
-
-    unsigned char short_dirname[11];
-    make_short_name(dirname, short_dirname);
-
-    int num = size / (int)sizeof(DIR_ENTRY);
-    int name_exists = 0;
-    for (int i = 0; i < num; i++) {
-        if (entries[i].DIR_Name[0] == 0x00) break;
-        if (memcmp(short_dirname, entries[i].DIR_Name, 11) == 0) {
-            printf("Error: name already exists in directory.\n");
-            name_exists = 1;
-            break;
-        }
-    }
-
-    if (name_exists) {
-        free(buffer);
-        return;
-    }
-
-    int free_index = -1;
-    for (int i = 0; i < num; i++) {
-        if (entries[i].DIR_Name[0] == 0x00 ||
-            entries[i].DIR_Name[0] == 0x5E ||
-            entries[i].DIR_Name[0] == 0xE5) {
-            free_index = i;
-            break;
-        }
-    }
-
-    if (free_index < 0) {
-        printf("Error: no space in directory.\n");
-        free(buffer);
-        return;
-    }
-
-    DIR_ENTRY *entry = &entries[free_index];
-    memcpy(entry->DIR_Name, short_dirname, 11);
-    entry->DIR_Attr = ATTR_DIRECTORY;
-
-    unsigned int my_cluster = find_new_cluster();
-    if (my_cluster == 0) {
-        printf("Error: no free clusters for directory.\n");
-        free(buffer);
-        return;
-    }
-    write_cluster(my_cluster, FAT32_EOC);
-
-    entry->DIR_FstClusHI = (unsigned short)(my_cluster >> 16);
-    entry->DIR_FstClusLO = (unsigned short)(my_cluster & 0xFFFF);
-    entry->DIR_FileSize  = 0;
-
-    unsigned int sector2 = cluster_to_sector(current_cluster);
-    unsigned int offset2 = sector2 * bpb.BPB_BytsPerSec;
-    fseek(fp, offset2, SEEK_SET);
-    fwrite(buffer, size, 1, fp);
-    free(buffer);
-
-    unsigned int size2 = cluster_size();
-    unsigned char *buffer2 = calloc(1, size2);
-    DIR_ENTRY *entries2 = (DIR_ENTRY *)buffer2;
-
-    unsigned char dot[11];
-    memset(dot, ' ', 11);
-    dot[0] = '.';
-
-    DIR_ENTRY *entry2 = &entries2[0];
-    memcpy(entry2->DIR_Name, dot, 11);
-    entry2->DIR_Attr      = ATTR_DIRECTORY;
-    entry2->DIR_FstClusHI = (unsigned short)(my_cluster >> 16);
-    entry2->DIR_FstClusLO = (unsigned short)(my_cluster & 0xFFFF);
-    entry2->DIR_FileSize  = 0;
-
-    unsigned char dot2[11];
-    memset(dot2, ' ', 11);
-    dot2[0] = '.';
-    dot2[1] = '.';
-
-    DIR_ENTRY *entry3 = &entries2[1];
-    memcpy(entry3->DIR_Name, dot2, 11);
-    entry3->DIR_Attr      = ATTR_DIRECTORY;
-    entry3->DIR_FstClusHI = (unsigned short)(current_cluster >> 16);
-    entry3->DIR_FstClusLO = (unsigned short)(current_cluster & 0xFFFF);
-    entry3->DIR_FileSize  = 0;
-
-    unsigned int sector3 = cluster_to_sector(my_cluster);
-    unsigned int offset3 = sector3 * bpb.BPB_BytsPerSec;
-    fseek(fp, offset3, SEEK_SET);
-    fwrite(buffer2, size2, 1, fp);
-    free(buffer2);
-}
-
-void creat(char *filename) {
-    if (!filename) {
-        printf("Error: creat needs a filename.\n");
-        return;
-    }
-
-    unsigned int size = cluster_size();
-    unsigned char *buffer = malloc(size);
-    if (!buffer) {
-        printf("Error: could not allocate memory for creat.\n");
-        return;
-    }
-
-    unsigned char short_filename[11];
-    make_short_name(filename, short_filename);
-
-    read_cluster(current_cluster, buffer);
-    DIR_ENTRY *entries = (DIR_ENTRY *)buffer;
-    int num = size / (int)sizeof(DIR_ENTRY);
-
-    int file_exists = 0;
-    for (int i = 0; i < num; i++) {
-        if (entries[i].DIR_Name[0] == 0x00) break;
-        if (memcmp(short_filename, entries[i].DIR_Name, 11) == 0) {
-            printf("Error: filename already exists here.\n");
-            file_exists = 1;
-            break;
-        }
-    }
-
-    if (file_exists) {
-        free(buffer);
-        return;
-    }
-
-    int free_index = -1;
-    for (int i = 0; i < num; i++) {
-        if (entries[i].DIR_Name[0] == 0x00 ||
-            entries[i].DIR_Name[0] == 0x5E ||
-            entries[i].DIR_Name[0] == 0xE5) {
-            free_index = i;
-            break;
-        }
-    }
-
-    if (free_index < 0) {
-        printf("Error: no space in directory.\n");
-        free(buffer);
-        return;
-    }
-
-    DIR_ENTRY *entry = &entries[free_index];
-    memcpy(entry->DIR_Name, short_filename, 11);
-    entry->DIR_Attr = ATTR_ARCHIVE;
-    entry->DIR_FstClusHI = 0;
-    entry->DIR_FstClusLO = 0;
-    entry->DIR_FileSize  = 0;
-
-    unsigned int sector = cluster_to_sector(current_cluster);
-    unsigned int offset = sector * bpb.BPB_BytsPerSec;
-    fseek(fp, offset, SEEK_SET);
-    fwrite(buffer, size, 1, fp);
-    free(buffer);
-}
-
-void open(char *filename, char *flags) {
-    if (!filename || !flags) {
-        printf("Error: open needs filename and flags.\n");
-        return;
-    }
-
-    unsigned int size = cluster_size();
-    unsigned char *buffer = malloc(size);
-    if (!buffer) {
-        printf("Error: could not allocate memory for open.\n");
-        return;
-    }
-
-    unsigned char short_filename[11];
-    make_short_name(filename, short_filename);
-
-    read_cluster(current_cluster, buffer);
-    DIR_ENTRY *entries = (DIR_ENTRY *)buffer;
-    DIR_ENTRY *cur_entry = NULL;
-    int num = size / (int)sizeof(DIR_ENTRY);
-    int file_exists = 0;
-
-    for (int i = 0; i < num; i++) {
-        if (!is_valid_entry(&entries[i])) continue;
-        if (memcmp(short_filename, entries[i].DIR_Name, 11) == 0) {
-            cur_entry = &entries[i];
-            file_exists = 1;
-            break;
-        }
-    }
-
-    if (!file_exists) {
-        printf("Error: file does not exist.\n");
-        free(buffer);
-        return;
-    }
-
-    if (cur_entry->DIR_Attr & ATTR_DIRECTORY) {
-        printf("Error: cannot open a directory.\n");
-        free(buffer);
-        return;
-    }
-
-    for (int i = 0; i < 10; i++) {
-        if (open_files_table[i].using &&
-            memcmp(open_files_table[i].name, short_filename, 11) == 0) {
-            printf("Error: file already open.\n");
-            free(buffer);
-            return;
-        }
-    }
-
-    int idx = -1;
-    for (int i = 0; i < 10; i++) {
-        if (!open_files_table[i].using) {
-            idx = i;
-            break;
-        }
-    }
-
-    if (idx < 0) {
-        printf("Error: open file table full.\n");
-        free(buffer);
-        return;
-    }
-
-    open_files_table[idx].using = 1;
-    memcpy(open_files_table[idx].name, short_filename, 11);
-    open_files_table[idx].name[11] = '\0';
-
-    unsigned int hi = cur_entry->DIR_FstClusHI;
-    unsigned int lo = cur_entry->DIR_FstClusLO;
-    open_files_table[idx].cluster = (hi << 16) | lo;
-    open_files_table[idx].offset = 0;
-
-    if (strcmp(flags, "-r") == 0) {
-        open_files_table[idx].mode = 0;
-    } else if (strcmp(flags, "-w") == 0) {
-        open_files_table[idx].mode = 1;
-    } else if (strcmp(flags, "-rw") == 0 || strcmp(flags, "-wr") == 0) {
-        open_files_table[idx].mode = 2;
-    } else {
-        printf("Error: invalid mode.\n");
-        open_files_table[idx].using = 0;
-        free(buffer);
-        return;
-    }
-
-    // store path at time of open
-    strncpy(open_files_table[idx].path, get_current_path(),
-            sizeof(open_files_table[idx].path) - 1);
-    open_files_table[idx].path[sizeof(open_files_table[idx].path) - 1] = '\0';
-
-    free(buffer);
-}
-
-void close(char *filename) {
-    if (!filename) {
-        printf("Error: close needs filename.\n");
-        return;
-    }
-
-    unsigned char short_filename[11];
-    make_short_name(filename, short_filename);
-
-    for (int i = 0; i < 10; i++) {
-        if (open_files_table[i].using &&
-            memcmp(open_files_table[i].name, short_filename, 11) == 0) {
-            open_files_table[i].using = 0;
-            memset(open_files_table[i].name, 0, sizeof(open_files_table[i].name));
-            open_files_table[i].cluster = 0;
-            open_files_table[i].offset = 0;
-            open_files_table[i].mode = 0;
-            memset(open_files_table[i].path, 0, sizeof(open_files_table[i].path));
-            return;
-        }
-    }
-
-    printf("Error: file not open.\n");
-}
-
-void lsof() {
-    int any = 0;
-    for (int i = 0; i < 10; i++) {
-        if (open_files_table[i].using) {
-            any = 1;
-            printf("index: %d | ", i);
-            printf("name: %s | ", open_files_table[i].name);
-            printf("cluster: %u | ", open_files_table[i].cluster);
-            printf("mode: %d | ", open_files_table[i].mode);
-            printf("offset: %u | ", open_files_table[i].offset);
-            printf("Path: %s\n", open_files_table[i].path);
-        }
-    }
-    if (!any) {
-        printf("No files are currently open.\n");
-    }
-}
-
-void lseek(char *filename, unsigned int offset) {
-    if (!filename) {
-        printf("Error: lseek needs a filename.\n");
-        return;
-    }
-
-    unsigned char short_filename[11];
-    make_short_name(filename, short_filename);
-
-    for (int i = 0; i < 10; i++) {
-        if (open_files_table[i].using &&
-            memcmp(open_files_table[i].name, short_filename, 11) == 0) {
-            open_files_table[i].offset = offset;
-            return;
-        }
-    }
-
-    printf("Error: file not open.\n");
-}
-
-//write and mv
-
-void write_cmd(char *filename, const char *string) {
-    if (!filename || !string) {
-        printf("Error: write requires a filename and a string.\n");
-        return;
-    }
-
-    unsigned char short_filename[11];
-    make_short_name(filename, short_filename);
-
-    int of_idx = -1;
-    for (int i = 0; i < 10; i++) {
-        if (open_files_table[i].using &&
-            memcmp(open_files_table[i].name, short_filename, 11) == 0) {
-            of_idx = i;
-            break;
-        }
-    }
-
-    if (of_idx < 0) {
-        printf("Error: file is not opened.\n");
-        return;
-    }
-
-    OPEN_FILE *of = &open_files_table[of_idx];
-    if (of->mode != 1 && of->mode != 2) {
-        printf("Error: file not opened for writing.\n");
-        return;
-    }
-
-    unsigned int size = cluster_size();
-    unsigned char *buffer = malloc(size);
-    if (!buffer) {
-        printf("Error: could not allocate memory for write.\n");
-        return;
-    }
-
-    read_cluster(current_cluster, buffer);
-    DIR_ENTRY *entries = (DIR_ENTRY *)buffer;
-    int num = size / (int)sizeof(DIR_ENTRY);
-    DIR_ENTRY *entry = NULL;
-
-    for (int i = 0; i < num; i++) {
-        if (!is_valid_entry(&entries[i])) continue;
-        if (memcmp(entries[i].DIR_Name, short_filename, 11) == 0) {
-            entry = &entries[i];
-            break;
-        }
-    }
-
-    if (!entry) {
-        printf("Error: file not found in current directory.\n");
-        free(buffer);
-        return;
-    }
-
-    if (entry->DIR_Attr & ATTR_DIRECTORY) {
-        printf("Error: cannot write to a directory.\n");
-        free(buffer);
-        return;
-    }
-
-    unsigned int first_cluster =
-        ((unsigned int)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
-    unsigned int file_size = entry->DIR_FileSize;
-
-    if (first_cluster == 0) {
-        unsigned int new_cluster = find_new_cluster();
-        if (new_cluster == 0) {
-            printf("Error: no free clusters for file data.\n");
-            free(buffer);
-            return;
-        }
-        write_cluster(new_cluster, FAT32_EOC);
-        first_cluster = new_cluster;
-
-        entry->DIR_FstClusHI = (unsigned short)(new_cluster >> 16);
-        entry->DIR_FstClusLO = (unsigned short)(new_cluster & 0xFFFF);
-        of->cluster = new_cluster;
-    }
-
-    unsigned int clus_size = cluster_size();
-    unsigned int offset = of->offset;
-    unsigned int len = (unsigned int)strlen(string);
-    unsigned int remaining = len;
-    unsigned int file_offset_after = offset;
-
-    unsigned int cluster = first_cluster;
-    unsigned int cluster_index = offset / clus_size;
-    unsigned int in_cluster_offset = offset % clus_size;
-
-    for (unsigned int k = 0; k < cluster_index; k++) {
-        unsigned int next = fat_get(cluster);
-        if (next >= 0x0FFFFFF8 || next == FAT32_EOC) {
-            unsigned int new_cluster = find_new_cluster();
-            if (new_cluster == 0) {
-                printf("Error: no free clusters while extending file.\n");
-                free(buffer);
-                return;
-            }
-            write_cluster(new_cluster, FAT32_EOC);
-            write_cluster(cluster, new_cluster);
-            cluster = new_cluster;
-        } else {
-            cluster = next;
-        }
-    }
-
-    const char *p = string;
-    while (remaining > 0) {
-        unsigned int sector = cluster_to_sector(cluster);
-        unsigned int cluster_byte_offset = sector * bpb.BPB_BytsPerSec;
-        unsigned int space = clus_size - in_cluster_offset;
-        unsigned int to_write = (remaining < space) ? remaining : space;
-
-        fseek(fp, cluster_byte_offset + in_cluster_offset, SEEK_SET);
-        fwrite(p, 1, to_write, fp);
-
-        p += to_write;
-        remaining -= to_write;
-        file_offset_after += to_write;
-        in_cluster_offset = 0;
-
-        if (remaining > 0) {
-            unsigned int next = fat_get(cluster);
-            if (next >= 0x0FFFFFF8 || next == FAT32_EOC) {
-                unsigned int new_cluster = find_new_cluster();
-                if (new_cluster == 0) {
-                    printf("Error: no free clusters while extending file.\n");
-                    free(buffer);
-                    return;
-                }
-                write_cluster(new_cluster, FAT32_EOC);
-                write_cluster(cluster, new_cluster);
-                cluster = new_cluster;
-            } else {
-                cluster = next;
-            }
-        }
-    }
-
-    of->offset = file_offset_after;
-    if (file_offset_after > file_size) {
-        entry->DIR_FileSize = file_offset_after;
-    }
-
-    unsigned int sector = cluster_to_sector(current_cluster);
-    unsigned int off = sector * bpb.BPB_BytsPerSec;
-    fseek(fp, off, SEEK_SET);
-    fwrite(buffer, size, 1, fp);
-
-    free(buffer);
-}
-
-void mv_cmd(char *src, char *dst) {
-    if (!src || !dst) {
-        printf("Error: mv requires source and destination.\n");
-        return;
-    }
-
-    unsigned char src_short[11];
-    unsigned char dst_short[11];
-    make_short_name(src, src_short);
-    make_short_name(dst, dst_short);
-
-    for (int i = 0; i < 10; i++) {
-        if (open_files_table[i].using &&
-            memcmp(open_files_table[i].name, src_short, 11) == 0) {
-            printf("Error: file must be closed before mv.\n");
-            return;
-        }
-    }
-
-    unsigned int size = cluster_size();
-    unsigned char *buffer = malloc(size);
-    if (!buffer) {
-        printf("Error: could not allocate memory for mv.\n");
-        return;
-    }
-
-    read_cluster(current_cluster, buffer);
-    DIR_ENTRY *entries = (DIR_ENTRY *)buffer;
-    int num = size / (int)sizeof(DIR_ENTRY);
-
-    int src_idx = -1;
-    for (int i = 0; i < num; i++) {
-        if (!is_valid_entry(&entries[i])) continue;
-        if (memcmp(entries[i].DIR_Name, src_short, 11) == 0) {
-            src_idx = i;
-            break;
-        }
-    }
-
-    if (src_idx < 0) {
-        printf("Error: source does not exist.\n");
-        free(buffer);
-        return;
-    }
-
-    DIR_ENTRY *src_entry = &entries[src_idx];
-
-    int dst_idx = -1;
-    for (int i = 0; i < num; i++) {
-        if (!is_valid_entry(&entries[i])) continue;
-        if (memcmp(entries[i].DIR_Name, dst_short, 11) == 0) {
-            dst_idx = i;
-            break;
-        }
-    }
-
-    if (dst_idx >= 0) {
-        // destination exists
-        DIR_ENTRY *dst_entry = &entries[dst_idx];
-        if (!(dst_entry->DIR_Attr & ATTR_DIRECTORY)) {
-            printf("Error: destination is not a directory.\n");
-            free(buffer);
-            return;
-        }
-
-        unsigned int dest_cluster =
-            ((unsigned int)dst_entry->DIR_FstClusHI << 16) |
-             dst_entry->DIR_FstClusLO;
-        if (dest_cluster == 0) {
-            printf("Error: invalid destination directory.\n");
-            free(buffer);
-            return;
-        }
-
-        unsigned int dsize = cluster_size();
-        unsigned char *dbuf = malloc(dsize);
-        if (!dbuf) {
-            printf("Error: could not allocate memory for mv dest.\n");
-            free(buffer);
-            return;
-        }
-
-        read_cluster(dest_cluster, dbuf);
-        DIR_ENTRY *dentries = (DIR_ENTRY *)dbuf;
-        int dnum = dsize / (int)sizeof(DIR_ENTRY);
-
-        for (int j = 0; j < dnum; j++) {
-            if (!is_valid_entry(&dentries[j])) continue;
-            if (memcmp(dentries[j].DIR_Name, src_entry->DIR_Name, 11) == 0) {
-                printf("Error: name already exists in destination directory.\n");
-                free(dbuf);
-                free(buffer);
-                return;
-            }
-        }
-
-        int dfree = -1;
-        for (int j = 0; j < dnum; j++) {
-            if (dentries[j].DIR_Name[0] == 0x00 ||
-                dentries[j].DIR_Name[0] == 0x5E ||
-                dentries[j].DIR_Name[0] == 0xE5) {
-                dfree = j;
-                break;
-            }
-        }
-
-        if (dfree < 0) {
-            printf("Error: no space in destination directory.\n");
-            free(dbuf);
-            free(buffer);
-            return;
-        }
-
-        memcpy(&dentries[dfree], src_entry, sizeof(DIR_ENTRY));
-
-        unsigned int dsector = cluster_to_sector(dest_cluster);
-        unsigned int doff = dsector * bpb.BPB_BytsPerSec;
-        fseek(fp, doff, SEEK_SET);
-        fwrite(dbuf, dsize, 1, fp);
-        free(dbuf);
-
-        int has_after = 0;
-        for (int j = src_idx + 1; j < num; j++) {
-            if (entries[j].DIR_Name[0] != 0x00) {
-                has_after = 1;
-                break;
-            }
-        }
-        entries[src_idx].DIR_Name[0] = has_after ? 0x5E : 0x00;
-
-        unsigned int sector = cluster_to_sector(current_cluster);
-        unsigned int off = sector * bpb.BPB_BytsPerSec;
-        fseek(fp, off, SEEK_SET);
-        fwrite(buffer, size, 1, fp);
-        free(buffer);
-    } else {
-        // rename
-        memcpy(src_entry->DIR_Name, dst_short, 11);
-
-        unsigned int sector = cluster_to_sector(current_cluster);
-        unsigned int off = sector * bpb.BPB_BytsPerSec;
-        fseek(fp, off, SEEK_SET);
-        fwrite(buffer, size, 1, fp);
-        free(buffer);
-    }
-}
-
-//RM and RMDIR
-
-void rm_cmd(char *filename) {
-    if (!filename) {
-        printf("Error: rm requires a filename.\n");
-        return;
-    }
-
-    unsigned char short_filename[11];
-    make_short_name(filename, short_filename);
-
-    for (int i = 0; i < 10; i++) {
-        if (open_files_table[i].using &&
-            memcmp(open_files_table[i].name, short_filename, 11) == 0) {
-            printf("Error: cannot rm an open file.\n");
-            return;
-        }
-    }
-
-    unsigned int size = cluster_size();
-    unsigned char *buffer = malloc(size);
-    if (!buffer) {
-        printf("Error: could not allocate memory for rm.\n");
-        return;
-    }
-
-    read_cluster(current_cluster, buffer);
-    DIR_ENTRY *entries = (DIR_ENTRY *)buffer;
-    int num = size / (int)sizeof(DIR_ENTRY);
-
-    int idx = -1;
-    for (int i = 0; i < num; i++) {
-        if (!is_valid_entry(&entries[i])) continue;
-        if (memcmp(entries[i].DIR_Name, short_filename, 11) == 0) {
-            idx = i;
-            break;
-        }
-    }
-
-    if (idx < 0) {
-        printf("Error: file does not exist.\n");
-        free(buffer);
-        return;
-    }
-
-    DIR_ENTRY *entry = &entries[idx];
-    if (entry->DIR_Attr & ATTR_DIRECTORY) {
-        printf("Error: rm target is a directory (use rmdir).\n");
-        free(buffer);
-        return;
-    }
-
-    unsigned int first_cluster =
-        ((unsigned int)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
-    if (first_cluster != 0) {
-        fat_free_chain(first_cluster);
-    }
-
-    int has_after = 0;
-    for (int j = idx + 1; j < num; j++) {
-        if (entries[j].DIR_Name[0] != 0x00) {
-            has_after = 1;
-            break;
-        }
-    }
-    entries[idx].DIR_Name[0] = has_after ? 0x5E : 0x00;
-
-    unsigned int sector = cluster_to_sector(current_cluster);
-    unsigned int off = sector * bpb.BPB_BytsPerSec;
-    fseek(fp, off, SEEK_SET);
-    fwrite(buffer, size, 1, fp);
-
-    free(buffer);
-}
-
-void rmdir_cmd(char *dirname) {
-    if (!dirname) {
-        printf("Error: rmdir requires a directory name.\n");
-        return;
-    }
-
-    unsigned char short_dirname[11];
-    make_short_name(dirname, short_dirname);
-
-    unsigned int size = cluster_size();
-    unsigned char *buffer = malloc(size);
-    if (!buffer) {
-        printf("Error: could not allocate memory for rmdir.\n");
-        return;
-    }
-
-    read_cluster(current_cluster, buffer);
-    DIR_ENTRY *entries = (DIR_ENTRY *)buffer;
-    int num = size / (int)sizeof(DIR_ENTRY);
-
-    int idx = -1;
-    for (int i = 0; i < num; i++) {
-        if (!is_valid_entry(&entries[i])) continue;
-        if (memcmp(entries[i].DIR_Name, short_dirname, 11) == 0) {
-            idx = i;
-            break;
-        }
-    }
-
-    if (idx < 0) {
-        printf("Error: directory does not exist.\n");
-        free(buffer);
-        return;
-    }
-
-    DIR_ENTRY *entry = &entries[idx];
-
-    if (!(entry->DIR_Attr & ATTR_DIRECTORY)) {
-        printf("Error: rmdir target is not a directory.\n");
-        free(buffer);
-        return;
-    }
-
-    // check if any file is open in that directory
-    char dir_path[256];
-    snprintf(dir_path, sizeof(dir_path), "%s%s/", get_current_path(), dirname);
-
-    for (int i = 0; i < 10; i++) {
-        if (open_files_table[i].using &&
-            strcmp(open_files_table[i].path, dir_path) == 0) {
-            printf("Error: a file is opened in that directory.\n");
-            free(buffer);
-            return;
-        }
-    }
-
-    unsigned int dir_cluster =
-        ((unsigned int)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
-
-    if (dir_cluster != 0) {
-        unsigned int dsize = cluster_size();
-        unsigned char *dbuf = malloc(dsize);
-        if (!dbuf) {
-            printf("Error: could not allocate memory for rmdir.\n");
-            free(buffer);
-            return;
-        }
-
-        read_cluster(dir_cluster, dbuf);
-        DIR_ENTRY *dentries = (DIR_ENTRY *)dbuf;
-        int dnum = dsize / (int)sizeof(DIR_ENTRY);
-
-        for (int j = 0; j < dnum; j++) {
-            if (!is_valid_entry(&dentries[j])) continue;
-
-            char name[12];
-            memcpy(name, dentries[j].DIR_Name, 11);
-            name[11] = '\0';
-            for (int k = 10; k >= 0; k--) {
-                if (name[k] == ' ') name[k] = '\0';
-                else break;
-            }
-
-            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
-                printf("Error: directory not empty.\n");
-                free(dbuf);
-                free(buffer);
-                return;
-            }
-        }
-
-        free(dbuf);
-        fat_free_chain(dir_cluster);
-    }
-
-    int has_after = 0;
-    for (int j = idx + 1; j < num; j++) {
-        if (entries[j].DIR_Name[0] != 0x00) {
-            has_after = 1;
-            break;
-        }
-    }
-    entries[idx].DIR_Name[0] = has_after ? 0x5E : 0x00;
-
-    unsigned int sector = cluster_to_sector(current_cluster);
-    unsigned int off = sector * bpb.BPB_BytsPerSec;
-    fseek(fp, off, SEEK_SET);
-    fwrite(buffer, size, 1, fp);
-
-    free(buffer);
-}
-
-void read(char *filename, unsigned int size) {
-    char short_filename[11];
-    for (int i = 0; i < 11; i++) {
-        short_filename[i] = ' ';
-    }
-    int i = 0;
-    while (filename[i] != '\0') {
-        short_filename[i] = toupper(filename[i]);
-        i += 1;
-    }
-    i = 0;
-    while (i < 10) {
-        if (memcmp(open_files_table[i].name, short_filename, 11) == 0 && open_files_table[i].using == 1) {
-            break;
-        }
-        i++;
-    }
-    if (i == 10) {
-        return;
-    }
-    unsigned int cluster_siz = cluster_size();
-    unsigned int first_cluster = open_files_table[i].cluster;
-    unsigned int offset_in_clust = open_files_table[i].offset % cluster_siz;
-    
-    unsigned int actual_offset = open_files_table[i].offset;
-    unsigned int total_bytes = size;
-    unsigned int cluster_index = actual_offset/ cluster_siz;
-
-    unsigned int cur_clust = first_cluster;
-    
-    for (unsigned int ii = 0; ii < cluster_index; ii++) {
-        unsigned int n = fat_get(cur_clust);
-        if (n == 0 || n == 0x0FFFFFFF) {
-            return;
-        }
-        cur_clust = n;
-    }
-
-    unsigned char *buffer = malloc(cluster_siz);
-    while (total_bytes > 0) {
-        read_cluster(cur_clust, buffer);
-
-        unsigned int space = cluster_siz - offset_in_clust;
-        unsigned int bytes = 0;
-        if (total_bytes < space) {
-            bytes = total_bytes;
-        }
-        else {
-            bytes = space;
-        }
-        for (unsigned int j = 0; j < bytes; j++) {
-            putchar(buffer[offset_in_clust + j]);
-        }
-        total_bytes -= bytes;
-        actual_offset += bytes;
-
-        offset_in_clust = 0;
-
-        if (total_bytes > 0) {
-            unsigned int n = fat_get(cur_clust);
-                if (n == 0x0FFFFFFF) {
-                    break;
-                }
-                cur_clust = n;
-            }
-        }
-    free(buffer);
-    open_files_table[i].offset = actual_offset;
-    return;
-}
\ No newline at end of file
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "fat32.h"
+#include "image_io.h"
+
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE   0x20
+#define FAT32_EOC      0x0FFFFFFF
+
+#define CACHE_DEFAULT_SLOTS 64
+#define CACHE_NO_CLUSTER    0xFFFFFFFF
+
+// largest single transfer used for bulk file data
+#define IO_MAX_CHUNK        (16u << 20)
+// reads at least this large are sent to pipes/files with sendfile()
+#define IO_SENDFILE_MIN     (64u << 10)
+
+// FSInfo sector signatures
+#define FSI_LEAD_SIG   0x41615252
+#define FSI_STRUC_SIG  0x61417272
+#define FSI_TRAIL_SIG  0xAA550000
+#define FSI_UNKNOWN    0xFFFFFFFF
+
+// free runs examined by alloc_run() before settling for the longest one
+#define ALLOC_MAX_PROBES 1024
+
+// directories share this many reader-writer locks, picked by first cluster
+// (at most 64: dir_lock_set() keeps the stripes it took in a bit mask)
+#define DIR_LOCK_STRIPES 64
+
+// longest path, in the canonical form kept in current_path
+#define PATH_MAX_LEN 256
+
+// run of physically contiguous clusters in a file's chain
+typedef struct {
+    unsigned int file_index;    // position of the run's first cluster in the file
+    unsigned int start;         // first physical cluster
+    unsigned int length;        // number of clusters
+} EXTENT;
+
+// state shared by every handle open on the same file
+typedef struct OPEN_INODE {
+    char name[12];
+    unsigned int dir_cluster;   // directory holding the file's entry
+    unsigned int cluster;
+    unsigned int size;          // file size as of the last open or write
+    char path[PATH_MAX_LEN];    // canonical path of the directory
+    EXTENT *extents;            // cluster chain as sorted runs
+    unsigned int n_extents;
+    unsigned int extents_cap;
+    unsigned int n_clusters;    // clusters covered by the extents
+    int first_handle;           // handles on this file, linked by OPEN_FILE.next
+    struct OPEN_INODE *hash_next;
+    pthread_rwlock_t lock;      // readers of the data vs. writers growing it
+} OPEN_INODE;
+
+// for opened files: one per handle
+typedef struct {
+    int using;
+    OPEN_INODE *file;
+    unsigned int offset;
+    int mode;
+    int next;                   // next handle on the same file / next free slot
+} OPEN_FILE;
+
+// cluster buffer cache: fixed number of slots, LRU replacement, write-back.
+// slots are linked in a doubly linked LRU list (head = most recently used)
+// and chained into a small hash table keyed by cluster number.
+typedef struct {
+    unsigned int cluster;
+    int dirty;
+    int prev;
+    int next;
+    int hnext;
+    unsigned char *data;
+} CACHE_SLOT;
+
+// location of a directory entry: the cluster holding it and its slot
+typedef struct {
+    unsigned int cluster;
+    int index;
+} DIR_POS;
+
+// cursor over every slot of a directory's cluster chain
+typedef struct {
+    DIR_POS pos;
+    int per_cluster;
+    DIR_ENTRY *entries;         // current cluster, in buf or in the mapping
+    unsigned char *buf;
+    int error;                  // the walk stopped on an unreadable cluster
+} DIR_ITER;
+
+// per-directory hash index: short name -> entry position. built lazily
+// on first lookup, kept current by the directory helpers, and evicted
+// least-recently-used when too many names are indexed.
+#define DIR_INDEX_SLOTS       16
+#define DIR_INDEX_MAX_ENTRIES (1u << 20)
+
+typedef struct {
+    unsigned char name[11];     // name[0] == 0 marks a free node
+    DIR_POS pos;
+    int next;
+} DIR_NAME_NODE;
+
+typedef struct {
+    unsigned int dir_cluster;   // first cluster of the directory, 0 = unused
+    unsigned long last_use;
+    int *buckets;
+    unsigned int nbuckets;
+    DIR_NAME_NODE *nodes;
+    unsigned int nnodes;
+    unsigned int cap;
+    int free_node;
+    unsigned int count;
+    DIR_POS *holes;             // deleted slots available for reuse
+    unsigned int nholes;
+    unsigned int holes_cap;
+    DIR_POS end;                // end-of-directory slot, cluster 0 = none
+    unsigned int last_cluster;
+} DIR_INDEX;
+
+// dentry cache: canonical directory path ("/A/B/") -> first cluster,
+// filled as paths are resolved. moving or removing a directory drops the
+// entries of its subtree; when full the cache starts over.
+#define DENTRY_BUCKETS 1024
+#define DENTRY_MAX     8192
+
+typedef struct DENTRY {
+    char *path;
+    unsigned int cluster;
+    struct DENTRY *next;        // same bucket
+    struct DENTRY *all_next;    // every entry, for dropping subtrees
+} DENTRY;
+
+// everything belonging to one mounted image. nothing in this file keeps
+// state outside of it, so several images can be mounted at once.
+//
+// locking. reads of file data, directories and the FAT may run on many
+// threads at once; operations that change the image take only the locks
+// covering what they touch. locks are always taken in this order:
+//   open_lock     handle table (write: open/close, read: use of a handle)
+//   inode lock    one open file's extents and size
+//   dir_locks     per-directory stripes (write: entries added/changed/removed)
+//   dir_index_lock  the table of directory name indexes
+//   dentry_lock   path -> directory cache
+//   fat_lock      FAT mirror and allocator (write: chains linked/freed)
+//   cache_lock    cluster cache
+//   trace_lock    trace file
+//   cmd_stats_lock  command latency table
+// the current directory is shell state and is not protected.
+struct fat32_fs {
+    FILE *fp;
+    int image_fd;
+    char *fp_name;
+    BPB bpb;
+    uint64_t image_size;
+    unsigned int current_cluster;
+    char current_path[PATH_MAX_LEN];
+
+    // mmap mount mode: the whole image is mapped and cluster/FAT accesses
+    // are served straight from the mapping
+    int use_mmap;
+    unsigned char *image_map;
+
+    // open file table. handles index a growable array whose freed slots
+    // are recycled through a free list. handles on the same file share
+    // one OPEN_INODE, and a hash on the short name finds the open files
+    // with a given name without scanning the table.
+    pthread_rwlock_t open_lock;
+    OPEN_FILE *open_files;
+    unsigned int open_files_cap;
+    int open_free;
+    OPEN_INODE **open_buckets;
+    unsigned int open_nbuckets;
+    unsigned int open_ninodes;
+
+    // input line of the command being run, used to tag error messages in
+    // batch mode (0 = untagged)
+    unsigned long error_line;
+
+    // in-memory copy of the first FAT, loaded at mount. modified sectors
+    // are tracked in fat_dirty and written back to every FAT copy on flush.
+    pthread_rwlock_t fat_lock;
+    uint64_t fat_start_off;
+    unsigned int *fat_table;
+    unsigned int fat_entries;
+    unsigned char *fat_dirty;
+    int fat_has_dirty;
+
+    // free-space bitmap (bit set = cluster in use) built from the FAT at
+    // mount, plus a rotating next-free hint seeded from the FSInfo sector
+    unsigned char *free_map;
+    unsigned int max_cluster;
+    unsigned int free_count;
+    unsigned int next_free;
+    int fsinfo_valid;
+
+    pthread_mutex_t cache_lock;
+    CACHE_SLOT *cache;
+    int *cache_buckets;
+    unsigned int cache_capacity;
+    unsigned int cache_nbuckets;
+    int cache_head;
+    int cache_tail;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned int cache_ndirty;  // dirty slots; read without the lock to skip syncs
+
+    pthread_rwlock_t dir_locks[DIR_LOCK_STRIPES];
+
+    pthread_mutex_t dir_index_lock;
+    DIR_INDEX dir_indexes[DIR_INDEX_SLOTS];
+    unsigned long dir_index_clock;
+    unsigned long dir_index_total;
+
+    pthread_mutex_t dentry_lock;
+    DENTRY *dentries[DENTRY_BUCKETS];
+    DENTRY *dentry_all;
+    unsigned int dentry_count;
+
+    // counters, updated with relaxed atomics from any thread (the cache
+    // hit/miss fields are unused: those live with the cache)
+    FAT32_STATS stats;
+
+    // latency of the commands run against this mount, filled in by the shell
+    pthread_mutex_t cmd_stats_lock;
+    FAT32_CMD_STATS cmd_stats[FAT32_CMD_SLOTS];
+
+    // trace being recorded, NULL when off
+    pthread_mutex_t trace_lock;
+    FILE *trace;
+    struct timespec trace_start;
+    unsigned long trace_cmd_start;
+};
+
+#define STAT_ADD(fs, field, n) __atomic_add_fetch(&(fs)->stats.field, (n), __ATOMIC_RELAXED)
+
+//helpers
+
+void set_error_line(fat32_fs *fs, unsigned long line) {
+    fs->error_line = line;
+}
+
+void report_error(fat32_fs *fs, const char *fmt, ...) {
+    va_list ap;
+
+    // one message per lock so concurrent errors do not interleave
+    flockfile(stdout);
+    if (fs->error_line) printf("Error (line %lu): ", fs->error_line);
+    else printf("Error: ");
+
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    funlockfile(stdout);
+}
+
+const char* get_image_name(fat32_fs *fs) {
+    return fs->fp_name;
+}
+
+const char* get_current_path(fat32_fs *fs) {
+    return fs->current_path;
+}
+
+unsigned int cluster_size(fat32_fs *fs) {
+    return fs->bpb.BPB_BytsPerSec * fs->bpb.BPB_SecPerClus;
+}
+
+unsigned int first_data_sector(fat32_fs *fs) {
+    return fs->bpb.BPB_RsvdSecCnt + (fs->bpb.BPB_NumFATs * fs->bpb.BPB_FATSz32);
+}
+
+unsigned int cluster_to_sector(fat32_fs *fs, unsigned int cluster) {
+    return first_data_sector(fs) + (cluster - 2) * fs->bpb.BPB_SecPerClus;
+}
+
+//tracing
+
+static unsigned long trace_now(fat32_fs *fs) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)(ts.tv_sec - fs->trace_start.tv_sec) * 1000000000ul +
+           (unsigned long)(ts.tv_nsec - fs->trace_start.tv_nsec);
+}
+
+// appends one record; the caller holds trace_lock
+static void trace_put(fat32_fs *fs, int type, unsigned long time_ns, uint64_t offset,
+                      unsigned int length, const char *text) {
+    unsigned char rec[20];
+    unsigned int info = (length & 0x0FFFFFFF) | ((unsigned int)type << 28);
+    for (int i = 0; i < 8; i++) rec[i] = (unsigned char)(time_ns >> (8 * i));
+    for (int i = 0; i < 8; i++) rec[8 + i] = (unsigned char)(offset >> (8 * i));
+    for (int i = 0; i < 4; i++) rec[16 + i] = (unsigned char)(info >> (8 * i));
+    fwrite(rec, sizeof(rec), 1, fs->trace);
+    if (text) fwrite(text, 1, length, fs->trace);
+}
+
+static void trace_io(fat32_fs *fs, int type, uint64_t offset, unsigned int length) {
+    if (!__atomic_load_n(&fs->trace, __ATOMIC_RELAXED)) return;
+
+    pthread_mutex_lock(&fs->trace_lock);
+    if (fs->trace) trace_put(fs, type, trace_now(fs), offset, length, NULL);
+    pthread_mutex_unlock(&fs->trace_lock);
+}
+
+int fat32_trace_start(fat32_fs *fs, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return -1;
+
+    unsigned char version[4] = { FAT32_TRACE_VERSION, 0, 0, 0 };
+    fwrite(FAT32_TRACE_MAGIC, 1, 8, fp);
+    fwrite(version, 1, 4, fp);
+
+    pthread_mutex_lock(&fs->trace_lock);
+    if (fs->trace) fclose(fs->trace);
+    clock_gettime(CLOCK_MONOTONIC, &fs->trace_start);
+    __atomic_store_n(&fs->trace, fp, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fs->trace_lock);
+    return 0;
+}
+
+void fat32_trace_stop(fat32_fs *fs) {
+    pthread_mutex_lock(&fs->trace_lock);
+    if (fs->trace) fclose(fs->trace);
+    __atomic_store_n(&fs->trace, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fs->trace_lock);
+}
+
+// marks the start of a command; the image accesses up to the matching
+// fat32_trace_command_end() belong to it
+void fat32_trace_command(fat32_fs *fs, const char *line) {
+    if (!__atomic_load_n(&fs->trace, __ATOMIC_RELAXED)) return;
+
+    size_t len = strlen(line);
+    if (len > 0x0FFFFFFF) len = 0x0FFFFFFF;
+    pthread_mutex_lock(&fs->trace_lock);
+    if (fs->trace) {
+        fs->trace_cmd_start = trace_now(fs);
+        trace_put(fs, FAT32_TRACE_COMMAND, fs->trace_cmd_start, 0, (unsigned int)len, line);
+    }
+    pthread_mutex_unlock(&fs->trace_lock);
+}
+
+void fat32_trace_command_end(fat32_fs *fs) {
+    if (!__atomic_load_n(&fs->trace, __ATOMIC_RELAXED)) return;
+
+    pthread_mutex_lock(&fs->trace_lock);
+    if (fs->trace) {
+        unsigned long t = trace_now(fs);
+        trace_put(fs, FAT32_TRACE_COMMAND_END, t, (t - fs->trace_cmd_start) / 1000, 0, NULL);
+    }
+    pthread_mutex_unlock(&fs->trace_lock);
+}
+
+FILE *fat32_trace_open(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    unsigned char head[12];
+    if (fread(head, 1, sizeof(head), fp) != sizeof(head) ||
+        memcmp(head, FAT32_TRACE_MAGIC, 8) != 0 || head[8] != FAT32_TRACE_VERSION) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+int fat32_trace_next(FILE *trace, FAT32_TRACE_EVENT *ev, char *text, size_t cap) {
+    unsigned char rec[20];
+    size_t n = fread(rec, 1, sizeof(rec), trace);
+    if (n == 0) return 0;
+    if (n != sizeof(rec)) return -1;
+
+    unsigned int info = 0;
+    ev->time_ns = 0;
+    ev->offset = 0;
+    for (int i = 7; i >= 0; i--) ev->time_ns = (ev->time_ns << 8) | rec[i];
+    for (int i = 7; i >= 0; i--) ev->offset = (ev->offset << 8) | rec[8 + i];
+    for (int i = 3; i >= 0; i--) info = (info << 8) | rec[16 + i];
+    ev->type = (int)(info >> 28);
+    ev->length = info & 0x0FFFFFFF;
+    if (ev->type < FAT32_TRACE_READ || ev->type > FAT32_TRACE_COMMAND_END) return -1;
+
+    if (ev->type == FAT32_TRACE_COMMAND) {
+        // keep what fits, skip the rest
+        size_t keep = (cap > 0 && ev->length > cap - 1) ? cap - 1 : ev->length;
+        if (cap == 0) keep = 0;
+        if (fread(text, 1, keep, trace) != keep) return -1;
+        if (cap > 0) text[keep] = '\0';
+        if (keep < ev->length && fseek(trace, (long)(ev->length - keep), SEEK_CUR) != 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+//raw image access
+
+// reads/writes bytes of the image, through the mapping in mmap mode and
+// with positional I/O otherwise. returns 0 on success.
+static int image_read(fat32_fs *fs, uint64_t offset, void *buf, unsigned int len) {
+    trace_io(fs, FAT32_TRACE_READ, offset, len);
+    STAT_ADD(fs, reads, 1);
+    STAT_ADD(fs, bytes_read, len);
+    if (fs->image_map) {
+        if (offset + len > fs->image_size) return -1;
+        memcpy(buf, fs->image_map + offset, len);
+        return 0;
+    }
+    return io_pread(fs->image_fd, buf, len, offset);
+}
+
+static int image_write(fat32_fs *fs, uint64_t offset, const void *buf, unsigned int len) {
+    trace_io(fs, FAT32_TRACE_WRITE, offset, len);
+    STAT_ADD(fs, writes, 1);
+    STAT_ADD(fs, bytes_written, len);
+    if (fs->image_map) {
+        if (offset + len > fs->image_size) return -1;
+        memcpy(fs->image_map + offset, buf, len);
+        return 0;
+    }
+    return io_pwrite(fs->image_fd, buf, len, offset);
+}
+
+// moves len bytes from one place in the image to another that does not
+// overlap it, without passing them through user space when not mapped
+static int image_copy(fat32_fs *fs, uint64_t from, uint64_t to, unsigned int len) {
+    trace_io(fs, FAT32_TRACE_READ, from, len);
+    trace_io(fs, FAT32_TRACE_WRITE, to, len);
+    STAT_ADD(fs, reads, 1);
+    STAT_ADD(fs, bytes_read, len);
+    STAT_ADD(fs, writes, 1);
+    STAT_ADD(fs, bytes_written, len);
+    if (fs->image_map) {
+        if (from + len > fs->image_size || to + len > fs->image_size) return -1;
+        memmove(fs->image_map + to, fs->image_map + from, len);
+        return 0;
+    }
+    return io_copy_range(fs->image_fd, from, to, len);
+}
+
+// sector numbers fit in 32 bits, byte offsets of volumes past 4 GB do not
+static uint64_t cluster_offset(fat32_fs *fs, unsigned int cluster) {
+    return (uint64_t)cluster_to_sector(fs, cluster) * fs->bpb.BPB_BytsPerSec;
+}
+
+// 1 when `count` clusters from `cluster` on are data clusters that lie
+// wholly inside the image. a damaged chain can name any cluster, and in
+// mmap mode nothing else stands between it and the pointer arithmetic.
+static int clusters_in_image(fat32_fs *fs, unsigned int cluster, unsigned int count) {
+    if (count == 0 || cluster < 2 || cluster > fs->max_cluster ||
+        count - 1 > fs->max_cluster - cluster) {
+        return 0;
+    }
+    return cluster_offset(fs, cluster + count - 1) + cluster_size(fs) <= fs->image_size;
+}
+
+// a cluster inside the mapping, NULL when it is not a valid data cluster
+static unsigned char *map_cluster(fat32_fs *fs, unsigned int cluster) {
+    if (!clusters_in_image(fs, cluster, 1)) return NULL;
+    return fs->image_map + cluster_offset(fs, cluster);
+}
+
+static int image_map_open(fat32_fs *fs) {
+    if (fs->image_size == 0 || fs->image_size > SIZE_MAX) {
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)fs->image_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fs->image_fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    fs->image_map = map;
+    return 0;
+}
+
+static void image_map_sync(fat32_fs *fs) {
+    if (fs->image_map) {
+        msync(fs->image_map, (size_t)fs->image_size, MS_SYNC);
+    }
+}
+
+static void image_map_close(fat32_fs *fs) {
+    if (fs->image_map) {
+        munmap(fs->image_map, (size_t)fs->image_size);
+        fs->image_map = NULL;
+    }
+}
+
+//cluster cache
+
+static void cache_unlink(fat32_fs *fs, int idx) {
+    CACHE_SLOT *s = &fs->cache[idx];
+    if (s->prev >= 0) fs->cache[s->prev].next = s->next;
+    else fs->cache_head = s->next;
+    if (s->next >= 0) fs->cache[s->next].prev = s->prev;
+    else fs->cache_tail = s->prev;
+    s->prev = s->next = -1;
+}
+
+static void cache_push_front(fat32_fs *fs, int idx) {
+    fs->cache[idx].prev = -1;
+    fs->cache[idx].next = fs->cache_head;
+    if (fs->cache_head >= 0) fs->cache[fs->cache_head].prev = idx;
+    fs->cache_head = idx;
+    if (fs->cache_tail < 0) fs->cache_tail = idx;
+}
+
+static void cache_unhash(fat32_fs *fs, int idx) {
+    if (fs->cache[idx].cluster == CACHE_NO_CLUSTER) return;
+    int *link = &fs->cache_buckets[fs->cache[idx].cluster % fs->cache_nbuckets];
+    while (*link >= 0) {
+        if (*link == idx) {
+            *link = fs->cache[idx].hnext;
+            break;
+        }
+        link = &fs->cache[*link].hnext;
+    }
+    fs->cache[idx].hnext = -1;
+}
+
+static int cache_lookup(fat32_fs *fs, unsigned int cluster) {
+    int idx = fs->cache_buckets[cluster % fs->cache_nbuckets];
+    while (idx >= 0 && fs->cache[idx].cluster != cluster) {
+        idx = fs->cache[idx].hnext;
+    }
+    return idx;
+}
+
+static void cache_set_clean(fat32_fs *fs, CACHE_SLOT *s) {
+    if (s->dirty) {
+        s->dirty = 0;
+        __atomic_fetch_sub(&fs->cache_ndirty, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// writes a dirty slot back. a slot that could not be written stays dirty
+// and -1 is returned.
+static int cache_writeback(fat32_fs *fs, int idx) {
+    CACHE_SLOT *s = &fs->cache[idx];
+    if (!s->dirty || s->cluster == CACHE_NO_CLUSTER) return 0;
+
+    if (image_write(fs, cluster_offset(fs, s->cluster), s->data, cluster_size(fs)) != 0) {
+        return -1;
+    }
+    cache_set_clean(fs, s);
+    return 0;
+}
+
+static void cache_free(fat32_fs *fs) {
+    if (fs->cache) {
+        for (unsigned int i = 0; i < fs->cache_capacity; i++) {
+            free(fs->cache[i].data);
+        }
+    }
+    free(fs->cache);
+    free(fs->cache_buckets);
+    fs->cache = NULL;
+    fs->cache_buckets = NULL;
+    fs->cache_head = fs->cache_tail = -1;
+    fs->cache_ndirty = 0;
+}
+
+static int cache_init(fat32_fs *fs) {
+    unsigned int size = cluster_size(fs);
+
+    // the mapping already gives direct access to every cluster
+    if (fs->image_map) return 0;
+
+    fs->cache_nbuckets = fs->cache_capacity * 2;
+    fs->cache = calloc(fs->cache_capacity, sizeof(CACHE_SLOT));
+    fs->cache_buckets = malloc(fs->cache_nbuckets * sizeof(int));
+    if (!fs->cache || !fs->cache_buckets) {
+        cache_free(fs);
+        return -1;
+    }
+    for (unsigned int i = 0; i < fs->cache_nbuckets; i++) {
+        fs->cache_buckets[i] = -1;
+    }
+
+    fs->cache_head = fs->cache_tail = -1;
+    for (unsigned int i = 0; i < fs->cache_capacity; i++) {
+        fs->cache[i].cluster = CACHE_NO_CLUSTER;
+        fs->cache[i].hnext = -1;
+        fs->cache[i].data = malloc(size);
+        if (!fs->cache[i].data) {
+            cache_free(fs);
+            return -1;
+        }
+        cache_push_front(fs, (int)i);
+    }
+    return 0;
+}
+
+// returns the cached buffer for a cluster, loading it from the image when
+// `load` is set. the pointer stays valid until the next cache call; the
+// caller holds cache_lock. NULL when the slot to reuse could not be
+// written back or the cluster could not be read; nothing is cached then.
+static unsigned char *cache_slot(fat32_fs *fs, unsigned int cluster, int load) {
+    if (fs->image_map) {
+        return map_cluster(fs, cluster);
+    }
+
+    int idx = cache_lookup(fs, cluster);
+    if (idx >= 0) {
+        fs->cache_hits++;
+    } else {
+        fs->cache_misses++;
+        idx = fs->cache_tail;
+        if (cache_writeback(fs, idx) != 0) return NULL;
+        cache_unhash(fs, idx);
+
+        CACHE_SLOT *s = &fs->cache[idx];
+        s->cluster = CACHE_NO_CLUSTER;
+        if (load) {
+            STAT_ADD(fs, cluster_reads, 1);
+            if (image_read(fs, cluster_offset(fs, cluster), s->data, cluster_size(fs)) != 0) {
+                return NULL;
+            }
+        }
+        s->cluster = cluster;
+        s->hnext = fs->cache_buckets[cluster % fs->cache_nbuckets];
+        fs->cache_buckets[cluster % fs->cache_nbuckets] = idx;
+    }
+
+    cache_unlink(fs, idx);
+    cache_push_front(fs, idx);
+    return fs->cache[idx].data;
+}
+
+int read_cluster(fat32_fs *fs, unsigned int cluster, unsigned char *buffer) {
+    pthread_mutex_lock(&fs->cache_lock);
+    unsigned char *data = cache_slot(fs, cluster, 1);
+    if (data) memcpy(buffer, data, cluster_size(fs));
+    pthread_mutex_unlock(&fs->cache_lock);
+    return data ? 0 : -1;
+}
+
+// pointer to a cluster's contents: into the mapping in mmap mode (no
+// copy), otherwise the cluster is read into `scratch`. NULL when it
+// cannot be read.
+static unsigned char *cluster_view(fat32_fs *fs, unsigned int cluster, unsigned char *scratch) {
+    if (fs->image_map) {
+        return map_cluster(fs, cluster);
+    }
+    return read_cluster(fs, cluster, scratch) == 0 ? scratch : NULL;
+}
+
+static void cache_mark_dirty(fat32_fs *fs) {
+    if (fs->image_map) return;
+
+    CACHE_SLOT *s = &fs->cache[fs->cache_head];
+    if (!s->dirty) {
+        s->dirty = 1;
+        __atomic_fetch_add(&fs->cache_ndirty, 1, __ATOMIC_RELEASE);
+    }
+}
+
+int store_cluster(fat32_fs *fs, unsigned int cluster, const unsigned char *buffer) {
+    pthread_mutex_lock(&fs->cache_lock);
+    unsigned char *data = cache_slot(fs, cluster, 0);
+    if (data) {
+        memcpy(data, buffer, cluster_size(fs));
+        cache_mark_dirty(fs);
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+    return data ? 0 : -1;
+}
+
+// copies `len` bytes at `offset` inside a cluster out of the cache. on
+// failure dst is zeroed and -1 returned.
+static int cache_read(fat32_fs *fs, unsigned int cluster, unsigned int offset,
+                      void *dst, unsigned int len) {
+    pthread_mutex_lock(&fs->cache_lock);
+    unsigned char *data = cache_slot(fs, cluster, 1);
+    if (data) memcpy(dst, data + offset, len);
+    else memset(dst, 0, len);
+    pthread_mutex_unlock(&fs->cache_lock);
+    return data ? 0 : -1;
+}
+
+// writes `len` bytes at `offset` inside a cluster; partial writes are
+// merged with the cluster's current contents. returns 0 on success.
+static int cache_write(fat32_fs *fs, unsigned int cluster, unsigned int offset,
+                       const void *src, unsigned int len) {
+    int whole = (offset == 0 && len == cluster_size(fs));
+    pthread_mutex_lock(&fs->cache_lock);
+    unsigned char *data = cache_slot(fs, cluster, !whole);
+    if (data) {
+        memcpy(data + offset, src, len);
+        cache_mark_dirty(fs);
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+    return data ? 0 : -1;
+}
+
+// brings the image up to date for a run of clusters before it is read
+// directly, or forgets cached copies of clusters about to be overwritten
+// directly (drop set). returns -1 when a cluster could not be written
+// back; it stays cached and dirty.
+static int cache_sync_range(fat32_fs *fs, unsigned int start, unsigned int count, int drop) {
+    if (!fs->cache) return 0;
+    // readers of clean data never contend for the cache
+    if (!drop && __atomic_load_n(&fs->cache_ndirty, __ATOMIC_ACQUIRE) == 0) return 0;
+
+    int err = 0;
+    pthread_mutex_lock(&fs->cache_lock);
+    for (unsigned int i = 0; i < fs->cache_capacity; i++) {
+        CACHE_SLOT *s = &fs->cache[i];
+        if (s->cluster == CACHE_NO_CLUSTER ||
+            s->cluster < start || s->cluster - start >= count) {
+            continue;
+        }
+        if (drop) {
+            cache_unhash(fs, (int)i);
+            s->cluster = CACHE_NO_CLUSTER;
+            cache_set_clean(fs, s);
+            cache_unlink(fs, (int)i);
+            // free slots are reused first
+            s->prev = fs->cache_tail;
+            s->next = -1;
+            if (fs->cache_tail >= 0) fs->cache[fs->cache_tail].next = (int)i;
+            fs->cache_tail = (int)i;
+            if (fs->cache_head < 0) fs->cache_head = (int)i;
+        } else if (cache_writeback(fs, (int)i) != 0) {
+            err = -1;
+        }
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+    return err;
+}
+
+static int cache_writeback_all(fat32_fs *fs) {
+    int err = 0;
+    if (!fs->cache) return 0;
+    for (unsigned int i = 0; i < fs->cache_capacity; i++) {
+        if (cache_writeback(fs, (int)i) != 0) err = -1;
+    }
+    return err;
+}
+
+int cache_flush(fat32_fs *fs) {
+    pthread_mutex_lock(&fs->cache_lock);
+    int err = cache_writeback_all(fs);
+    pthread_mutex_unlock(&fs->cache_lock);
+    return err;
+}
+
+void cache_set_capacity(fat32_fs *fs, unsigned int slots) {
+    if (slots == 0) slots = 1;
+    pthread_mutex_lock(&fs->cache_lock);
+    if (fs->cache) {
+        // dirty clusters that cannot be written back keep the old cache
+        if (cache_writeback_all(fs) != 0) {
+            pthread_mutex_unlock(&fs->cache_lock);
+            return;
+        }
+        cache_free(fs);
+        fs->cache_capacity = slots;
+        cache_init(fs);
+    } else {
+        fs->cache_capacity = slots;
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+void cache_get_stats(fat32_fs *fs, unsigned long *hits, unsigned long *misses) {
+    pthread_mutex_lock(&fs->cache_lock);
+    if (hits) *hits = fs->cache_hits;
+    if (misses) *misses = fs->cache_misses;
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+// every field of FAT32_STATS is an unsigned long counter
+void fat32_get_stats(fat32_fs *fs, FAT32_STATS *st) {
+    unsigned long *dst = (unsigned long *)st;
+    unsigned long *src = (unsigned long *)&fs->stats;
+    for (size_t i = 0; i < sizeof(FAT32_STATS) / sizeof(unsigned long); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&fs->cache_lock);
+    st->cache_hits = fs->cache_hits;
+    st->cache_misses = fs->cache_misses;
+    st->dirty_bytes = (unsigned long)fs->cache_ndirty * cluster_size(fs);
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+void fat32_reset_stats(fat32_fs *fs) {
+    unsigned long *p = (unsigned long *)&fs->stats;
+    for (size_t i = 0; i < sizeof(FAT32_STATS) / sizeof(unsigned long); i++) {
+        __atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&fs->cache_lock);
+    fs->cache_hits = fs->cache_misses = 0;
+    pthread_mutex_unlock(&fs->cache_lock);
+
+    pthread_mutex_lock(&fs->cmd_stats_lock);
+    memset(fs->cmd_stats, 0, sizeof(fs->cmd_stats));
+    pthread_mutex_unlock(&fs->cmd_stats_lock);
+}
+
+void fat32_record_command(fat32_fs *fs, unsigned int slot, double seconds) {
+    if (slot >= FAT32_CMD_SLOTS) return;
+    double us = seconds * 1e6;
+    int b = 0;
+    while (b < FAT32_LAT_BUCKETS - 1 && us >= (double)(1ul << b)) b++;
+
+    pthread_mutex_lock(&fs->cmd_stats_lock);
+    FAT32_CMD_STATS *cs = &fs->cmd_stats[slot];
+    cs->calls++;
+    cs->total += seconds;
+    if (seconds > cs->max) cs->max = seconds;
+    cs->hist[b]++;
+    pthread_mutex_unlock(&fs->cmd_stats_lock);
+}
+
+void fat32_get_command_stats(fat32_fs *fs, unsigned int slot, FAT32_CMD_STATS *st) {
+    if (slot >= FAT32_CMD_SLOTS) {
+        memset(st, 0, sizeof(*st));
+        return;
+    }
+    pthread_mutex_lock(&fs->cmd_stats_lock);
+    *st = fs->cmd_stats[slot];
+    pthread_mutex_unlock(&fs->cmd_stats_lock);
+}
+
+static void make_short_name(const char *src, unsigned char dest[11]) {
+    for (int i = 0; i < 11; i++) {
+        dest[i] = ' ';
+    }
+    int i = 0;
+    while (src[i] != '\0' && i < 11) {
+        dest[i] = (unsigned char)toupper((unsigned char)src[i]);
+        i++;
+    }
+}
+
+//fat helpers
+
+static int fat_load(fat32_fs *fs) {
+    unsigned int bytes_per_fat = fs->bpb.BPB_FATSz32 * fs->bpb.BPB_BytsPerSec;
+
+    fs->fat_entries = bytes_per_fat / 4;
+    fs->fat_dirty = calloc(fs->bpb.BPB_FATSz32, 1);
+    fs->fat_has_dirty = 0;
+    if (!fs->fat_dirty) {
+        return -1;
+    }
+
+    // in mmap mode the first FAT in the mapping is used in place
+    if (fs->image_map) {
+        if (fs->fat_start_off + bytes_per_fat > fs->image_size) return -1;
+        fs->fat_table = (unsigned int *)(fs->image_map + fs->fat_start_off);
+        return 0;
+    }
+
+    fs->fat_table = malloc(bytes_per_fat);
+    if (!fs->fat_table) {
+        return -1;
+    }
+    return image_read(fs, fs->fat_start_off, fs->fat_table, bytes_per_fat);
+}
+
+static void fat_release(fat32_fs *fs) {
+    if (!fs->image_map) free(fs->fat_table);
+    free(fs->fat_dirty);
+    fs->fat_table = NULL;
+    fs->fat_dirty = NULL;
+    fs->fat_entries = 0;
+}
+
+// writes dirty FAT sectors to all FAT copies, one write per run of
+// adjacent dirty sectors
+// writes the modified FAT sectors to every copy. sectors that could not
+// be written stay dirty for the next flush, and -1 is returned.
+int fat_flush(fat32_fs *fs) {
+    pthread_rwlock_wrlock(&fs->fat_lock);
+    if (!fs->fat_table || !fs->fat_has_dirty) {
+        pthread_rwlock_unlock(&fs->fat_lock);
+        return 0;
+    }
+
+    unsigned int bps = fs->bpb.BPB_BytsPerSec;
+    unsigned int sec = 0;
+    int err = 0;
+    while (sec < fs->bpb.BPB_FATSz32) {
+        if (!fs->fat_dirty[sec]) {
+            sec++;
+            continue;
+        }
+        unsigned int run = sec;
+        while (run < fs->bpb.BPB_FATSz32 && fs->fat_dirty[run]) run++;
+
+        // in mmap mode copy 0 is the live table itself
+        int written = 1;
+        for (int i = fs->image_map ? 1 : 0; i < fs->bpb.BPB_NumFATs; i++) {
+            uint64_t fat_base_off =
+                fs->fat_start_off + (uint64_t)i * fs->bpb.BPB_FATSz32 * bps;
+            if (image_write(fs, fat_base_off + (uint64_t)sec * bps,
+                            (unsigned char *)fs->fat_table + sec * bps,
+                            (run - sec) * bps) != 0) {
+                written = 0;
+            }
+        }
+        if (written) memset(fs->fat_dirty + sec, 0, run - sec);
+        else err = -1;
+        sec = run;
+    }
+    fs->fat_has_dirty = err != 0;
+    pthread_rwlock_unlock(&fs->fat_lock);
+    return err;
+}
+
+static int map_test(fat32_fs *fs, unsigned int cluster) {
+    return (fs->free_map[cluster >> 3] >> (cluster & 7)) & 1;
+}
+
+static void map_set(fat32_fs *fs, unsigned int cluster, int used) {
+    if (used) fs->free_map[cluster >> 3] |= (unsigned char)(1 << (cluster & 7));
+    else fs->free_map[cluster >> 3] &= (unsigned char)~(1 << (cluster & 7));
+}
+
+static uint64_t fsinfo_offset(fat32_fs *fs) {
+    return (uint64_t)fs->bpb.BPB_FSInfo * fs->bpb.BPB_BytsPerSec;
+}
+
+static int alloc_init(fat32_fs *fs) {
+    unsigned int data_clusters =
+        (fs->bpb.BPB_TotSec32 - first_data_sector(fs)) / fs->bpb.BPB_SecPerClus;
+
+    fs->max_cluster = data_clusters + 1;
+    if (fs->max_cluster >= fs->fat_entries) {
+        fs->max_cluster = fs->fat_entries - 1;
+    }
+
+    fs->free_map = calloc(fs->max_cluster / 8 + 1, 1);
+    if (!fs->free_map) {
+        return -1;
+    }
+
+    // clusters 0 and 1 are reserved
+    map_set(fs, 0, 1);
+    map_set(fs, 1, 1);
+    fs->free_count = 0;
+    for (unsigned int c = 2; c <= fs->max_cluster; c++) {
+        if ((fs->fat_table[c] & 0x0FFFFFFF) != 0) map_set(fs, c, 1);
+        else fs->free_count++;
+    }
+
+    // seed the allocation hint from FSInfo when it looks sane
+    unsigned int fsi[128];
+    fs->next_free = 2;
+    fs->fsinfo_valid = 0;
+    if (fs->bpb.BPB_FSInfo != 0 && fs->bpb.BPB_FSInfo != 0xFFFF) {
+        if (image_read(fs, fsinfo_offset(fs), fsi, sizeof(fsi)) == 0 &&
+            fsi[0] == FSI_LEAD_SIG && fsi[121] == FSI_STRUC_SIG &&
+            fsi[127] == FSI_TRAIL_SIG) {
+            fs->fsinfo_valid = 1;
+            if (fsi[123] >= 2 && fsi[123] <= fs->max_cluster) {
+                fs->next_free = fsi[123];
+            }
+        }
+    }
+    return 0;
+}
+
+// stores the free count and next-free hint back into FSInfo
+static int alloc_sync_fsinfo(fat32_fs *fs) {
+    if (!fs->fsinfo_valid) return 0;
+
+    unsigned int vals[2] = { fs->free_count, fs->next_free };
+    return image_write(fs, fsinfo_offset(fs) + 488, vals, sizeof(vals));
+}
+
+static void alloc_release(fat32_fs *fs) {
+    free(fs->free_map);
+    fs->free_map = NULL;
+}
+
+// the FAT helpers below expect the caller to hold fat_lock, except
+// fat_get() and fat_free_chain() which take it themselves
+
+static unsigned int fat_entry(fat32_fs *fs, unsigned int cluster) {
+    STAT_ADD(fs, fat_lookups, 1);
+    if (cluster >= fs->fat_entries) {
+        return FAT32_EOC;
+    }
+    return fs->fat_table[cluster] & 0x0FFFFFFF;
+}
+
+static unsigned int fat_get(fat32_fs *fs, unsigned int cluster) {
+    pthread_rwlock_rdlock(&fs->fat_lock);
+    unsigned int next = fat_entry(fs, cluster);
+    pthread_rwlock_unlock(&fs->fat_lock);
+    return next;
+}
+
+static void write_cluster(fat32_fs *fs, unsigned int cluster, unsigned int next) {
+    if (cluster >= fs->fat_entries) return;
+
+    // upper 4 bits are reserved and must be preserved
+    fs->fat_table[cluster] = (fs->fat_table[cluster] & 0xF0000000) | (next & 0x0FFFFFFF);
+
+    if (fs->free_map && cluster >= 2 && cluster <= fs->max_cluster) {
+        int used = (next & 0x0FFFFFFF) != 0;
+        if (used != map_test(fs, cluster)) {
+            map_set(fs, cluster, used);
+            if (used) {
+                fs->free_count--;
+                STAT_ADD(fs, cluster_allocs, 1);
+            } else {
+                fs->free_count++;
+            }
+        }
+    }
+    fs->fat_dirty[(cluster * 4) / fs->bpb.BPB_BytsPerSec] = 1;
+    fs->fat_has_dirty = 1;
+}
+
+static void fat_free_chain(fat32_fs *fs, unsigned int start) {
+    unsigned int cluster = start;
+
+    pthread_rwlock_wrlock(&fs->fat_lock);
+    while (cluster >= 2) {
+        unsigned int next = fat_entry(fs, cluster);
+        // mark as free
+        write_cluster(fs, cluster, 0x00000000);
+
+        if (next == 0 || next >= 0x0FFFFFF8) {
+            break;
+        }
+        cluster = next;
+    }
+    pthread_rwlock_unlock(&fs->fat_lock);
+}
+
+// find a free FAT entry (cluster >= 2), returns 0 if none. next-fit: the
+// search resumes after the last allocation and wraps around once.
+static unsigned int find_new_cluster(fat32_fs *fs) {
+    if (fs->free_count == 0) {
+        return 0;
+    }
+
+    unsigned int c = fs->next_free;
+    if (c < 2 || c > fs->max_cluster) c = 2;
+
+    for (unsigned int scanned = 0; scanned < fs->max_cluster - 1; ) {
+        // skip fully used bytes eight clusters at a time
+        if ((c & 7) == 0 && c + 8 <= fs->max_cluster + 1 && fs->free_map[c >> 3] == 0xFF) {
+            c += 8;
+            scanned += 8;
+        } else {
+            if (!map_test(fs, c)) {
+                fs->next_free = (c + 1 > fs->max_cluster) ? 2 : c + 1;
+                return c;
+            }
+            c++;
+            scanned++;
+        }
+        if (c > fs->max_cluster) c = 2;
+    }
+    return 0;
+}
+
+// finds a run of free clusters for an allocation of `want` clusters.
+// the run starting at `goal` (e.g. right after a file's last cluster) is
+// preferred; otherwise the first run of the full length found from the
+// next-free hint is used, or failing that the longest run seen. returns
+// the run length (0 when the volume is full) and its start in *start.
+static unsigned int alloc_run(fat32_fs *fs, unsigned int goal, unsigned int want,
+                              unsigned int *start) {
+    if (fs->free_count == 0 || want == 0) return 0;
+
+    if (goal >= 2 && goal <= fs->max_cluster && !map_test(fs, goal)) {
+        unsigned int len = 0;
+        while (len < want && goal + len <= fs->max_cluster && !map_test(fs, goal + len)) {
+            len++;
+        }
+        if (len == want) {
+            *start = goal;
+            return len;
+        }
+    }
+
+    unsigned int best_start = 0;
+    unsigned int best_len = 0;
+    unsigned int c = find_new_cluster(fs);
+    unsigned int first = c;
+    int wrapped = 0;
+    for (int probes = 0; c != 0 && probes < ALLOC_MAX_PROBES; probes++) {
+        unsigned int len = 0;
+        while (len < want && c + len <= fs->max_cluster && !map_test(fs, c + len)) {
+            len++;
+        }
+        if (len > best_len) {
+            best_start = c;
+            best_len = len;
+        }
+        if (len == want) break;
+
+        unsigned int prev = c;
+        fs->next_free = (c + len > fs->max_cluster) ? 2 : c + len;
+        c = find_new_cluster(fs);
+        if (c <= prev) wrapped = 1;
+        if (wrapped && c >= first) break;
+    }
+
+    if (best_len == 0) return 0;
+    *start = best_start;
+    fs->next_free = (best_start + best_len > fs->max_cluster) ? 2 : best_start + best_len;
+    return best_len;
+}
+
+// chains `len` clusters from `start` together and terminates the run with
+// EOC, updating the FAT mirror and the bitmap in one pass
+static void fat_link_run(fat32_fs *fs, unsigned int start, unsigned int len) {
+    unsigned int bps = fs->bpb.BPB_BytsPerSec;
+    unsigned int last_sector = 0xFFFFFFFF;
+
+    for (unsigned int c = start; c < start + len; c++) {
+        unsigned int next = (c + 1 < start + len) ? c + 1 : FAT32_EOC;
+        fs->fat_table[c] = (fs->fat_table[c] & 0xF0000000) | next;
+        if (!map_test(fs, c)) {
+            map_set(fs, c, 1);
+            fs->free_count--;
+            STAT_ADD(fs, cluster_allocs, 1);
+        }
+        unsigned int sector = (c * 4) / bps;
+        if (sector != last_sector) {
+            fs->fat_dirty[sector] = 1;
+            last_sector = sector;
+        }
+    }
+    fs->fat_has_dirty = 1;
+}
+
+//directory helpers
+
+// callers hold a directory's stripe lock while they use its entries:
+// for reading to look names up, for writing to add, change or remove them
+static pthread_rwlock_t *dir_lock(fat32_fs *fs, unsigned int dir_cluster) {
+    return &fs->dir_locks[dir_cluster % DIR_LOCK_STRIPES];
+}
+
+// write-locks the stripes of several directories in stripe order so that
+// concurrent callers cannot deadlock; a shared stripe is locked once.
+// returns the set of stripes taken, for dir_unlock_set().
+static uint64_t dir_lock_set(fat32_fs *fs, const unsigned int *dirs, int n) {
+    uint64_t set = 0;
+    for (int i = 0; i < n; i++) {
+        set |= (uint64_t)1 << (dirs[i] % DIR_LOCK_STRIPES);
+    }
+    for (uint64_t left = set; left; left &= left - 1) {
+        pthread_rwlock_wrlock(&fs->dir_locks[__builtin_ctzll(left)]);
+    }
+    return set;
+}
+
+static void dir_unlock_set(fat32_fs *fs, uint64_t set) {
+    for (uint64_t left = set; left; left &= ~((uint64_t)1 << (63 - __builtin_clzll(left)))) {
+        pthread_rwlock_unlock(&fs->dir_locks[63 - __builtin_clzll(left)]);
+    }
+}
+
+static int is_valid_entry(DIR_ENTRY *entry) {
+    if (entry->DIR_Name[0] == 0x00) {
+        return 0;
+    }
+    if (entry->DIR_Attr == 0x0F) { 
+        return 0;
+    }
+    if (entry->DIR_Name[0] == 0xE5) { 
+        return 0;
+    }
+    if (entry->DIR_Name[0] == 0x5E) { 
+        return 0;
+    }
+    return 1;
+}
+
+// walks every slot of a directory's cluster chain. dir_iter_next() returns
+// each raw slot (including free and deleted ones) and records its position
+// in it->pos; it returns NULL once the end of the chain is reached.
+static int dir_iter_begin(fat32_fs *fs, DIR_ITER *it, unsigned int dir_cluster) {
+    it->buf = NULL;
+    if (!fs->image_map) {
+        it->buf = malloc(cluster_size(fs));
+        if (!it->buf) return -1;
+    }
+
+    it->per_cluster = cluster_size(fs) / (int)sizeof(DIR_ENTRY);
+    it->error = 0;
+    it->pos.cluster = dir_cluster;
+    it->pos.index = -1;
+    it->entries = (DIR_ENTRY *)cluster_view(fs, dir_cluster, it->buf);
+    if (!it->entries) {
+        free(it->buf);
+        it->buf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static DIR_ENTRY *dir_iter_next(fat32_fs *fs, DIR_ITER *it) {
+    it->pos.index++;
+    if (it->pos.index >= it->per_cluster) {
+        unsigned int next = fat_get(fs, it->pos.cluster);
+        if (next < 2 || next >= 0x0FFFFFF8) {
+            it->pos.index = it->per_cluster;
+            return NULL;
+        }
+        it->entries = (DIR_ENTRY *)cluster_view(fs, next, it->buf);
+        if (!it->entries) {
+            // the walk ends here, but not at the end of the chain: callers
+            // that go on to use pos.cluster must check it->error
+            it->error = 1;
+            it->pos.index = it->per_cluster;
+            return NULL;
+        }
+        it->pos.cluster = next;
+        it->pos.index = 0;
+    }
+    return &it->entries[it->pos.index];
+}
+
+static void dir_iter_end(DIR_ITER *it) {
+    free(it->buf);
+    it->buf = NULL;
+}
+
+static int is_free_slot(DIR_ENTRY *entry) {
+    return entry->DIR_Name[0] == 0x00 ||
+           entry->DIR_Name[0] == 0x5E ||
+           entry->DIR_Name[0] == 0xE5;
+}
+
+//directory name index
+
+static unsigned int name_hash(const unsigned char name[11]) {
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < 11; i++) {
+        h ^= name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void dir_index_free(fat32_fs *fs, DIR_INDEX *ix) {
+    fs->dir_index_total -= ix->count;
+    free(ix->buckets);
+    free(ix->nodes);
+    free(ix->holes);
+    memset(ix, 0, sizeof(*ix));
+}
+
+static DIR_INDEX *dir_index_find(fat32_fs *fs, unsigned int dir_cluster) {
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++) {
+        if (fs->dir_indexes[i].dir_cluster == dir_cluster) {
+            fs->dir_indexes[i].last_use = ++fs->dir_index_clock;
+            return &fs->dir_indexes[i];
+        }
+    }
+    return NULL;
+}
+
+// forgets the index of a directory (e.g. because it was removed)
+static void dir_index_drop(fat32_fs *fs, unsigned int dir_cluster) {
+    pthread_mutex_lock(&fs->dir_index_lock);
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++) {
+        if (fs->dir_indexes[i].dir_cluster == dir_cluster) {
+            dir_index_free(fs, &fs->dir_indexes[i]);
+        }
+    }
+    pthread_mutex_unlock(&fs->dir_index_lock);
+}
+
+static void dir_index_drop_all(fat32_fs *fs) {
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++) {
+        if (fs->dir_indexes[i].dir_cluster != 0) {
+            dir_index_free(fs, &fs->dir_indexes[i]);
+        }
+    }
+}
+
+// evicts the least recently used index other than `keep`; returns 0 when
+// there was nothing to evict
+static int dir_index_evict(fat32_fs *fs, DIR_INDEX *keep) {
+    DIR_INDEX *victim = NULL;
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++) {
+        DIR_INDEX *ix = &fs->dir_indexes[i];
+        if (ix == keep || ix->dir_cluster == 0) continue;
+        if (!victim || ix->last_use < victim->last_use) victim = ix;
+    }
+    if (!victim) return 0;
+    dir_index_free(fs, victim);
+    return 1;
+}
+
+static int dir_index_rehash(DIR_INDEX *ix, unsigned int nbuckets) {
+    int *buckets = malloc(nbuckets * sizeof(int));
+    if (!buckets) return -1;
+    for (unsigned int i = 0; i < nbuckets; i++) buckets[i] = -1;
+
+    for (unsigned int n = 0; n < ix->nnodes; n++) {
+        DIR_NAME_NODE *node = &ix->nodes[n];
+        if (node->name[0] == 0) continue;
+        unsigned int b = name_hash(node->name) & (nbuckets - 1);
+        node->next = buckets[b];
+        buckets[b] = (int)n;
+    }
+    free(ix->buckets);
+    ix->buckets = buckets;
+    ix->nbuckets = nbuckets;
+    return 0;
+}
+
+static int dir_index_insert(fat32_fs *fs, DIR_INDEX *ix, const unsigned char name[11],
+                            const DIR_POS *pos) {
+    if (ix->count + 1 > ix->nbuckets &&
+        dir_index_rehash(ix, ix->nbuckets * 2) != 0) {
+        return -1;
+    }
+
+    int n;
+    if (ix->free_node >= 0) {
+        n = ix->free_node;
+        ix->free_node = ix->nodes[n].next;
+    } else {
+        if (ix->nnodes == ix->cap) {
+            unsigned int cap = ix->cap ? ix->cap * 2 : 64;
+            DIR_NAME_NODE *nodes = realloc(ix->nodes, cap * sizeof(DIR_NAME_NODE));
+            if (!nodes) return -1;
+            ix->nodes = nodes;
+            ix->cap = cap;
+        }
+        n = (int)ix->nnodes++;
+    }
+
+    DIR_NAME_NODE *node = &ix->nodes[n];
+    memcpy(node->name, name, 11);
+    node->pos = *pos;
+    unsigned int b = name_hash(name) & (ix->nbuckets - 1);
+    node->next = ix->buckets[b];
+    ix->buckets[b] = n;
+    ix->count++;
+    fs->dir_index_total++;
+    return 0;
+}
+
+static int dir_index_search(DIR_INDEX *ix, const unsigned char name[11],
+                            DIR_POS *pos) {
+    int n = ix->buckets[name_hash(name) & (ix->nbuckets - 1)];
+    while (n >= 0) {
+        if (memcmp(ix->nodes[n].name, name, 11) == 0) {
+            if (pos) *pos = ix->nodes[n].pos;
+            return 1;
+        }
+        n = ix->nodes[n].next;
+    }
+    return 0;
+}
+
+static void dir_index_erase(fat32_fs *fs, DIR_INDEX *ix, const unsigned char name[11]) {
+    int *link = &ix->buckets[name_hash(name) & (ix->nbuckets - 1)];
+    while (*link >= 0) {
+        DIR_NAME_NODE *node = &ix->nodes[*link];
+        if (memcmp(node->name, name, 11) == 0) {
+            int n = *link;
+            *link = node->next;
+            node->name[0] = 0;
+            node->next = ix->free_node;
+            ix->free_node = n;
+            ix->count--;
+            fs->dir_index_total--;
+            return;
+        }
+        link = &node->next;
+    }
+}
+
+static int dir_index_push_hole(DIR_INDEX *ix, const DIR_POS *pos) {
+    if (ix->nholes == ix->holes_cap) {
+        unsigned int cap = ix->holes_cap ? ix->holes_cap * 2 : 16;
+        DIR_POS *holes = realloc(ix->holes, cap * sizeof(DIR_POS));
+        if (!holes) return -1;
+        ix->holes = holes;
+        ix->holes_cap = cap;
+    }
+    ix->holes[ix->nholes++] = *pos;
+    return 0;
+}
+
+// slot following `pos` in the chain, or cluster 0 when pos is the last one
+static DIR_POS dir_next_pos(fat32_fs *fs, DIR_POS pos) {
+    int per_cluster = cluster_size(fs) / (int)sizeof(DIR_ENTRY);
+    if (pos.index + 1 < per_cluster) {
+        pos.index++;
+        return pos;
+    }
+    unsigned int next = fat_get(fs, pos.cluster);
+    pos.cluster = (next >= 2 && next < 0x0FFFFFF8) ? next : 0;
+    pos.index = 0;
+    return pos;
+}
+
+// scans a directory chain once and records every live name, every deleted
+// slot and the end-of-directory marker
+static DIR_INDEX *dir_index_build(fat32_fs *fs, unsigned int dir_cluster) {
+    DIR_INDEX *ix = NULL;
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++) {
+        if (fs->dir_indexes[i].dir_cluster == 0) {
+            ix = &fs->dir_indexes[i];
+            break;
+        }
+    }
+    if (!ix) {
+        dir_index_evict(fs, NULL);
+        return dir_index_build(fs, dir_cluster);
+    }
+
+    DIR_ITER it;
+    DIR_ENTRY *e;
+    if (dir_iter_begin(fs, &it, dir_cluster) != 0) return NULL;
+
+    ix->dir_cluster = dir_cluster;
+    ix->free_node = -1;
+    ix->end.cluster = 0;
+    if (dir_index_rehash(ix, 64) != 0) {
+        dir_iter_end(&it);
+        dir_index_free(fs, ix);
+        return NULL;
+    }
+
+    int ok = 1;
+    while (ok && (e = dir_iter_next(fs, &it)) != NULL) {
+        if (e->DIR_Name[0] == 0x00) {
+            ix->end = it.pos;
+            break;
+        }
+        if (e->DIR_Name[0] == 0x5E || e->DIR_Name[0] == 0xE5) {
+            ok = dir_index_push_hole(ix, &it.pos) == 0;
+        } else if (is_valid_entry(e)) {
+            ok = dir_index_insert(fs, ix, e->DIR_Name, &it.pos) == 0;
+        }
+    }
+    // remember the last cluster so the chain can be grown without a walk
+    while (e != NULL && fat_get(fs, it.pos.cluster) >= 2 &&
+           fat_get(fs, it.pos.cluster) < 0x0FFFFFF8) {
+        it.pos.cluster = fat_get(fs, it.pos.cluster);
+    }
+    ix->last_cluster = it.pos.cluster;
+    dir_iter_end(&it);
+
+    // a walk cut short by a read error would index part of the directory
+    // and take a cluster in the middle of the chain for its last one
+    if (it.error) ok = 0;
+    if (!ok) {
+        dir_index_free(fs, ix);
+        return NULL;
+    }
+
+    ix->last_use = ++fs->dir_index_clock;
+    while (fs->dir_index_total > DIR_INDEX_MAX_ENTRIES && dir_index_evict(fs, ix)) {
+    }
+    return ix;
+}
+
+// index for a directory, built on first use. NULL when it cannot be built,
+// in which case callers fall back to a linear scan.
+static DIR_INDEX *dir_index_get(fat32_fs *fs, unsigned int dir_cluster) {
+    DIR_INDEX *ix = dir_index_find(fs, dir_cluster);
+    if (!ix) ix = dir_index_build(fs, dir_cluster);
+    return ix;
+}
+
+static void dir_index_add(fat32_fs *fs, unsigned int dir_cluster, const unsigned char name[11],
+                          const DIR_POS *pos) {
+    pthread_mutex_lock(&fs->dir_index_lock);
+    DIR_INDEX *ix = dir_index_find(fs, dir_cluster);
+    if (ix && dir_index_insert(fs, ix, name, pos) != 0) {
+        dir_index_free(fs, ix);
+    }
+    pthread_mutex_unlock(&fs->dir_index_lock);
+}
+
+static void dir_index_remove(fat32_fs *fs, unsigned int dir_cluster, const unsigned char name[11]) {
+    pthread_mutex_lock(&fs->dir_index_lock);
+    DIR_INDEX *ix = dir_index_find(fs, dir_cluster);
+    if (ix) dir_index_erase(fs, ix, name);
+    pthread_mutex_unlock(&fs->dir_index_lock);
+}
+
+// looks up a valid entry by its 11-byte short name in a directory chain.
+// returns 1 and fills pos/out (either may be NULL) when found.
+static int dir_lookup(fat32_fs *fs, unsigned int dir_cluster, const unsigned char name[11],
+                      DIR_POS *pos, DIR_ENTRY *out) {
+    pthread_mutex_lock(&fs->dir_index_lock);
+    DIR_INDEX *ix = dir_index_get(fs, dir_cluster);
+    if (ix) {
+        DIR_POS found_pos;
+        int hit = dir_index_search(ix, name, &found_pos);
+        pthread_mutex_unlock(&fs->dir_index_lock);
+        if (!hit) return 0;
+        if (pos) *pos = found_pos;
+        if (out && cache_read(fs, found_pos.cluster, found_pos.index * sizeof(DIR_ENTRY),
+                              out, sizeof(DIR_ENTRY)) != 0) {
+            return 0;
+        }
+        return 1;
+    }
+    pthread_mutex_unlock(&fs->dir_index_lock);
+
+    DIR_ITER it;
+    DIR_ENTRY *e;
+    int found = 0;
+
+    if (dir_iter_begin(fs, &it, dir_cluster) != 0) return 0;
+    while ((e = dir_iter_next(fs, &it)) != NULL) {
+        if (e->DIR_Name[0] == 0x00) break;
+        if (!is_valid_entry(e)) continue;
+        if (memcmp(e->DIR_Name, name, 11) == 0) {
+            if (pos) *pos = it.pos;
+            if (out) memcpy(out, e, sizeof(DIR_ENTRY));
+            found = 1;
+            break;
+        }
+    }
+    dir_iter_end(&it);
+    return found;
+}
+
+// appends a zeroed cluster to a directory chain, returns it or 0 when the
+// volume is full
+static unsigned int dir_grow(fat32_fs *fs, unsigned int last_cluster) {
+    unsigned char *zero = calloc(1, cluster_size(fs));
+    if (!zero) return 0;
+
+    pthread_rwlock_wrlock(&fs->fat_lock);
+    unsigned int new_cluster = find_new_cluster(fs);
+    if (new_cluster != 0) {
+        write_cluster(fs, new_cluster, FAT32_EOC);
+        write_cluster(fs, last_cluster, new_cluster);
+    }
+    pthread_rwlock_unlock(&fs->fat_lock);
+    if (new_cluster == 0) {
+        free(zero);
+        return 0;
+    }
+
+    int err = store_cluster(fs, new_cluster, zero);
+    free(zero);
+    if (err != 0) {
+        // never link in a cluster whose contents are unknown
+        pthread_rwlock_wrlock(&fs->fat_lock);
+        write_cluster(fs, last_cluster, FAT32_EOC);
+        pthread_rwlock_unlock(&fs->fat_lock);
+        fat_free_chain(fs, new_cluster);
+        return 0;
+    }
+    return new_cluster;
+}
+
+// finds a free or deleted slot in a directory, growing the chain by one
+// cluster when every slot is taken. returns 0 on success.
+static int dir_alloc_slot(fat32_fs *fs, unsigned int dir_cluster, DIR_POS *pos) {
+    pthread_mutex_lock(&fs->dir_index_lock);
+    DIR_INDEX *ix = dir_index_get(fs, dir_cluster);
+    if (ix) {
+        int ret = 0;
+        if (ix->nholes > 0) {
+            *pos = ix->holes[--ix->nholes];
+        } else if (ix->end.cluster != 0) {
+            *pos = ix->end;
+            ix->end = dir_next_pos(fs, ix->end);
+        } else {
+            unsigned int new_cluster = dir_grow(fs, ix->last_cluster);
+            if (new_cluster == 0) {
+                ret = -1;
+            } else {
+                ix->last_cluster = new_cluster;
+                pos->cluster = new_cluster;
+                pos->index = 0;
+                ix->end = dir_next_pos(fs, *pos);
+            }
+        }
+        pthread_mutex_unlock(&fs->dir_index_lock);
+        return ret;
+    }
+    pthread_mutex_unlock(&fs->dir_index_lock);
+
+    DIR_ITER it;
+    DIR_ENTRY *e;
+
+    if (dir_iter_begin(fs, &it, dir_cluster) != 0) return -1;
+    while ((e = dir_iter_next(fs, &it)) != NULL) {
+        if (is_free_slot(e)) {
+            *pos = it.pos;
+            dir_iter_end(&it);
+            return 0;
+        }
+    }
+    unsigned int last = it.pos.cluster;
+    dir_iter_end(&it);
+    if (it.error) return -1;     // never grow from the middle of the chain
+
+    unsigned int new_cluster = dir_grow(fs, last);
+    if (new_cluster == 0) return -1;
+
+    pos->cluster = new_cluster;
+    pos->index = 0;
+    return 0;
+}
+
+static int dir_put(fat32_fs *fs, const DIR_POS *pos, const DIR_ENTRY *entry) {
+    return cache_write(fs, pos->cluster, pos->index * sizeof(DIR_ENTRY),
+                       entry, sizeof(DIR_ENTRY));
+}
+
+// stores a new entry in a free slot of the directory
+static int dir_add(fat32_fs *fs, unsigned int dir_cluster, const DIR_ENTRY *entry) {
+    DIR_POS pos;
+    if (dir_alloc_slot(fs, dir_cluster, &pos) != 0) return -1;
+
+    if (dir_put(fs, &pos, entry) != 0) return -1;
+    dir_index_add(fs, dir_cluster, entry->DIR_Name, &pos);
+    return 0;
+}
+
+// gives an existing entry a new name
+static void dir_rename(fat32_fs *fs, unsigned int dir_cluster, const DIR_POS *pos,
+                       DIR_ENTRY *entry, const unsigned char name[11]) {
+    dir_index_remove(fs, dir_cluster, entry->DIR_Name);
+    memcpy(entry->DIR_Name, name, 11);
+    dir_put(fs, pos, entry);
+    dir_index_add(fs, dir_cluster, entry->DIR_Name, pos);
+}
+
+// marks an entry deleted. the slot becomes the end marker (0x00) when it
+// is the last used slot of the directory, otherwise a tombstone (0x5E).
+static void dir_remove(fat32_fs *fs, unsigned int dir_cluster, const DIR_POS *pos) {
+    unsigned char mark = 0x00;
+    unsigned char next_first = 0x00;
+    DIR_POS next = dir_next_pos(fs, *pos);
+    if (next.cluster != 0) {
+        cache_read(fs, next.cluster, next.index * sizeof(DIR_ENTRY), &next_first, 1);
+    }
+    if (next_first != 0x00) {
+        mark = 0x5E;
+    }
+
+    pthread_mutex_lock(&fs->dir_index_lock);
+    DIR_INDEX *ix = dir_index_find(fs, dir_cluster);
+    if (ix) {
+        unsigned char name[11];
+        cache_read(fs, pos->cluster, pos->index * sizeof(DIR_ENTRY), name, 11);
+        dir_index_erase(fs, ix, name);
+        if (mark == 0x00) ix->end = *pos;
+        else if (dir_index_push_hole(ix, pos) != 0) dir_index_free(fs, ix);
+    }
+    pthread_mutex_unlock(&fs->dir_index_lock);
+
+    cache_write(fs, pos->cluster, pos->index * sizeof(DIR_ENTRY), &mark, 1);
+}
+
+// returns 1 when a directory holds nothing but "." and ".."
+static int dir_is_empty(fat32_fs *fs, unsigned int dir_cluster) {
+    DIR_ITER it;
+    DIR_ENTRY *e;
+    int empty = 1;
+
+    if (dir_iter_begin(fs, &it, dir_cluster) != 0) return 0;
+    while ((e = dir_iter_next(fs, &it)) != NULL) {
+        if (e->DIR_Name[0] == 0x00) break;
+        if (!is_valid_entry(e)) continue;
+        if (e->DIR_Name[0] == '.' &&
+            (e->DIR_Name[1] == ' ' ||
+             (e->DIR_Name[1] == '.' && e->DIR_Name[2] == ' '))) {
+            continue;
+        }
+        empty = 0;
+        break;
+    }
+    dir_iter_end(&it);
+    return empty && !it.error;
+}
+
+// rewrites a directory with its live slots packed at the start, in their
+// order, followed by the end marker, and frees the clusters left empty at
+// the end of the chain. the caller holds the directory's lock for writing
+// and no positions inside it. returns the number of deleted slots dropped
+// (*freed, unless NULL, gets the clusters given back), -1 on failure.
+static long dir_compact(fat32_fs *fs, unsigned int dir_cluster, unsigned int *freed) {
+    unsigned int size = cluster_size(fs);
+    unsigned int per_cluster = size / sizeof(DIR_ENTRY);
+
+    unsigned int *chain = NULL;
+    unsigned int n = 0;
+    unsigned int cap = 0;
+    for (unsigned int c = dir_cluster; c >= 2 && c < 0x0FFFFFF8 && n <= fs->max_cluster;
+         c = fat_get(fs, c)) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            unsigned int *p = realloc(chain, cap * sizeof(unsigned int));
+            if (!p) {
+                free(chain);
+                return -1;
+            }
+            chain = p;
+        }
+        chain[n++] = c;
+    }
+    unsigned char *in = malloc(size);
+    unsigned char *out = calloc(n ? n : 1, size);
+    if (n == 0 || !in || !out) {
+        free(chain);
+        free(in);
+        free(out);
+        return -1;
+    }
+
+    unsigned long live = 0;
+    unsigned long dead = 0;
+    int end = 0;
+    for (unsigned int k = 0; k < n && !end; k++) {
+        if (read_cluster(fs, chain[k], in) != 0) {
+            free(chain);
+            free(in);
+            free(out);
+            return -1;
+        }
+        for (unsigned int j = 0; j < per_cluster; j++) {
+            DIR_ENTRY *e = (DIR_ENTRY *)(in + j * sizeof(DIR_ENTRY));
+            if (e->DIR_Name[0] == 0x00) {
+                end = 1;
+                break;
+            }
+            if (e->DIR_Name[0] == 0x5E || e->DIR_Name[0] == 0xE5) {
+                dead++;
+                continue;
+            }
+            memcpy(out + live * sizeof(DIR_ENTRY), e, sizeof(DIR_ENTRY));
+            live++;
+        }
+    }
+
+    // the first cluster stays: it is the directory's identity
+    unsigned int keep = live > 0 ? (unsigned int)((live + per_cluster - 1) / per_cluster) : 1;
+    if (dead > 0 || keep < n) {
+        int err = 0;
+        for (unsigned int k = 0; k < keep && err == 0; k++) {
+            err = store_cluster(fs, chain[k], out + (size_t)k * size);
+        }
+        for (unsigned int k = keep; k < n && err == 0; k++) {
+            cache_sync_range(fs, chain[k], 1, 1);
+        }
+        if (err != 0) {
+            // the chain is left whole so no entry is lost with it
+            dir_index_drop(fs, dir_cluster);
+            free(chain);
+            free(in);
+            free(out);
+            return -1;
+        }
+        if (keep < n) {
+            pthread_rwlock_wrlock(&fs->fat_lock);
+            write_cluster(fs, chain[keep - 1], FAT32_EOC);
+            for (unsigned int k = keep; k < n; k++) {
+                write_cluster(fs, chain[k], 0);
+            }
+            pthread_rwlock_unlock(&fs->fat_lock);
+        }
+        // every position changed; the index is rebuilt on the next lookup
+        dir_index_drop(fs, dir_cluster);
+    }
+    if (freed) *freed = n - keep;
+
+    free(chain);
+    free(in);
+    free(out);
+    return (long)dead;
+}
+
+// compacts a directory once its tombstones outnumber its names and fill at
+// least a cluster. only directories with an index are looked at, so the
+// check is free; it runs after removals, with the caller holding the
+// directory's lock for writing and no positions inside it.
+static void dir_compact_auto(fat32_fs *fs, unsigned int dir_cluster) {
+    unsigned int per_cluster = cluster_size(fs) / sizeof(DIR_ENTRY);
+
+    pthread_mutex_lock(&fs->dir_index_lock);
+    DIR_INDEX *ix = dir_index_find(fs, dir_cluster);
+    int due = ix && ix->nholes >= per_cluster && ix->nholes > ix->count;
+    pthread_mutex_unlock(&fs->dir_index_lock);
+
+    if (due) dir_compact(fs, dir_cluster, NULL);
+}
+
+//paths
+
+static unsigned int dentry_hash(const char *path, size_t len) {
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return h & (DENTRY_BUCKETS - 1);
+}
+
+// cluster of the directory whose canonical path is the first len bytes of
+// path. the caller holds dentry_lock.
+static int dentry_find(fat32_fs *fs, const char *path, size_t len, unsigned int *cluster) {
+    for (DENTRY *d = fs->dentries[dentry_hash(path, len)]; d; d = d->next) {
+        if (strlen(d->path) == len && memcmp(d->path, path, len) == 0) {
+            *cluster = d->cluster;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void dentry_clear(fat32_fs *fs) {
+    while (fs->dentry_all) {
+        DENTRY *d = fs->dentry_all;
+        fs->dentry_all = d->all_next;
+        free(d->path);
+        free(d);
+    }
+    memset(fs->dentries, 0, sizeof(fs->dentries));
+    fs->dentry_count = 0;
+}
+
+static void dentry_add(fat32_fs *fs, const char *path, size_t len, unsigned int cluster) {
+    pthread_mutex_lock(&fs->dentry_lock);
+    unsigned int known;
+    if (dentry_find(fs, path, len, &known)) {
+        pthread_mutex_unlock(&fs->dentry_lock);
+        return;
+    }
+    if (fs->dentry_count >= DENTRY_MAX) dentry_clear(fs);
+
+    DENTRY *d = malloc(sizeof(DENTRY));
+    char *copy = malloc(len + 1);
+    if (d && copy) {
+        memcpy(copy, path, len);
+        copy[len] = '\0';
+        unsigned int b = dentry_hash(path, len);
+        d->path = copy;
+        d->cluster = cluster;
+        d->next = fs->dentries[b];
+        fs->dentries[b] = d;
+        d->all_next = fs->dentry_all;
+        fs->dentry_all = d;
+        fs->dentry_count++;
+    } else {
+        free(d);
+        free(copy);
+    }
+    pthread_mutex_unlock(&fs->dentry_lock);
+}
+
+// forgets the directory with canonical path prefix and everything below it
+static void dentry_drop(fat32_fs *fs, const char *prefix) {
+    size_t len = strlen(prefix);
+    pthread_mutex_lock(&fs->dentry_lock);
+    DENTRY **link = &fs->dentry_all;
+    while (*link) {
+        DENTRY *d = *link;
+        if (strncmp(d->path, prefix, len) != 0) {
+            link = &d->all_next;
+            continue;
+        }
+        *link = d->all_next;
+
+        DENTRY **b = &fs->dentries[dentry_hash(d->path, strlen(d->path))];
+        while (*b != d) b = &(*b)->next;
+        *b = d->next;
+        free(d->path);
+        free(d);
+        fs->dentry_count--;
+    }
+    pthread_mutex_unlock(&fs->dentry_lock);
+}
+
+// turns a path into canonical form in out: absolute, with "." and ".."
+// folded, names as stored (upper case, at most 11 characters) and a '/'
+// after every component, so the root is "/" and a directory "/A/B/".
+// ".." is applied to the text, as shells do. returns -1 when the result
+// does not fit in cap bytes.
+static int path_canon(fat32_fs *fs, const char *path, char *out, size_t cap) {
+    size_t len;
+    if (path[0] == '/') {
+        out[0] = '/';
+        len = 1;
+    } else {
+        len = strlen(fs->current_path);
+        if (len >= cap) return -1;
+        memcpy(out, fs->current_path, len);
+    }
+
+    const char *p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        const char *name = p;
+        while (*p && *p != '/') p++;
+        size_t n = (size_t)(p - name);
+
+        if (n == 0 || (n == 1 && name[0] == '.')) continue;
+        if (n == 2 && name[0] == '.' && name[1] == '.') {
+            // the root is its own parent
+            if (len > 1) {
+                len--;
+                while (out[len - 1] != '/') len--;
+            }
+            continue;
+        }
+        if (n > 11) n = 11;
+        if (len + n + 2 > cap) return -1;
+        for (size_t i = 0; i < n; i++) {
+            out[len++] = (char)toupper((unsigned char)name[i]);
+        }
+        out[len++] = '/';
+    }
+    out[len] = '\0';
+    return 0;
+}
+
+// length of the parent's part of a canonical path of length len > 1
+static size_t path_parent_len(const char *canon, size_t len) {
+    len--;
+    while (canon[len - 1] != '/') len--;
+    return len;
+}
+
+// first cluster of the directory at a canonical path. resolution starts
+// from the longest known prefix (a cached one or the current directory)
+// and caches every directory found below it. returns 0 on success, -1
+// when a component does not exist and -2 when one is not a directory.
+static int path_lookup_dir(fat32_fs *fs, const char *canon, unsigned int *cluster) {
+    size_t len = strlen(canon);
+    size_t cur = strlen(fs->current_path);
+    int below_cwd = strncmp(canon, fs->current_path, cur) == 0;
+    size_t known = len;
+    unsigned int dir;
+
+    for (;;) {
+        if (below_cwd && known == cur) {
+            dir = fs->current_cluster;
+            break;
+        }
+        if (known == 1) {
+            dir = fs->bpb.BPB_RootClus;
+            break;
+        }
+        pthread_mutex_lock(&fs->dentry_lock);
+        int hit = dentry_find(fs, canon, known, &dir);
+        pthread_mutex_unlock(&fs->dentry_lock);
+        if (hit) break;
+        known = path_parent_len(canon, known);
+    }
+
+    while (known < len) {
+        const char *name = canon + known;
+        size_t n = (size_t)(strchr(name, '/') - name);
+        char part[12];
+        unsigned char short_name[11];
+        memcpy(part, name, n);
+        part[n] = '\0';
+        make_short_name(part, short_name);
+
+        DIR_ENTRY entry;
+        pthread_rwlock_rdlock(dir_lock(fs, dir));
+        int found = dir_lookup(fs, dir, short_name, NULL, &entry);
+        pthread_rwlock_unlock(dir_lock(fs, dir));
+        if (!found) return -1;
+        if (!(entry.DIR_Attr & ATTR_DIRECTORY)) return -2;
+
+        dir = ((unsigned int)entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
+        if (dir == 0) return -1;
+        known += n + 1;
+        dentry_add(fs, canon, known, dir);
+    }
+    *cluster = dir;
+    return 0;
+}
+
+// splits a path into the directory holding its last component and that
+// component's short name. unless canon is NULL it receives the canonical
+// path of the component itself ("/A/B/NAME/"; the directory's path is its
+// path_parent_len() prefix). returns 0 on success, -1 or -2 as
+// path_lookup_dir() does for the directory, -3 when the path is too long
+// and -4 for the root (canon is "/" then).
+static int path_parse(fat32_fs *fs, const char *path, unsigned int *dir, char *canon,
+                      unsigned char name[11]) {
+    char buf[PATH_MAX_LEN];
+    if (!canon) canon = buf;
+
+    // a plain name lives in the current directory
+    if (path[0] != '\0' && !strchr(path, '/') &&
+        strcmp(path, ".") != 0 && strcmp(path, "..") != 0) {
+        make_short_name(path, name);
+        if (canon != buf) {
+            size_t len = strlen(fs->current_path);
+            size_t n = 11;
+            while (n > 0 && name[n - 1] == ' ') n--;
+            if (len + n + 2 > PATH_MAX_LEN) return -3;
+            memcpy(canon, fs->current_path, len);
+            memcpy(canon + len, name, n);
+            strcpy(canon + len + n, "/");
+        }
+        *dir = fs->current_cluster;
+        return 0;
+    }
+
+    if (path_canon(fs, path, canon, PATH_MAX_LEN) != 0) return -3;
+    size_t len = strlen(canon);
+    if (len == 1) return -4;
+
+    size_t parent = path_parent_len(canon, len);
+    char part[12];
+    memcpy(part, canon + parent, len - parent - 1);
+    part[len - parent - 1] = '\0';
+    make_short_name(part, name);
+
+    canon[parent] = '\0';
+    int r = path_lookup_dir(fs, canon, dir);
+    canon[parent] = part[0];
+    return r;
+}
+
+// reports why path_parse() failed with r
+static void path_report(fat32_fs *fs, const char *path, int r) {
+    switch (r) {
+    case -1:
+        report_error(fs, "directory does not exist.\n");
+        break;
+    case -2:
+        report_error(fs, "a component of %s is not a directory.\n", path);
+        break;
+    case -3:
+        report_error(fs, "path too long.\n");
+        break;
+    default:
+        report_error(fs, "the root directory has no name.\n");
+        break;
+    }
+}
+
+// path_parse() for shell commands: reports why it failed
+static int path_split(fat32_fs *fs, const char *path, unsigned int *dir, char *canon,
+                      unsigned char name[11]) {
+    int r = path_parse(fs, path, dir, canon, name);
+    if (r != 0) path_report(fs, path, r);
+    return r == 0 ? 0 : -1;
+}
+
+// copies the entry a path names into *out. returns 1 when found.
+int find_entry(fat32_fs *fs, const char *target, DIR_ENTRY *out) {
+    unsigned int dir;
+    unsigned char short_name[11];
+    if (path_parse(fs, target, &dir, NULL, short_name) != 0) return 0;
+
+    pthread_rwlock_rdlock(dir_lock(fs, dir));
+    int found = dir_lookup(fs, dir, short_name, NULL, out);
+    pthread_rwlock_unlock(dir_lock(fs, dir));
+    return found;
+}
+
+unsigned int get_parent_cluster(fat32_fs *fs) {
+    char canon[PATH_MAX_LEN];
+    unsigned int parent;
+    if (path_canon(fs, "..", canon, sizeof(canon)) != 0 ||
+        path_lookup_dir(fs, canon, &parent) != 0) {
+        return fs->bpb.BPB_RootClus;
+    }
+    return parent;
+}
+
+//open file extents
+
+static void extents_clear(OPEN_INODE *of) {
+    free(of->extents);
+    of->extents = NULL;
+    of->n_extents = 0;
+    of->extents_cap = 0;
+    of->n_clusters = 0;
+}
+
+// adds the next physical cluster of the file, merging it into the last
+// run when it is contiguous
+static int extents_append(OPEN_INODE *of, unsigned int cluster) {
+    if (of->n_extents > 0) {
+        EXTENT *last = &of->extents[of->n_extents - 1];
+        if (last->start + last->length == cluster) {
+            last->length++;
+            of->n_clusters++;
+            return 0;
+        }
+    }
+
+    if (of->n_extents == of->extents_cap) {
+        unsigned int cap = of->extents_cap ? of->extents_cap * 2 : 8;
+        EXTENT *extents = realloc(of->extents, cap * sizeof(EXTENT));
+        if (!extents) return -1;
+        of->extents = extents;
+        of->extents_cap = cap;
+    }
+
+    EXTENT *e = &of->extents[of->n_extents++];
+    e->file_index = of->n_clusters;
+    e->start = cluster;
+    e->length = 1;
+    of->n_clusters++;
+    return 0;
+}
+
+static int extents_append_run(OPEN_INODE *of, unsigned int start,
+                              unsigned int len) {
+    if (extents_append(of, start) != 0) return -1;
+
+    // the rest of the run is contiguous with the first cluster
+    of->extents[of->n_extents - 1].length += len - 1;
+    of->n_clusters += len - 1;
+    return 0;
+}
+
+// walks the file's cluster chain once and records it as runs
+static int extents_build(fat32_fs *fs, OPEN_INODE *of) {
+    extents_clear(of);
+
+    unsigned int cluster = of->cluster;
+    pthread_rwlock_rdlock(&fs->fat_lock);
+    while (cluster >= 2 && cluster < 0x0FFFFFF8) {
+        if (extents_append(of, cluster) != 0) {
+            pthread_rwlock_unlock(&fs->fat_lock);
+            extents_clear(of);
+            return -1;
+        }
+        // guard against cyclic chains
+        if (of->n_clusters > fs->max_cluster) break;
+        cluster = fat_entry(fs, cluster);
+    }
+    pthread_rwlock_unlock(&fs->fat_lock);
+    return 0;
+}
+
+// physical cluster holding the file's index-th cluster, 0 when the chain
+// is shorter than that
+static unsigned int extents_lookup(OPEN_INODE *of, unsigned int index) {
+    if (index >= of->n_clusters) return 0;
+
+    unsigned int lo = 0;
+    unsigned int hi = of->n_extents;
+    while (hi - lo > 1) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (of->extents[mid].file_index <= index) lo = mid;
+        else hi = mid;
+    }
+    EXTENT *e = &of->extents[lo];
+    return e->start + (index - e->file_index);
+}
+
+// like extents_lookup, but grows the chain with new clusters up to index.
+// returns 0 when the volume is full.
+// every missing cluster is requested from the allocator at once, so the
+// growth lands in as few contiguous runs as free space allows.
+static unsigned int extents_reserve(fat32_fs *fs, OPEN_INODE *of, unsigned int index) {
+    pthread_rwlock_wrlock(&fs->fat_lock);
+    while (of->n_clusters <= index) {
+        unsigned int last = of->n_clusters ? extents_lookup(of, of->n_clusters - 1) : 0;
+        unsigned int start;
+        unsigned int got = alloc_run(fs, last ? last + 1 : 0,
+                                     index + 1 - of->n_clusters, &start);
+        if (got == 0) break;
+
+        // the extent first: if it cannot be recorded the run is simply
+        // never linked, instead of hanging off a chain the extents miss
+        if (extents_append_run(of, start, got) != 0) break;
+        fat_link_run(fs, start, got);
+        if (last) {
+            write_cluster(fs, last, start);
+        }
+    }
+    pthread_rwlock_unlock(&fs->fat_lock);
+    return extents_lookup(of, index);
+}
+
+// maps a byte offset of the file to its byte offset in the image and
+// stores in *span how many bytes from there are physically contiguous.
+// *span is 0 past the end of the chain.
+static uint64_t extents_span(fat32_fs *fs, OPEN_INODE *of, unsigned int offset,
+                                 unsigned int *span) {
+    unsigned int clus_size = cluster_size(fs);
+    unsigned int index = offset / clus_size;
+
+    *span = 0;
+    if (index >= of->n_clusters) return 0;
+
+    unsigned int lo = 0;
+    unsigned int hi = of->n_extents;
+    while (hi - lo > 1) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (of->extents[mid].file_index <= index) lo = mid;
+        else hi = mid;
+    }
+    EXTENT *e = &of->extents[lo];
+    unsigned int run_end = (e->file_index + e->length) * clus_size;
+    *span = run_end - offset;
+    return cluster_offset(fs, e->start + (index - e->file_index)) + offset % clus_size;
+}
+
+// copies up to len bytes of file data starting at offset into buf, one
+// transfer per contiguous run. returns the number of bytes copied.
+static unsigned int file_read_data(fat32_fs *fs, OPEN_INODE *of, unsigned int offset,
+                                   unsigned char *buf, unsigned int len) {
+    unsigned int clus_size = cluster_size(fs);
+    unsigned int done = 0;
+
+    while (done < len) {
+        unsigned int span;
+        uint64_t phys = extents_span(fs, of, offset + done, &span);
+        if (span == 0) break;
+
+        unsigned int n = (len - done < span) ? len - done : span;
+        uint64_t first = phys / clus_size;
+        uint64_t last = (phys + n - 1) / clus_size;
+        unsigned int cluster = extents_lookup(of, (offset + done) / clus_size);
+        unsigned int count = (unsigned int)(last - first + 1);
+        if (!clusters_in_image(fs, cluster, count) ||
+            cache_sync_range(fs, cluster, count, 0) != 0 ||
+            image_read(fs, phys, buf + done, n) != 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// zeroes clusters [from, to) of the file in the image, one write per
+// contiguous run (or chunk of it), dropping any cached copies. the caller
+// holds the inode lock. returns 0 on success.
+static int extents_zero(fat32_fs *fs, OPEN_INODE *of, unsigned int from, unsigned int to) {
+    unsigned int clus_size = cluster_size(fs);
+    uint64_t total = (uint64_t)(to - from) * clus_size;
+    if (from >= to) return 0;
+
+    unsigned int chunk = total < IO_MAX_CHUNK ? (unsigned int)total : IO_MAX_CHUNK;
+    unsigned char *zero = calloc(1, chunk);
+    if (!zero) return -1;
+
+    int err = 0;
+    unsigned int index = from;
+    while (index < to && err == 0) {
+        unsigned int span;
+        uint64_t phys = extents_span(fs, of, index * clus_size, &span);
+        unsigned int n = span / clus_size;
+        if (n > to - index) n = to - index;
+        if (n > chunk / clus_size) n = chunk / clus_size;
+        if (n == 0) {
+            err = -1;
+            break;
+        }
+        unsigned int cluster = extents_lookup(of, index);
+        if (!clusters_in_image(fs, cluster, n) ||
+            cache_sync_range(fs, cluster, n, 1) != 0 ||
+            image_write(fs, phys, zero, n * clus_size) != 0) {
+            err = -1;
+        }
+        index += n;
+    }
+    free(zero);
+    return err;
+}
+
+// writes len bytes at offset, growing the chain as needed. whole clusters
+// of each contiguous run go to the image in one transfer; partial clusters
+// at the edges are merged through the cache. returns 0 on success.
+static int file_write_data(fat32_fs *fs, OPEN_INODE *of, unsigned int offset,
+                           const unsigned char *buf, unsigned int len) {
+    unsigned int clus_size = cluster_size(fs);
+    if (len == 0) return 0;
+
+    if (extents_reserve(fs, of, (offset + len - 1) / clus_size) == 0) {
+        return -1;
+    }
+
+    unsigned int done = 0;
+    while (done < len) {
+        unsigned int pos = offset + done;
+        unsigned int span;
+        extents_span(fs, of, pos, &span);
+        unsigned int n = (len - done < span) ? len - done : span;
+        unsigned int cluster = extents_lookup(of, pos / clus_size);
+        unsigned int in_cluster = pos % clus_size;
+
+        if (in_cluster != 0 || n < clus_size) {
+            // partial cluster
+            unsigned int part = clus_size - in_cluster;
+            if (part > n) part = n;
+            if (cache_write(fs, cluster, in_cluster, buf + done, part) != 0) return -1;
+            done += part;
+            continue;
+        }
+
+        unsigned int whole = n / clus_size;
+        if (whole * clus_size > IO_MAX_CHUNK) whole = IO_MAX_CHUNK / clus_size;
+        cache_sync_range(fs, cluster, whole, 1);
+        if (image_write(fs, cluster_offset(fs, cluster), buf + done, whole * clus_size) != 0) {
+            return -1;
+        }
+        done += whole * clus_size;
+    }
+    return 0;
+}
+
+//open file table
+
+static OPEN_INODE *open_inode_find(fat32_fs *fs, unsigned int dir_cluster,
+                                   const unsigned char name[11]) {
+    if (!fs->open_buckets) return NULL;
+
+    OPEN_INODE *ino = fs->open_buckets[name_hash(name) & (fs->open_nbuckets - 1)];
+    while (ino) {
+        if (ino->dir_cluster == dir_cluster && memcmp(ino->name, name, 11) == 0) {
+            return ino;
+        }
+        ino = ino->hash_next;
+    }
+    return NULL;
+}
+
+// an open file with this name, preferring one in the current directory
+static OPEN_INODE *open_inode_by_name(fat32_fs *fs, const unsigned char name[11]) {
+    if (!fs->open_buckets) return NULL;
+
+    OPEN_INODE *found = NULL;
+    OPEN_INODE *ino = fs->open_buckets[name_hash(name) & (fs->open_nbuckets - 1)];
+    while (ino) {
+        if (memcmp(ino->name, name, 11) == 0) {
+            if (ino->dir_cluster == fs->current_cluster) return ino;
+            if (!found) found = ino;
+        }
+        ino = ino->hash_next;
+    }
+    return found;
+}
+
+static int open_buckets_grow(fat32_fs *fs) {
+    unsigned int nbuckets = fs->open_nbuckets ? fs->open_nbuckets * 2 : 64;
+    OPEN_INODE **buckets = calloc(nbuckets, sizeof(OPEN_INODE *));
+    if (!buckets) return -1;
+
+    for (unsigned int b = 0; b < fs->open_nbuckets; b++) {
+        OPEN_INODE *ino = fs->open_buckets[b];
+        while (ino) {
+            OPEN_INODE *next = ino->hash_next;
+            unsigned int nb = name_hash((unsigned char *)ino->name) & (nbuckets - 1);
+            ino->hash_next = buckets[nb];
+            buckets[nb] = ino;
+            ino = next;
+        }
+    }
+    free(fs->open_buckets);
+    fs->open_buckets = buckets;
+    fs->open_nbuckets = nbuckets;
+    return 0;
+}
+
+// shared state for a file, created with its extent map on first open
+static OPEN_INODE *open_inode_get(fat32_fs *fs, unsigned int dir_cluster,
+                                  const char *dir_path, const DIR_ENTRY *entry) {
+    const unsigned char *name = entry->DIR_Name;
+    OPEN_INODE *ino = open_inode_find(fs, dir_cluster, name);
+    if (ino) return ino;
+
+    if (fs->open_ninodes + 1 > fs->open_nbuckets && open_buckets_grow(fs) != 0) {
+        return NULL;
+    }
+
+    ino = calloc(1, sizeof(OPEN_INODE));
+    if (!ino) return NULL;
+    memcpy(ino->name, name, 11);
+    ino->name[11] = '\0';
+    ino->dir_cluster = dir_cluster;
+    ino->cluster = ((unsigned int)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    ino->size = entry->DIR_FileSize;
+    ino->first_handle = -1;
+    strncpy(ino->path, dir_path, sizeof(ino->path) - 1);
+    if (extents_build(fs, ino) != 0) {
+        free(ino);
+        return NULL;
+    }
+    pthread_rwlock_init(&ino->lock, NULL);
+
+    unsigned int b = name_hash(name) & (fs->open_nbuckets - 1);
+    ino->hash_next = fs->open_buckets[b];
+    fs->open_buckets[b] = ino;
+    fs->open_ninodes++;
+    return ino;
+}
+
+static void open_inode_release(fat32_fs *fs, OPEN_INODE *ino) {
+    OPEN_INODE **link = &fs->open_buckets[name_hash((unsigned char *)ino->name) & (fs->open_nbuckets - 1)];
+    while (*link) {
+        if (*link == ino) {
+            *link = ino->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    fs->open_ninodes--;
+    extents_clear(ino);
+    pthread_rwlock_destroy(&ino->lock);
+    free(ino);
+}
+
+static int handle_alloc(fat32_fs *fs) {
+    if (fs->open_free < 0) {
+        unsigned int cap = fs->open_files_cap ? fs->open_files_cap * 2 : 16;
+        OPEN_FILE *files = realloc(fs->open_files, cap * sizeof(OPEN_FILE));
+        if (!files) return -1;
+        // new slots go on the free list, lowest handle first
+        for (unsigned int i = cap; i-- > fs->open_files_cap; ) {
+            files[i].using = 0;
+            files[i].file = NULL;
+            files[i].next = fs->open_free;
+            fs->open_free = (int)i;
+        }
+        fs->open_files = files;
+        fs->open_files_cap = cap;
+    }
+
+    int h = fs->open_free;
+    fs->open_free = fs->open_files[h].next;
+    return h;
+}
+
+static void handle_release(fat32_fs *fs, int h) {
+    OPEN_FILE *of = &fs->open_files[h];
+    OPEN_INODE *ino = of->file;
+
+    int *link = &ino->first_handle;
+    while (*link >= 0) {
+        if (*link == h) {
+            *link = of->next;
+            break;
+        }
+        link = &fs->open_files[*link].next;
+    }
+    if (ino->first_handle < 0) {
+        open_inode_release(fs, ino);
+    }
+
+    of->using = 0;
+    of->file = NULL;
+    of->offset = 0;
+    of->mode = 0;
+    of->next = fs->open_free;
+    fs->open_free = h;
+}
+
+// resolves a file argument to a handle: "#N" names handle N directly, a
+// path or file name selects the only handle open on that file (a bare
+// name preferring the current directory). returns -1 when nothing
+// matches; *ambiguous is set when the file has several handles.
+static int resolve_handle(fat32_fs *fs, const char *arg, int *ambiguous) {
+    *ambiguous = 0;
+    if (arg[0] == '#') {
+        char *end;
+        unsigned long h = strtoul(arg + 1, &end, 10);
+        if (*end != '\0' || arg[1] == '\0' || h >= fs->open_files_cap ||
+            !fs->open_files[h].using) {
+            return -1;
+        }
+        return (int)h;
+    }
+
+    unsigned char short_name[11];
+    OPEN_INODE *ino;
+    if (strchr(arg, '/')) {
+        unsigned int dir;
+        if (path_parse(fs, arg, &dir, NULL, short_name) != 0) return -1;
+        ino = open_inode_find(fs, dir, short_name);
+    } else {
+        make_short_name(arg, short_name);
+        ino = open_inode_by_name(fs, short_name);
+    }
+    if (!ino) return -1;
+    if (fs->open_files[ino->first_handle].next >= 0) {
+        *ambiguous = 1;
+        return -1;
+    }
+    return ino->first_handle;
+}
+
+static void open_table_clear(fat32_fs *fs) {
+    for (unsigned int i = 0; i < fs->open_files_cap; i++) {
+        if (fs->open_files[i].using) handle_release(fs, (int)i);
+    }
+    free(fs->open_files);
+    free(fs->open_buckets);
+    fs->open_files = NULL;
+    fs->open_files_cap = 0;
+    fs->open_free = -1;
+    fs->open_buckets = NULL;
+    fs->open_nbuckets = 0;
+    fs->open_ninodes = 0;
+}
+
+//mount
+
+static void fs_locks_init(fat32_fs *fs) {
+    pthread_rwlock_init(&fs->open_lock, NULL);
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&fs->dir_locks[i], NULL);
+    }
+    pthread_mutex_init(&fs->dir_index_lock, NULL);
+    pthread_mutex_init(&fs->dentry_lock, NULL);
+    pthread_rwlock_init(&fs->fat_lock, NULL);
+    pthread_mutex_init(&fs->cache_lock, NULL);
+    pthread_mutex_init(&fs->trace_lock, NULL);
+    pthread_mutex_init(&fs->cmd_stats_lock, NULL);
+}
+
+static void fs_locks_destroy(fat32_fs *fs) {
+    pthread_rwlock_destroy(&fs->open_lock);
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++) {
+        pthread_rwlock_destroy(&fs->dir_locks[i]);
+    }
+    pthread_mutex_destroy(&fs->dir_index_lock);
+    pthread_mutex_destroy(&fs->dentry_lock);
+    pthread_rwlock_destroy(&fs->fat_lock);
+    pthread_mutex_destroy(&fs->cache_lock);
+    pthread_mutex_destroy(&fs->trace_lock);
+    pthread_mutex_destroy(&fs->cmd_stats_lock);
+}
+
+fat32_fs *fat32_mount(const char *filename, int flags) {
+    fat32_fs *fs = calloc(1, sizeof(fat32_fs));
+    if (!fs) {
+        return NULL;
+    }
+    fs->image_fd = -1;
+    fs->open_free = -1;
+    fs->next_free = 2;
+    fs->cache_head = fs->cache_tail = -1;
+    fs->cache_capacity = CACHE_DEFAULT_SLOTS;
+    fs->use_mmap = (flags & FAT32_MOUNT_MMAP) != 0;
+    strcpy(fs->current_path, "/");
+    fs_locks_init(fs);
+
+    if ((fs->fp = fopen(filename, "rb+")) == NULL) {
+        fs_locks_destroy(fs);
+        free(fs);
+        return NULL;
+    }
+
+    fs->fp_name = malloc(strlen(filename) + 1);
+    if (!fs->fp_name) {
+        fclose(fs->fp);
+        fs_locks_destroy(fs);
+        free(fs);
+        return NULL;
+    }
+    strcpy(fs->fp_name, filename);
+
+    // read BPB
+    fs->image_fd = fileno(fs->fp);
+    if (io_size(fs->image_fd, &fs->image_size) != 0 ||
+        image_read(fs, 0, &fs->bpb, sizeof(BPB)) != 0) {
+        fclose(fs->fp);
+        free(fs->fp_name);
+        fs_locks_destroy(fs);
+        free(fs);
+        return NULL;
+    }
+
+    // images that cannot be mapped fall back to stdio access
+    if (fs->use_mmap && image_map_open(fs) != 0) {
+        fprintf(stderr, "Warning: could not map image, using stdio access.\n");
+    }
+
+    // set current directory to root
+    fs->current_cluster = fs->bpb.BPB_RootClus;
+    fs->fat_start_off = (uint64_t)fs->bpb.BPB_RsvdSecCnt * fs->bpb.BPB_BytsPerSec;
+
+    fs->cache_hits = fs->cache_misses = 0;
+    if (fat_load(fs) != 0 || alloc_init(fs) != 0 || cache_init(fs) != 0) {
+        alloc_release(fs);
+        fat_release(fs);
+        image_map_close(fs);
+        fclose(fs->fp);
+        free(fs->fp_name);
+        fs_locks_destroy(fs);
+        free(fs);
+        return NULL;
+    }
+
+    return fs;
+}
+
+// returns -1 when cached clusters, the FAT or FSInfo could not all be
+// written; whatever failed stays dirty for the next try
+int fat32_sync(fat32_fs *fs) {
+    if (!fs->fp) return 0;
+    int err = 0;
+    if (cache_flush(fs) != 0) err = -1;
+    if (fat_flush(fs) != 0) err = -1;
+    pthread_rwlock_rdlock(&fs->fat_lock);
+    if (alloc_sync_fsinfo(fs) != 0) err = -1;
+    pthread_rwlock_unlock(&fs->fat_lock);
+    image_map_sync(fs);
+    return err;
+}
+
+// returns -1 when something could not be written back; the mount is
+// released either way
+int fat32_unmount(fat32_fs *fs) {
+    int err = 0;
+    if (!fs) return 0;
+    if (fs->fp) {
+        open_table_clear(fs);
+        dir_index_drop_all(fs);
+        dentry_drop(fs, "/");
+        if (cache_flush(fs) != 0) err = -1;
+        cache_free(fs);
+        if (fat_flush(fs) != 0) err = -1;
+        if (alloc_sync_fsinfo(fs) != 0) err = -1;
+        alloc_release(fs);
+        fat_release(fs);
+        image_map_sync(fs);
+        image_map_close(fs);
+        fclose(fs->fp);
+        fs->fp = NULL;
+        fs->image_fd = -1;
+    }
+    fat32_trace_stop(fs);
+    free(fs->fp_name);
+    fs_locks_destroy(fs);
+    free(fs);
+    return err;
+}
+
+//commands
+
+void info_cmd(fat32_fs *fs) {
+    printf("Root cluster: %u\n", fs->bpb.BPB_RootClus);
+    printf("Bytes per sector: %u\n", fs->bpb.BPB_BytsPerSec);
+    printf("Sectors per cluster: %u\n", fs->bpb.BPB_SecPerClus);
+
+    unsigned int dataSectors =
+        fs->bpb.BPB_TotSec32 -
+        (fs->bpb.BPB_RsvdSecCnt + fs->bpb.BPB_NumFATs * fs->bpb.BPB_FATSz32);
+    unsigned int totalClusters = dataSectors / fs->bpb.BPB_SecPerClus;
+    printf("Total clusters in data region: %u\n", totalClusters);
+
+    unsigned int entriesPerFAT =
+        (fs->bpb.BPB_FATSz32 * fs->bpb.BPB_BytsPerSec) / 4;
+    printf("# of entries in one FAT: %u\n", entriesPerFAT);
+
+    printf("Size of image (bytes): %llu\n", (unsigned long long)fs->image_size);
+}
+
+// resolves a directory argument of a shell command (NULL = the current
+// directory) into its cluster and, unless canon is NULL, canonical path.
+// reports why it failed.
+static int path_dir_cmd(fat32_fs *fs, const char *path, unsigned int *cluster, char *canon) {
+    char buf[PATH_MAX_LEN];
+    if (!canon) canon = buf;
+    if (!path) {
+        strcpy(canon, fs->current_path);
+        *cluster = fs->current_cluster;
+        return 0;
+    }
+    if (path_canon(fs, path, canon, PATH_MAX_LEN) != 0) {
+        report_error(fs, "path too long.\n");
+        return -1;
+    }
+
+    int r = path_lookup_dir(fs, canon, cluster);
+    if (r == -1) {
+        report_error(fs, "directory not found.\n");
+    } else if (r == -2) {
+        report_error(fs, "%s is not a directory.\n", path);
+    }
+    return r == 0 ? 0 : -1;
+}
+
+void ls_cmd(fat32_fs *fs, char *path) {
+    DIR_ITER it;
+    DIR_ENTRY *e;
+    unsigned int dir;
+
+    if (path_dir_cmd(fs, path, &dir, NULL) != 0) {
+        return;
+    }
+    // the first cluster is read by dir_iter_begin, so lock before it
+    pthread_rwlock_rdlock(dir_lock(fs, dir));
+    if (dir_iter_begin(fs, &it, dir) != 0) {
+        pthread_rwlock_unlock(dir_lock(fs, dir));
+        report_error(fs, "could not read the directory for ls.\n");
+        return;
+    }
+
+    while ((e = dir_iter_next(fs, &it)) != NULL) {
+        if (e->DIR_Name[0] == 0x00) break;
+        if (!is_valid_entry(e)) continue;
+
+        char name[12];
+        memcpy(name, e->DIR_Name, 11);
+        name[11] = '\0';
+
+        for (int j = 10; j >= 0; j--) {
+            if (name[j] == ' ') name[j] = '\0';
+            else break;
+        }
+
+        printf("%s\n", name);
+    }
+
+    pthread_rwlock_unlock(dir_lock(fs, dir));
+    dir_iter_end(&it);
+}
+
+void cd_cmd(fat32_fs *fs, char *name) {
+    if (!name) {
+        report_error(fs, "cd needs a directory name.\n");
+        return;
+    }
+
+    char canon[PATH_MAX_LEN];
+    unsigned int clus;
+    if (path_dir_cmd(fs, name, &clus, canon) != 0) {
+        return;
+    }
+
+    fs->current_cluster = clus;
+    strcpy(fs->current_path, canon);
+}
+
+// creates the directory name in dir and stores its first cluster in
+// *cluster. the caller holds dir's lock for writing. returns an error
+// message or NULL.
+static const char *dir_make(fat32_fs *fs, unsigned int dir, const unsigned char name[11],
+                            unsigned int *cluster) {
+    unsigned int size2 = cluster_size(fs);
+    unsigned char *buffer2 = calloc(1, size2);
+    if (!buffer2) {
+        return "could not allocate memory for mkdir.\n";
+    }
+
+    if (dir_lookup(fs, dir, name, NULL, NULL)) {
+        free(buffer2);
+        return "name already exists in directory.\n";
+    }
+
+    pthread_rwlock_wrlock(&fs->fat_lock);
+    unsigned int my_cluster = find_new_cluster(fs);
+    if (my_cluster != 0) {
+        write_cluster(fs, my_cluster, FAT32_EOC);
+    }
+    pthread_rwlock_unlock(&fs->fat_lock);
+    if (my_cluster == 0) {
+        free(buffer2);
+        return "no free clusters for directory.\n";
+    }
+
+    DIR_ENTRY *entries2 = (DIR_ENTRY *)buffer2;
+
+    unsigned char dot[11];
+    memset(dot, ' ', 11);
+    dot[0] = '.';
+
+    DIR_ENTRY *entry2 = &entries2[0];
+    memcpy(entry2->DIR_Name, dot, 11);
+    entry2->DIR_Attr      = ATTR_DIRECTORY;
+    entry2->DIR_FstClusHI = (unsigned short)(my_cluster >> 16);
+    entry2->DIR_FstClusLO = (unsigned short)(my_cluster & 0xFFFF);
+    entry2->DIR_FileSize  = 0;
+
+    unsigned char dot2[11];
+    memset(dot2, ' ', 11);
+    dot2[0] = '.';
+    dot2[1] = '.';
+
+    DIR_ENTRY *entry3 = &entries2[1];
+    memcpy(entry3->DIR_Name, dot2, 11);
+    entry3->DIR_Attr      = ATTR_DIRECTORY;
+    entry3->DIR_FstClusHI = (unsigned short)(dir >> 16);
+    entry3->DIR_FstClusLO = (unsigned short)(dir & 0xFFFF);
+    entry3->DIR_FileSize  = 0;
+
+    // the new directory is complete before its entry makes it reachable
+    int err = store_cluster(fs, my_cluster, buffer2);
+    free(buffer2);
+    if (err != 0) {
+        fat_free_chain(fs, my_cluster);
+        return "could not write the directory.\n";
+    }
+
+    DIR_ENTRY entry;
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.DIR_Name, name, 11);
+    entry.DIR_Attr = ATTR_DIRECTORY;
+    entry.DIR_FstClusHI = (unsigned short)(my_cluster >> 16);
+    entry.DIR_FstClusLO = (unsigned short)(my_cluster & 0xFFFF);
+    entry.DIR_FileSize  = 0;
+    if (dir_add(fs, dir, &entry) != 0) {
+        fat_free_chain(fs, my_cluster);
+        return "no space in directory.\n";
+    }
+    *cluster = my_cluster;
+    return NULL;
+}
+
+void mkdir_cmd(fat32_fs *fs, char *dirname) {
+    if (!dirname) {
+        report_error(fs, "mkdir needs a name.\n");
+        return;
+    }
+
+    unsigned char short_dirname[11];
+    unsigned int dir;
+    if (path_split(fs, dirname, &dir, NULL, short_dirname) != 0) {
+        return;
+    }
+
+    unsigned int cluster;
+    pthread_rwlock_wrlock(dir_lock(fs, dir));
+    const char *err = dir_make(fs, dir, short_dirname, &cluster);
+    pthread_rwlock_unlock(dir_lock(fs, dir));
+    if (err) {
+        report_error(fs, "%s", err);
+    }
+}
+
+void creat_cmd(fat32_fs *fs, char *filename) {
+    if (!filename) {
+        report_error(fs, "creat needs a filename.\n");
+        return;
+    }
+
+    unsigned char short_filename[11];
+    unsigned int dir;
+    if (path_split(fs, filename, &dir, NULL, short_filename) != 0) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(dir_lock(fs, dir));
+    if (dir_lookup(fs, dir, short_filename, NULL, NULL)) {
+        pthread_rwlock_unlock(dir_lock(fs, dir));
+        report_error(fs, "filename already exists here.\n");
+        return;
+    }
+
+    DIR_ENTRY entry;
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.DIR_Name, short_filename, 11);
+    entry.DIR_Attr = ATTR_ARCHIVE;
+    entry.DIR_FstClusHI = 0;
+    entry.DIR_FstClusLO = 0;
+    entry.DIR_FileSize  = 0;
+    int added = dir_add(fs, dir, &entry);
+    pthread_rwlock_unlock(dir_lock(fs, dir));
+    if (added != 0) {
+        report_error(fs, "no space in directory.\n");
+    }
+}
+
+//file handles
+
+// the handle's table entry, or NULL when it is not open. the caller holds
+// open_lock.
+static OPEN_FILE *handle_get(fat32_fs *fs, int handle) {
+    if (handle < 0 || (unsigned int)handle >= fs->open_files_cap ||
+        !fs->open_files[handle].using) {
+        return NULL;
+    }
+    return &fs->open_files[handle];
+}
+
+int fat32_open(fat32_fs *fs, const char *filename, int mode) {
+    if (mode != FAT32_O_RDONLY && mode != FAT32_O_WRONLY && mode != FAT32_O_RDWR) {
+        report_error(fs, "invalid mode.\n");
+        return -1;
+    }
+
+    unsigned char short_filename[11];
+    char dir_path[PATH_MAX_LEN];
+    unsigned int dir;
+    if (path_split(fs, filename, &dir, dir_path, short_filename) != 0) {
+        return -1;
+    }
+    dir_path[path_parent_len(dir_path, strlen(dir_path))] = '\0';
+
+    pthread_rwlock_wrlock(&fs->open_lock);
+    pthread_rwlock_rdlock(dir_lock(fs, dir));
+    DIR_ENTRY cur_entry;
+    int found = dir_lookup(fs, dir, short_filename, NULL, &cur_entry);
+    pthread_rwlock_unlock(dir_lock(fs, dir));
+
+    if (!found) {
+        pthread_rwlock_unlock(&fs->open_lock);
+        report_error(fs, "file does not exist.\n");
+        return -1;
+    }
+
+    if (cur_entry.DIR_Attr & ATTR_DIRECTORY) {
+        pthread_rwlock_unlock(&fs->open_lock);
+        report_error(fs, "cannot open a directory.\n");
+        return -1;
+    }
+
+    OPEN_INODE *ino = open_inode_get(fs, dir, dir_path, &cur_entry);
+    int h = ino ? handle_alloc(fs) : -1;
+    if (h < 0) {
+        if (ino && ino->first_handle < 0) open_inode_release(fs, ino);
+        pthread_rwlock_unlock(&fs->open_lock);
+        report_error(fs, "could not allocate memory for open.\n");
+        return -1;
+    }
+
+    OPEN_FILE *of = &fs->open_files[h];
+    of->using = 1;
+    of->file = ino;
+    of->offset = 0;
+    of->mode = mode;
+    of->next = ino->first_handle;
+    ino->first_handle = h;
+    pthread_rwlock_unlock(&fs->open_lock);
+    return h;
+}
+
+int fat32_close(fat32_fs *fs, int handle) {
+    pthread_rwlock_wrlock(&fs->open_lock);
+    int ret = -1;
+    if (handle_get(fs, handle)) {
+        handle_release(fs, handle);
+        ret = 0;
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+    return ret;
+}
+
+long fat32_size(fat32_fs *fs, int handle) {
+    long size = -1;
+    pthread_rwlock_rdlock(&fs->open_lock);
+    OPEN_FILE *of = handle_get(fs, handle);
+    if (of) {
+        pthread_rwlock_rdlock(&of->file->lock);
+        size = of->file->size;
+        pthread_rwlock_unlock(&of->file->lock);
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+    return size;
+}
+
+// reads up to len bytes at offset, stopping at the end of the file. the
+// caller holds open_lock.
+static long handle_pread(fat32_fs *fs, OPEN_FILE *handle, void *buf,
+                         unsigned long len, unsigned long offset) {
+    OPEN_INODE *of = handle->file;
+    if (handle->mode == FAT32_O_WRONLY) {
+        report_error(fs, "file not opened for reading.\n");
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&of->lock);
+    long done = 0;
+    if (offset < of->size) {
+        if (len > of->size - offset) {
+            len = of->size - offset;
+        }
+        done = file_read_data(fs, of, (unsigned int)offset, buf, (unsigned int)len);
+    }
+    pthread_rwlock_unlock(&of->lock);
+    return done;
+}
+
+// writes len bytes at offset, growing the file as needed, and updates its
+// directory entry. with advance set the write goes at the handle's offset
+// instead, which moves past it; both happen under the inode lock so two
+// threads sharing the handle never write at the same offset. the caller
+// holds open_lock.
+static long handle_pwrite(fat32_fs *fs, OPEN_FILE *handle, const void *buf,
+                          unsigned long len, unsigned long offset, int advance) {
+    OPEN_INODE *of = handle->file;
+    if (handle->mode != FAT32_O_WRONLY && handle->mode != FAT32_O_RDWR) {
+        report_error(fs, "file not opened for writing.\n");
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&of->lock);
+    if (advance) {
+        offset = handle->offset;
+    }
+    if (offset + len > 0xFFFFFFFFul) {
+        pthread_rwlock_unlock(&of->lock);
+        report_error(fs, "write past the maximum file size.\n");
+        return -1;
+    }
+
+    STAT_ADD(fs, file_bytes, len);
+    if (of->cluster == 0 && len > 0) {
+        if (extents_reserve(fs, of, 0) == 0) {
+            pthread_rwlock_unlock(&of->lock);
+            report_error(fs, "no free clusters for file data.\n");
+            return -1;
+        }
+        of->cluster = extents_lookup(of, 0);
+    }
+
+    int failed = file_write_data(fs, of, (unsigned int)offset, buf, (unsigned int)len) != 0;
+    if (!failed && offset + len > of->size) {
+        of->size = (unsigned int)(offset + len);
+    }
+
+    // the entry lives in the directory the file was opened from
+    pthread_rwlock_wrlock(dir_lock(fs, of->dir_cluster));
+    DIR_POS pos;
+    DIR_ENTRY entry;
+    if (dir_lookup(fs, of->dir_cluster, (unsigned char *)of->name, &pos, &entry)) {
+        entry.DIR_FstClusHI = (unsigned short)(of->cluster >> 16);
+        entry.DIR_FstClusLO = (unsigned short)(of->cluster & 0xFFFF);
+        entry.DIR_FileSize = of->size;
+        dir_put(fs, &pos, &entry);
+    }
+    pthread_rwlock_unlock(dir_lock(fs, of->dir_cluster));
+    if (!failed && advance) {
+        handle->offset = (unsigned int)(offset + len);
+    }
+    pthread_rwlock_unlock(&of->lock);
+
+    if (failed) {
+        report_error(fs, "no free clusters while extending file.\n");
+        return -1;
+    }
+    return (long)len;
+}
+
+// returns the number of bytes read
+long fat32_pread(fat32_fs *fs, int handle, void *buf, unsigned long len,
+                 unsigned long offset) {
+    long ret = -1;
+    pthread_rwlock_rdlock(&fs->open_lock);
+    OPEN_FILE *of = handle_get(fs, handle);
+    if (of) ret = handle_pread(fs, of, buf, len, offset);
+    pthread_rwlock_unlock(&fs->open_lock);
+    if (!of) report_error(fs, "file not open.\n");
+    return ret;
+}
+
+// returns len
+long fat32_pwrite(fat32_fs *fs, int handle, const void *buf, unsigned long len,
+                  unsigned long offset) {
+    long ret = -1;
+    pthread_rwlock_rdlock(&fs->open_lock);
+    OPEN_FILE *of = handle_get(fs, handle);
+    if (of) ret = handle_pwrite(fs, of, buf, len, offset, 0);
+    pthread_rwlock_unlock(&fs->open_lock);
+    if (!of) report_error(fs, "file is not opened.\n");
+    return ret;
+}
+
+//shell commands on handles
+
+int open_cmd(fat32_fs *fs, char *filename, char *flags) {
+    if (!filename || !flags) {
+        report_error(fs, "open needs filename and flags.\n");
+        return -1;
+    }
+
+    int mode;
+    if (strcmp(flags, "-r") == 0) {
+        mode = FAT32_O_RDONLY;
+    } else if (strcmp(flags, "-w") == 0) {
+        mode = FAT32_O_WRONLY;
+    } else if (strcmp(flags, "-rw") == 0 || strcmp(flags, "-wr") == 0) {
+        mode = FAT32_O_RDWR;
+    } else {
+        report_error(fs, "invalid mode.\n");
+        return -1;
+    }
+
+    return fat32_open(fs, filename, mode);
+}
+
+// resolves a file argument of a shell command and reports why it failed.
+// the caller holds open_lock.
+static OPEN_FILE *resolve_handle_cmd(fat32_fs *fs, const char *filename,
+                                     const char *not_open) {
+    int ambiguous;
+    int h = resolve_handle(fs, filename, &ambiguous);
+    if (h < 0) {
+        if (ambiguous) report_error(fs, "%s has several open handles; use #N.\n", filename);
+        else report_error(fs, not_open);
+        return NULL;
+    }
+    return &fs->open_files[h];
+}
+
+void close_cmd(fat32_fs *fs, char *filename) {
+    if (!filename) {
+        report_error(fs, "close needs filename.\n");
+        return;
+    }
+
+    pthread_rwlock_wrlock(&fs->open_lock);
+    OPEN_FILE *of = resolve_handle_cmd(fs, filename, "file not open.\n");
+    if (of) {
+        handle_release(fs, (int)(of - fs->open_files));
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+}
+
+void lsof_cmd(fat32_fs *fs) {
+    int any = 0;
+    pthread_rwlock_rdlock(&fs->open_lock);
+    for (unsigned int i = 0; i < fs->open_files_cap; i++) {
+        if (fs->open_files[i].using) {
+            OPEN_INODE *ino = fs->open_files[i].file;
+            any = 1;
+            printf("index: %u | ", i);
+            printf("name: %s | ", ino->name);
+            printf("cluster: %u | ", ino->cluster);
+            printf("mode: %d | ", fs->open_files[i].mode);
+            pthread_rwlock_rdlock(&ino->lock);
+            printf("offset: %u | ", fs->open_files[i].offset);
+            pthread_rwlock_unlock(&ino->lock);
+            printf("Path: %s\n", ino->path);
+        }
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+    if (!any) {
+        printf("No files are currently open.\n");
+    }
+}
+
+void lseek_cmd(fat32_fs *fs, char *filename, unsigned int offset) {
+    if (!filename) {
+        report_error(fs, "lseek needs a filename.\n");
+        return;
+    }
+
+    pthread_rwlock_rdlock(&fs->open_lock);
+    OPEN_FILE *of = resolve_handle_cmd(fs, filename, "file not open.\n");
+    if (of) {
+        // the offset is only ever moved under the inode's write lock
+        pthread_rwlock_wrlock(&of->file->lock);
+        of->offset = offset;
+        pthread_rwlock_unlock(&of->file->lock);
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+}
+
+// reserves clusters so the file's chain covers `bytes` without changing
+// its size, so later appends land in contiguous space
+void fallocate_cmd(fat32_fs *fs, char *filename, unsigned int bytes) {
+    if (!filename) {
+        report_error(fs, "fallocate requires [FILENAME] [BYTES].\n");
+        return;
+    }
+
+    unsigned char short_filename[11];
+    unsigned int dir;
+    if (path_split(fs, filename, &dir, NULL, short_filename) != 0) {
+        return;
+    }
+
+    // holding open_lock keeps the file from being opened meanwhile
+    pthread_rwlock_rdlock(&fs->open_lock);
+    pthread_rwlock_rdlock(dir_lock(fs, dir));
+    DIR_ENTRY entry;
+    int found = dir_lookup(fs, dir, short_filename, NULL, &entry);
+    pthread_rwlock_unlock(dir_lock(fs, dir));
+
+    if (!found) {
+        pthread_rwlock_unlock(&fs->open_lock);
+        report_error(fs, "file does not exist.\n");
+        return;
+    }
+    if (entry.DIR_Attr & ATTR_DIRECTORY) {
+        pthread_rwlock_unlock(&fs->open_lock);
+        report_error(fs, "cannot fallocate a directory.\n");
+        return;
+    }
+    if (bytes == 0) {
+        pthread_rwlock_unlock(&fs->open_lock);
+        return;
+    }
+
+    // an open file's extents must see the new clusters too
+    OPEN_INODE tmp;
+    OPEN_INODE *of = open_inode_find(fs, dir, short_filename);
+    if (!of) {
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.cluster = ((unsigned int)entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
+        of = &tmp;
+        if (extents_build(fs, of) != 0) {
+            pthread_rwlock_unlock(&fs->open_lock);
+            report_error(fs, "could not allocate memory for fallocate.\n");
+            return;
+        }
+    } else {
+        pthread_rwlock_wrlock(&of->lock);
+    }
+
+    // reserved clusters may still hold a deleted file's data; they are
+    // zeroed so nothing written later can leave it showing through
+    unsigned int clus_size = cluster_size(fs);
+    unsigned int had = of->n_clusters;
+    int full = extents_reserve(fs, of, (bytes - 1) / clus_size) == 0;
+    int zero_failed = extents_zero(fs, of, had, of->n_clusters) != 0;
+
+    if (of->n_clusters > 0 && of->cluster == 0) {
+        of->cluster = extents_lookup(of, 0);
+
+        pthread_rwlock_wrlock(dir_lock(fs, dir));
+        DIR_POS pos;
+        if (dir_lookup(fs, dir, short_filename, &pos, &entry)) {
+            entry.DIR_FstClusHI = (unsigned short)(of->cluster >> 16);
+            entry.DIR_FstClusLO = (unsigned short)(of->cluster & 0xFFFF);
+            dir_put(fs, &pos, &entry);
+        }
+        pthread_rwlock_unlock(dir_lock(fs, dir));
+    }
+
+    if (of == &tmp) {
+        extents_clear(&tmp);
+    } else {
+        pthread_rwlock_unlock(&of->lock);
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+
+    if (full) {
+        report_error(fs, "no free clusters for fallocate.\n");
+    } else if (zero_failed) {
+        report_error(fs, "could not clear the reserved clusters.\n");
+    }
+}
+
+//write and mv
+
+void write_cmd(fat32_fs *fs, char *filename, const char *string) {
+    if (!filename || !string) {
+        report_error(fs, "write requires a filename and a string.\n");
+        return;
+    }
+
+    pthread_rwlock_rdlock(&fs->open_lock);
+    OPEN_FILE *handle = resolve_handle_cmd(fs, filename, "file is not opened.\n");
+    if (handle) {
+        handle_pwrite(fs, handle, string, strlen(string), 0, 1);
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+}
+
+// write-locks dir and the directories a and b together with the
+// subdirectory of dir called name, if there is one, and stores the
+// subdirectory's cluster in *child (0 when name is absent or not a
+// directory). the lookup is repeated until it holds under the locks;
+// release with dir_unlock_set().
+static uint64_t dir_lock_with_child(fat32_fs *fs, unsigned int dir, unsigned int a,
+                                   unsigned int b, const unsigned char name[11],
+                                   unsigned int *child) {
+    unsigned int dirs[4] = { dir, a, b, 0 };
+    for (;;) {
+        dirs[3] = *child ? *child : dir;
+        uint64_t set = dir_lock_set(fs, dirs, 4);
+
+        DIR_ENTRY entry;
+        unsigned int found = 0;
+        if (dir_lookup(fs, dir, name, NULL, &entry) && (entry.DIR_Attr & ATTR_DIRECTORY)) {
+            found = ((unsigned int)entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
+        }
+        if (found == *child) {
+            return set;
+        }
+
+        dir_unlock_set(fs, set);
+        *child = found;
+    }
+}
+
+// points the ".." entry of a moved directory at its new parent
+static void dir_set_parent(fat32_fs *fs, unsigned int dir_cluster, unsigned int parent) {
+    static const unsigned char dotdot[11] = { '.', '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+    DIR_POS pos;
+    DIR_ENTRY entry;
+    if (dir_lookup(fs, dir_cluster, dotdot, &pos, &entry)) {
+        entry.DIR_FstClusHI = (unsigned short)(parent >> 16);
+        entry.DIR_FstClusLO = (unsigned short)(parent & 0xFFFF);
+        dir_put(fs, &pos, &entry);
+    }
+}
+
+// replaces the leading canonical directory path from in path with to
+static void path_rebase(char *path, size_t cap, const char *from, const char *to) {
+    size_t n = strlen(from);
+    if (strncmp(path, from, n) != 0 || strlen(to) + strlen(path + n) >= cap) return;
+
+    char rest[PATH_MAX_LEN];
+    strcpy(rest, path + n);
+    snprintf(path, cap, "%s%s", to, rest);
+}
+
+// mv once the directories involved are locked: the entry src_short of
+// sdir goes to tdir under the name name. returns an error message or NULL.
+static const char *mv_locked(fat32_fs *fs, unsigned int sdir,
+                             const unsigned char src_short[11],
+                             unsigned int tdir, const unsigned char name[11],
+                             unsigned int *moved_dir) {
+    DIR_POS src_pos;
+    DIR_ENTRY src_entry;
+    if (!dir_lookup(fs, sdir, src_short, &src_pos, &src_entry)) {
+        return "source does not exist.\n";
+    }
+    unsigned int src_cluster =
+        ((unsigned int)src_entry.DIR_FstClusHI << 16) | src_entry.DIR_FstClusLO;
+    int is_dir = (src_entry.DIR_Attr & ATTR_DIRECTORY) != 0;
+    if ((is_dir ? src_cluster : 0) != *moved_dir) {
+        // the source changed since it was locked; "" asks for a retry
+        *moved_dir = is_dir ? src_cluster : 0;
+        return "";
+    }
+
+    if (tdir == sdir) {
+        // rename
+        dir_rename(fs, sdir, &src_pos, &src_entry, name);
+        return NULL;
+    }
+
+    if (dir_lookup(fs, tdir, name, NULL, NULL)) {
+        return "name already exists in destination directory.\n";
+    }
+
+    memcpy(src_entry.DIR_Name, name, 11);
+    if (dir_add(fs, tdir, &src_entry) != 0) {
+        return "no space in destination directory.\n";
+    }
+    dir_remove(fs, sdir, &src_pos);
+    if (is_dir && src_cluster != 0) {
+        dir_set_parent(fs, src_cluster, tdir);
+    }
+    dir_compact_auto(fs, sdir);
+    return NULL;
+}
+
+// mv SRC DST: renames SRC when DST does not exist, moves it into DST when
+// that is a directory. either may be a path; a rename may also move the
+// entry to another directory.
+void mv_cmd(fat32_fs *fs, char *src, char *dst) {
+    if (!src || !dst) {
+        report_error(fs, "mv requires source and destination.\n");
+        return;
+    }
+
+    unsigned char src_short[11];
+    unsigned char dst_short[11];
+    char src_canon[PATH_MAX_LEN];
+    char dst_canon[PATH_MAX_LEN];
+    char dst_dir_path[PATH_MAX_LEN];
+    unsigned int sdir;
+    unsigned int ddir;
+    if (path_split(fs, src, &sdir, src_canon, src_short) != 0) {
+        return;
+    }
+
+    // the root has no entry of its own: moving into it needs no lookup
+    int r = path_parse(fs, dst, &ddir, dst_canon, dst_short);
+    int dst_root = r == -4;
+    if (dst_root) {
+        ddir = fs->bpb.BPB_RootClus;
+    } else if (r != 0) {
+        path_report(fs, dst, r);
+        return;
+    }
+    strcpy(dst_dir_path, dst_canon);
+    if (!dst_root) dst_dir_path[path_parent_len(dst_canon, strlen(dst_canon))] = '\0';
+
+    const char *err = "file must be closed before mv.\n";
+    unsigned int moved = 0;
+    unsigned int dest = dst_root ? ddir : 0;
+    char new_canon[PATH_MAX_LEN];
+    new_canon[0] = '\0';
+
+    // write: the paths of open files below a moved directory change
+    pthread_rwlock_wrlock(&fs->open_lock);
+    if (!open_inode_find(fs, sdir, src_short)) {
+        // a directory source is found under the locks and needs a second
+        // round with its own lock taken too
+        do {
+            uint64_t set;
+            unsigned int tdir;
+            const unsigned char *name;
+            DIR_ENTRY dst_entry;
+            if (dst_root) {
+                unsigned int dirs[3] = { sdir, ddir, moved ? moved : sdir };
+                set = dir_lock_set(fs, dirs, 3);
+            } else {
+                set = dir_lock_with_child(fs, ddir, sdir, moved ? moved : sdir,
+                                          dst_short, &dest);
+            }
+
+            if (dest) {
+                tdir = dest;
+                name = src_short;
+                snprintf(new_canon, sizeof(new_canon), "%s", dst_canon);
+            } else if (dir_lookup(fs, ddir, dst_short, NULL, &dst_entry)) {
+                err = "destination is not a directory.\n";
+                dir_unlock_set(fs, set);
+                break;
+            } else {
+                tdir = ddir;
+                name = dst_short;
+                snprintf(new_canon, sizeof(new_canon), "%s", dst_dir_path);
+            }
+
+            if (moved && strncmp(new_canon, src_canon, strlen(src_canon)) == 0) {
+                err = "cannot move a directory into itself.\n";
+            } else {
+                err = mv_locked(fs, sdir, src_short, tdir, name, &moved);
+            }
+            if (!err && moved) dentry_drop(fs, src_canon);
+            dir_unlock_set(fs, set);
+
+            if (!err && moved) {
+                // canonical path of the directory after the move
+                char part[12];
+                memcpy(part, name, 11);
+                part[11] = '\0';
+                for (int j = 10; j >= 0 && part[j] == ' '; j--) part[j] = '\0';
+                size_t len = strlen(new_canon);
+                snprintf(new_canon + len, sizeof(new_canon) - len, "%s/", part);
+            }
+        } while (err && err[0] == '\0');
+    }
+
+    if (!err && moved) {
+        path_rebase(fs->current_path, sizeof(fs->current_path), src_canon, new_canon);
+        for (unsigned int i = 0; i < fs->open_files_cap; i++) {
+            if (fs->open_files[i].using) {
+                OPEN_INODE *ino = fs->open_files[i].file;
+                path_rebase(ino->path, sizeof(ino->path), src_canon, new_canon);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+
+    if (err) {
+        report_error(fs, "%s", err);
+    }
+}
+
+//RM and RMDIR
+
+void rm_cmd(fat32_fs *fs, char *filename) {
+    if (!filename) {
+        report_error(fs, "rm requires a filename.\n");
+        return;
+    }
+
+    unsigned char short_filename[11];
+    unsigned int dir;
+    if (path_split(fs, filename, &dir, NULL, short_filename) != 0) {
+        return;
+    }
+
+    const char *err = NULL;
+    unsigned int first_cluster = 0;
+
+    // open_lock keeps the file from being opened while it goes away
+    pthread_rwlock_rdlock(&fs->open_lock);
+    pthread_rwlock_wrlock(dir_lock(fs, dir));
+
+    DIR_POS pos;
+    DIR_ENTRY entry;
+    if (open_inode_find(fs, dir, short_filename)) {
+        err = "cannot rm an open file.\n";
+    } else if (!dir_lookup(fs, dir, short_filename, &pos, &entry)) {
+        err = "file does not exist.\n";
+    } else if (entry.DIR_Attr & ATTR_DIRECTORY) {
+        err = "rm target is a directory (use rmdir).\n";
+    } else {
+        first_cluster = ((unsigned int)entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
+        dir_remove(fs, dir, &pos);
+        dir_compact_auto(fs, dir);
+    }
+
+    pthread_rwlock_unlock(dir_lock(fs, dir));
+    pthread_rwlock_unlock(&fs->open_lock);
+
+    // the entry is gone, so nobody can reach the chain any more
+    if (first_cluster != 0) {
+        fat_free_chain(fs, first_cluster);
+    }
+    if (err) {
+        report_error(fs, "%s", err);
+    }
+}
+
+// rmdir once the directory and its parent are locked. returns an error
+// message or NULL.
+static const char *rmdir_locked(fat32_fs *fs, unsigned int dir,
+                                const unsigned char short_dirname[11]) {
+    DIR_POS pos;
+    DIR_ENTRY entry;
+    if (!dir_lookup(fs, dir, short_dirname, &pos, &entry)) {
+        return "directory does not exist.\n";
+    }
+
+    if (!(entry.DIR_Attr & ATTR_DIRECTORY)) {
+        return "rmdir target is not a directory.\n";
+    }
+
+    unsigned int dir_cluster =
+        ((unsigned int)entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
+
+    // check if any file is open in that directory
+    for (unsigned int i = 0; i < fs->open_files_cap; i++) {
+        if (fs->open_files[i].using &&
+            fs->open_files[i].file->dir_cluster == dir_cluster) {
+            return "a file is opened in that directory.\n";
+        }
+    }
+
+    if (dir_cluster != 0) {
+        if (dir_cluster == fs->current_cluster) {
+            return "cannot remove the current directory.\n";
+        }
+        if (!dir_is_empty(fs, dir_cluster)) {
+            return "directory not empty.\n";
+        }
+        dir_index_drop(fs, dir_cluster);
+        fat_free_chain(fs, dir_cluster);
+    }
+
+    dir_remove(fs, dir, &pos);
+    dir_compact_auto(fs, dir);
+    return NULL;
+}
+
+void rmdir_cmd(fat32_fs *fs, char *dirname) {
+    if (!dirname) {
+        report_error(fs, "rmdir requires a directory name.\n");
+        return;
+    }
+
+    unsigned char short_dirname[11];
+    char canon[PATH_MAX_LEN];
+    unsigned int dir;
+    if (path_split(fs, dirname, &dir, canon, short_dirname) != 0) {
+        return;
+    }
+
+    unsigned int child = 0;
+    pthread_rwlock_rdlock(&fs->open_lock);
+    uint64_t set = dir_lock_with_child(fs, dir, dir, dir, short_dirname, &child);
+    const char *err = rmdir_locked(fs, dir, short_dirname);
+    if (!err) dentry_drop(fs, canon);
+    dir_unlock_set(fs, set);
+    pthread_rwlock_unlock(&fs->open_lock);
+
+    if (err) {
+        report_error(fs, "%s", err);
+    }
+}
+
+// compact DIR: packs the entries of a directory (NULL = the current one),
+// dropping the slots of deleted entries, and frees the clusters this
+// leaves empty. rm, rmdir and mv do the same on their own once deleted
+// slots outnumber the names in a directory.
+void compact_cmd(fat32_fs *fs, char *path) {
+    unsigned int dir;
+    if (path_dir_cmd(fs, path, &dir, NULL) != 0) return;
+
+    unsigned int freed = 0;
+    pthread_rwlock_wrlock(dir_lock(fs, dir));
+    long dropped = dir_compact(fs, dir, &freed);
+    pthread_rwlock_unlock(dir_lock(fs, dir));
+
+    if (dropped < 0) {
+        report_error(fs, "could not compact the directory.\n");
+        return;
+    }
+    printf("%ld deleted entr%s dropped, %u cluster(s) freed\n", dropped,
+           dropped == 1 ? "y" : "ies", freed);
+}
+
+// streams up to len bytes of file data starting at offset to out, one
+// write per contiguous run (or chunk of it). large copies to pipes and
+// regular files are made by the kernel with sendfile(). the caller holds
+// the inode lock. stops at the end of the file, never at the end of its
+// last cluster. returns the number of bytes copied.
+static unsigned int file_copy_out(fat32_fs *fs, OPEN_INODE *of, unsigned int offset,
+                                  unsigned int len, FILE *out) {
+    if (offset >= of->size) return 0;
+    if (len > of->size - offset) len = of->size - offset;
+
+    unsigned int actual_offset = offset;
+    unsigned int total_bytes = len;
+
+    int use_sendfile = !fs->image_map && len >= IO_SENDFILE_MIN &&
+                       !io_is_terminal(fileno(out));
+    if (use_sendfile) {
+        fflush(out);
+    }
+
+    unsigned char *buffer = NULL;
+    unsigned int chunk = (len < IO_MAX_CHUNK) ? len : IO_MAX_CHUNK;
+    unsigned int clus_size = cluster_size(fs);
+
+    while (total_bytes > 0) {
+        unsigned int bytes;
+
+        if (fs->image_map || use_sendfile) {
+            unsigned int span;
+            uint64_t phys = extents_span(fs, of, actual_offset, &span);
+            if (span == 0) {
+                break;
+            }
+            bytes = (total_bytes < span) ? total_bytes : span;
+
+            if (fs->image_map) {
+                // straight from the mapping, once the run is known to lie
+                // inside it
+                unsigned int count = (unsigned int)((phys % clus_size + bytes + clus_size - 1) /
+                                                    clus_size);
+                if (!clusters_in_image(fs, extents_lookup(of, actual_offset / clus_size), count)) {
+                    break;
+                }
+                fwrite(fs->image_map + phys, 1, bytes, out);
+            } else {
+                if (bytes > chunk) bytes = chunk;
+                if (cache_sync_range(fs, extents_lookup(of, actual_offset / clus_size),
+                                     (unsigned int)((phys % clus_size + bytes + clus_size - 1) /
+                                                    clus_size), 0) != 0) {
+                    break;
+                }
+                long sent = io_sendfile(fileno(out), fs->image_fd, bytes, phys);
+                trace_io(fs, FAT32_TRACE_SENDFILE, phys, sent > 0 ? (unsigned int)sent : 0);
+                STAT_ADD(fs, reads, 1);
+                if (sent < 0) {
+                    use_sendfile = 0;
+                    continue;
+                }
+                STAT_ADD(fs, bytes_read, sent);
+                bytes = (unsigned int)sent;
+            }
+        } else {
+            if (!buffer && (buffer = malloc(chunk)) == NULL) {
+                report_error(fs, "could not allocate memory for read.\n");
+                break;
+            }
+            unsigned int want = (total_bytes < chunk) ? total_bytes : chunk;
+            bytes = file_read_data(fs, of, actual_offset, buffer, want);
+            fwrite(buffer, 1, bytes, out);
+            if (bytes < want) {
+                actual_offset += bytes;
+                break;
+            }
+        }
+
+        total_bytes -= bytes;
+        actual_offset += bytes;
+    }
+
+    free(buffer);
+    return actual_offset - offset;
+}
+
+// streams up to size bytes of an open file from its current offset to out
+void read_cmd(fat32_fs *fs, char *filename, unsigned int size, FILE *out) {
+    if (!filename) {
+        report_error(fs, "read requires [FILENAME] [SIZE].\n");
+        return;
+    }
+
+    pthread_rwlock_rdlock(&fs->open_lock);
+    OPEN_FILE *handle = resolve_handle_cmd(fs, filename, "file not open.\n");
+    if (!handle) {
+        pthread_rwlock_unlock(&fs->open_lock);
+        return;
+    }
+
+    if (handle->mode == FAT32_O_WRONLY) {
+        pthread_rwlock_unlock(&fs->open_lock);
+        report_error(fs, "file not opened for reading.\n");
+        return;
+    }
+
+    // held for writing, as the handle's offset moves
+    OPEN_INODE *of = handle->file;
+    pthread_rwlock_wrlock(&of->lock);
+    handle->offset += file_copy_out(fs, of, handle->offset, size, out);
+    pthread_rwlock_unlock(&of->lock);
+    pthread_rwlock_unlock(&fs->open_lock);
+}
+
+//host transfers
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void report_transfer(const char *what, unsigned long bytes, double secs) {
+    printf("%s: %lu bytes in %.3f s (%.1f MB/s)\n", what, bytes, secs,
+           secs > 0 ? bytes / secs / (1 << 20) : 0.0);
+}
+
+// makes name an empty regular file: creates it, or frees the chain of an
+// existing one. returns 0 when the file is ready.
+static int put_prepare(fat32_fs *fs, const char *name) {
+    unsigned char short_name[11];
+    unsigned int dir;
+    if (path_split(fs, name, &dir, NULL, short_name) != 0) {
+        return -1;
+    }
+
+    const char *err = NULL;
+    unsigned int old = 0;
+
+    // open_lock keeps the file from being opened while its chain goes away
+    pthread_rwlock_wrlock(&fs->open_lock);
+    pthread_rwlock_wrlock(dir_lock(fs, dir));
+    DIR_POS pos;
+    DIR_ENTRY entry;
+    if (open_inode_find(fs, dir, short_name)) {
+        err = "cannot put over an open file.\n";
+    } else if (!dir_lookup(fs, dir, short_name, &pos, &entry)) {
+        memset(&entry, 0, sizeof(entry));
+        memcpy(entry.DIR_Name, short_name, 11);
+        entry.DIR_Attr = ATTR_ARCHIVE;
+        if (dir_add(fs, dir, &entry) != 0) err = "no space in directory.\n";
+    } else if (entry.DIR_Attr & ATTR_DIRECTORY) {
+        err = "put target is a directory.\n";
+    } else {
+        old = ((unsigned int)entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
+        entry.DIR_FstClusHI = 0;
+        entry.DIR_FstClusLO = 0;
+        entry.DIR_FileSize = 0;
+        dir_put(fs, &pos, &entry);
+    }
+    pthread_rwlock_unlock(dir_lock(fs, dir));
+    pthread_rwlock_unlock(&fs->open_lock);
+
+    if (old != 0) {
+        fat_free_chain(fs, old);
+    }
+    if (err) {
+        report_error(fs, "%s", err);
+        return -1;
+    }
+    return 0;
+}
+
+// reserves the clusters for bytes of data in one request, so the file
+// lands in as few contiguous runs as free space allows. returns 0 when
+// they were all found.
+static int put_reserve(fat32_fs *fs, int h, uint64_t bytes) {
+    unsigned int clus_size = cluster_size(fs);
+    uint64_t need = (bytes + clus_size - 1) / clus_size;
+    if (need == 0) return 0;
+
+    pthread_rwlock_rdlock(&fs->fat_lock);
+    int room = need <= fs->free_count;
+    pthread_rwlock_unlock(&fs->fat_lock);
+    if (!room) return -1;
+
+    int ok = 0;
+    pthread_rwlock_rdlock(&fs->open_lock);
+    OPEN_FILE *handle = handle_get(fs, h);
+    if (handle) {
+        OPEN_INODE *of = handle->file;
+        pthread_rwlock_wrlock(&of->lock);
+        ok = extents_reserve(fs, of, (unsigned int)(need - 1)) != 0;
+        if (of->n_clusters > 0 && of->cluster == 0) {
+            of->cluster = extents_lookup(of, 0);
+        }
+        pthread_rwlock_unlock(&of->lock);
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+    return ok ? 0 : -1;
+}
+
+// copies a host file into the image under name, replacing a file of that
+// name. the data goes over in IO_MAX_CHUNK pieces, whole clusters straight
+// to the image. input that is not a regular file (a pipe) is read to its
+// end without reserving space first.
+void put_cmd(fat32_fs *fs, char *host, char *name) {
+    if (!host || !name) {
+        report_error(fs, "put requires [HOSTFILE] [FILENAME].\n");
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    FILE *in = fopen(host, "rb");
+    if (!in) {
+        report_error(fs, "cannot open host file %s.\n", host);
+        return;
+    }
+    uint64_t size = 0;
+    if (io_size(fileno(in), &size) != 0) size = 0;
+    if (size > 0xFFFFFFFFul) {
+        fclose(in);
+        report_error(fs, "%s is larger than a FAT32 file can be.\n", host);
+        return;
+    }
+
+    if (put_prepare(fs, name) != 0) {
+        fclose(in);
+        return;
+    }
+    int h = fat32_open(fs, name, FAT32_O_WRONLY);
+    if (h < 0) {
+        fclose(in);
+        return;
+    }
+    if (put_reserve(fs, h, size) != 0) {
+        fat32_close(fs, h);
+        fclose(in);
+        report_error(fs, "not enough free clusters for %s.\n", host);
+        return;
+    }
+
+    unsigned long chunk = (size > 0 && size < IO_MAX_CHUNK) ? (unsigned long)size : IO_MAX_CHUNK;
+    unsigned char *buf = malloc(chunk);
+    unsigned long done = 0;
+    int failed = !buf;
+    while (!failed) {
+        size_t n = fread(buf, 1, chunk, in);
+        if (n == 0) break;
+        if (done + n > 0xFFFFFFFFul) {
+            report_error(fs, "%s is larger than a FAT32 file can be.\n", host);
+            failed = 1;
+        } else if (fat32_pwrite(fs, h, buf, n, done) < 0) {
+            failed = 1;
+        } else {
+            done += n;
+        }
+    }
+    if (!buf) {
+        report_error(fs, "could not allocate memory for put.\n");
+    } else if (ferror(in)) {
+        report_error(fs, "error reading host file %s.\n", host);
+        failed = 1;
+    }
+
+    free(buf);
+    fat32_close(fs, h);
+    fclose(in);
+    if (!failed) {
+        report_transfer("put", done, seconds_since(&start));
+    }
+}
+
+// copies a file of the image to a host file, replacing it
+void get_cmd(fat32_fs *fs, char *name, char *host) {
+    if (!name || !host) {
+        report_error(fs, "get requires [FILENAME] [HOSTFILE].\n");
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int h = fat32_open(fs, name, FAT32_O_RDONLY);
+    if (h < 0) {
+        return;
+    }
+    FILE *out = fopen(host, "wb");
+    if (!out) {
+        fat32_close(fs, h);
+        report_error(fs, "cannot open host file %s for writing.\n", host);
+        return;
+    }
+
+    unsigned int size = 0, done = 0;
+    pthread_rwlock_rdlock(&fs->open_lock);
+    OPEN_FILE *handle = handle_get(fs, h);
+    if (handle) {
+        OPEN_INODE *of = handle->file;
+        pthread_rwlock_rdlock(&of->lock);
+        size = of->size;
+        done = file_copy_out(fs, of, 0, size, out);
+        pthread_rwlock_unlock(&of->lock);
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+    fat32_close(fs, h);
+
+    int err = ferror(out);
+    if (fclose(out) != 0 || err) {
+        report_error(fs, "error writing host file %s.\n", host);
+    } else if (done < size) {
+        report_error(fs, "%s is shorter than its size; copied %u of %u bytes.\n",
+                     name, done, size);
+    } else {
+        report_transfer("get", done, seconds_since(&start));
+    }
+}
+
+//import
+
+// import copies a host directory tree into the image. the command thread
+// scans the host tree first, creating the directories and listing the
+// files. reader threads then load the small files into memory, up to
+// IMPORT_WINDOW bytes ahead of the command thread, which takes them in
+// order and does all allocation and metadata: the chains of a batch of
+// ready files are linked under one fat_lock, their data is packed into a
+// staging buffer written with one large write per contiguous run, and
+// their entries are added once that write is done, with one lock per
+// directory. large files are streamed from the host by the command thread.
+#define IMPORT_MAX_THREADS 16
+#define IMPORT_SMALL  (4u << 20)    // larger files are streamed, not staged
+#define IMPORT_WINDOW (64u << 20)   // bytes read ahead of the command thread
+#define IMPORT_BATCH  256           // files whose chains share one fat_lock
+
+enum { IMPORT_WAIT, IMPORT_READY, IMPORT_FAILED };
+
+typedef struct {
+    char *host;
+    unsigned int dir;           // image directory it goes to
+    unsigned char name[11];
+    unsigned int size;
+    unsigned char *data;        // contents once read (small files)
+    int state;
+    int reserved;               // has an empty entry in dir
+    unsigned int first;         // first cluster once allocated
+} IMPORT_FILE;
+
+// clusters given to a file of the batch being committed
+typedef struct {
+    unsigned int file;
+    unsigned int start;
+    unsigned int len;
+    unsigned int offset;        // byte offset in the file
+} IMPORT_RUN;
+
+typedef struct {
+    fat32_fs *fs;
+    IMPORT_FILE *files;
+    unsigned int nfiles;
+    unsigned int files_cap;
+    unsigned long dirs;
+    unsigned long skipped;      // hidden entries, links, devices
+    unsigned long imported;
+    unsigned long failed;
+    unsigned long bytes;
+    int full;                   // out of clusters: the rest is not imported
+    int broken;                 // a write to the image failed: likewise
+
+    // readers claim files in order from `next` and stay within
+    // IMPORT_WINDOW bytes of `committed`, the first file not yet staged
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t room;
+    unsigned int next;
+    unsigned int committed;
+    unsigned long inflight;
+
+    // staged data of clusters [stage_start, stage_start + stage_len), and
+    // the files from `linked` on whose entries wait for it to be written
+    unsigned char *stage;
+    unsigned int stage_cap;     // clusters
+    unsigned int stage_start;
+    unsigned int stage_len;
+    unsigned int linked;
+    unsigned int goal;          // where the next chain should start
+
+    IMPORT_RUN *runs;
+    unsigned int nruns;
+    unsigned int runs_cap;
+} IMPORT;
+
+// host entry of the directory being scanned
+typedef struct {
+    char *name;
+    unsigned char short_name[11];
+} IMPORT_NAME;
+
+static int import_name_cmp(const void *a, const void *b) {
+    return memcmp(((const IMPORT_NAME *)a)->short_name, ((const IMPORT_NAME *)b)->short_name, 11);
+}
+
+static int import_add_file(IMPORT *im, const char *host, unsigned int dir,
+                           const unsigned char name[11], unsigned int size) {
+    if (im->nfiles == im->files_cap) {
+        unsigned int cap = im->files_cap ? im->files_cap * 2 : 256;
+        IMPORT_FILE *p = realloc(im->files, cap * sizeof(IMPORT_FILE));
+        if (!p) return -1;
+        im->files = p;
+        im->files_cap = cap;
+    }
+    IMPORT_FILE *f = &im->files[im->nfiles];
+    memset(f, 0, sizeof(*f));
+    if ((f->host = strdup(host)) == NULL) return -1;
+    f->dir = dir;
+    memcpy(f->name, name, 11);
+    f->size = size;
+    im->nfiles++;
+    return 0;
+}
+
+// lists the host directory host into the import: its files are queued for
+// the image directory dir and its subdirectories are created there and
+// scanned in turn. returns -1 when memory ran out.
+static int import_scan(IMPORT *im, const char *host, unsigned int dir) {
+    fat32_fs *fs = im->fs;
+    DIR *d = opendir(host);
+    if (!d) {
+        report_error(fs, "cannot read host directory %s.\n", host);
+        im->failed++;
+        return 0;
+    }
+
+    IMPORT_NAME *names = NULL;
+    unsigned int n = 0, cap = 0;
+    int ret = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') {
+            if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) im->skipped++;
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            IMPORT_NAME *p = realloc(names, cap * sizeof(IMPORT_NAME));
+            if (!p) {
+                ret = -1;
+                break;
+            }
+            names = p;
+        }
+        if ((names[n].name = strdup(de->d_name)) == NULL) {
+            ret = -1;
+            break;
+        }
+        make_short_name(de->d_name, names[n].short_name);
+        n++;
+    }
+    closedir(d);
+
+    // sorted by short name, names that collide once cut to 11 characters
+    // end up next to each other
+    qsort(names, n, sizeof(IMPORT_NAME), import_name_cmp);
+
+    size_t hlen = strlen(host);
+    for (unsigned int i = 0; ret == 0 && i < n; i++) {
+        char *path = malloc(hlen + strlen(names[i].name) + 2);
+        if (!path) {
+            ret = -1;
+            break;
+        }
+        sprintf(path, "%s/%s", host, names[i].name);
+
+        struct stat st;
+        if (lstat(path, &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+            im->skipped++;
+            free(path);
+            continue;
+        }
+
+        DIR_ENTRY entry;
+        pthread_rwlock_rdlock(dir_lock(fs, dir));
+        int exists = dir_lookup(fs, dir, names[i].short_name, NULL, &entry);
+        pthread_rwlock_unlock(dir_lock(fs, dir));
+        int collides = i > 0 && memcmp(names[i].short_name, names[i - 1].short_name, 11) == 0;
+
+        if (S_ISDIR(st.st_mode)) {
+            unsigned int sub = 0;
+            const char *err = NULL;
+            if (collides) {
+                err = "name collides with another once shortened.\n";
+            } else if (exists && !(entry.DIR_Attr & ATTR_DIRECTORY)) {
+                err = "a file of that name exists in the image.\n";
+            } else if (exists) {
+                // merge into the existing directory
+                sub = ((unsigned int)entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
+            } else {
+                pthread_rwlock_wrlock(dir_lock(fs, dir));
+                err = dir_make(fs, dir, names[i].short_name, &sub);
+                pthread_rwlock_unlock(dir_lock(fs, dir));
+                if (!err) im->dirs++;
+            }
+            if (err) {
+                report_error(fs, "%s: %s", path, err);
+                im->failed++;
+            } else if (sub >= 2) {
+                ret = import_scan(im, path, sub);
+            }
+        } else if (collides || exists || (uint64_t)st.st_size > 0xFFFFFFFFul) {
+            report_error(fs, "%s: %s", path,
+                         collides ? "name collides with another once shortened.\n" :
+                         exists ? "already exists in the image.\n" :
+                                  "larger than a FAT32 file can be.\n");
+            im->failed++;
+        } else if (import_add_file(im, path, dir, names[i].short_name,
+                                   (unsigned int)st.st_size) != 0) {
+            ret = -1;
+        }
+        free(path);
+    }
+
+    for (unsigned int i = 0; i < n; i++) free(names[i].name);
+    free(names);
+    return ret;
+}
+
+static int import_read(IMPORT_FILE *f) {
+    FILE *in = fopen(f->host, "rb");
+    if (!in) return -1;
+    f->data = malloc(f->size ? f->size : 1);
+    int ok = f->data && fread(f->data, 1, f->size, in) == f->size;
+    fclose(in);
+    return ok ? 0 : -1;
+}
+
+static void *import_reader(void *arg) {
+    IMPORT *im = arg;
+
+    pthread_mutex_lock(&im->lock);
+    while (im->next < im->nfiles) {
+        unsigned int i = im->next++;
+        IMPORT_FILE *f = &im->files[i];
+        if (f->size > IMPORT_SMALL) {
+            // streamed by the command thread
+            f->state = IMPORT_READY;
+            pthread_cond_signal(&im->ready);
+            continue;
+        }
+        // the file the command thread waits for is always let through
+        while (i != im->committed && im->inflight + f->size > IMPORT_WINDOW) {
+            pthread_cond_wait(&im->room, &im->lock);
+        }
+        im->inflight += f->size;
+        pthread_mutex_unlock(&im->lock);
+
+        int ok = import_read(f) == 0;
+
+        pthread_mutex_lock(&im->lock);
+        f->state = ok ? IMPORT_READY : IMPORT_FAILED;
+        pthread_cond_signal(&im->ready);
+    }
+    pthread_mutex_unlock(&im->lock);
+    return NULL;
+}
+
+// gives the ready files [lo, hi) empty entries, so their directories have
+// grown before the data takes the space; import_link() fills them in.
+// each directory's lock is taken once for a run of files going to it.
+static void import_reserve(IMPORT *im, unsigned int lo, unsigned int hi) {
+    fat32_fs *fs = im->fs;
+    unsigned int i = lo;
+    while (i < hi) {
+        unsigned int dir = im->files[i].dir;
+        pthread_rwlock_wrlock(dir_lock(fs, dir));
+        for (; i < hi && im->files[i].dir == dir; i++) {
+            IMPORT_FILE *f = &im->files[i];
+            if (f->state != IMPORT_READY) continue;
+
+            DIR_ENTRY entry;
+            memset(&entry, 0, sizeof(entry));
+            memcpy(entry.DIR_Name, f->name, 11);
+            entry.DIR_Attr = ATTR_ARCHIVE;
+            if (dir_lookup(fs, dir, f->name, NULL, NULL) || dir_add(fs, dir, &entry) != 0) {
+                // created meanwhile, or the directory cannot grow
+                f->state = IMPORT_FAILED;
+            } else {
+                f->reserved = 1;
+            }
+        }
+        pthread_rwlock_unlock(dir_lock(fs, dir));
+    }
+}
+
+// points the entries of files [lo, hi) whose data is in the image at
+// their chains, and takes the others out again
+static void import_link(IMPORT *im, unsigned int lo, unsigned int hi) {
+    fat32_fs *fs = im->fs;
+    unsigned int i = lo;
+    while (i < hi) {
+        unsigned int dir = im->files[i].dir;
+        pthread_rwlock_wrlock(dir_lock(fs, dir));
+        for (; i < hi && im->files[i].dir == dir; i++) {
+            IMPORT_FILE *f = &im->files[i];
+            if (im->broken) f->state = IMPORT_FAILED;
+
+            DIR_POS pos;
+            DIR_ENTRY entry;
+            if (!f->reserved || !dir_lookup(fs, dir, f->name, &pos, &entry)) {
+                f->state = IMPORT_FAILED;
+            } else if (f->state != IMPORT_READY) {
+                dir_remove(fs, dir, &pos);
+            } else {
+                entry.DIR_FstClusHI = (unsigned short)(f->first >> 16);
+                entry.DIR_FstClusLO = (unsigned short)(f->first & 0xFFFF);
+                entry.DIR_FileSize = f->size;
+                dir_put(fs, &pos, &entry);
+                im->imported++;
+                im->bytes += f->size;
+            }
+        }
+        pthread_rwlock_unlock(dir_lock(fs, dir));
+    }
+
+    for (i = lo; i < hi; i++) {
+        IMPORT_FILE *f = &im->files[i];
+        if (f->state == IMPORT_FAILED) {
+            if (f->first) fat_free_chain(fs, f->first);
+            f->first = 0;
+            if (!im->full && !im->broken) {
+                report_error(fs, "%s: could not be imported.\n", f->host);
+            }
+            im->failed++;
+        }
+    }
+    im->linked = hi;
+}
+
+// writes the staged clusters in one go, then makes the files staged so
+// far reachable
+static void import_flush(IMPORT *im, unsigned int upto) {
+    fat32_fs *fs = im->fs;
+    if (im->stage_len > 0) {
+        cache_sync_range(fs, im->stage_start, im->stage_len, 1);
+        if (image_write(fs, cluster_offset(fs, im->stage_start), im->stage,
+                        im->stage_len * cluster_size(fs)) != 0) {
+            im->broken = 1;
+        }
+        im->stage_len = 0;
+    }
+    import_link(im, im->linked, upto);
+}
+
+// copies a run of a file's data into the stage, writing the stage out
+// first when the run does not continue it
+static void import_stage(IMPORT *im, const IMPORT_RUN *r, unsigned int upto) {
+    IMPORT_FILE *f = &im->files[r->file];
+    unsigned int clus_size = cluster_size(im->fs);
+
+    if (im->stage_len > 0 && (r->start != im->stage_start + im->stage_len ||
+                              im->stage_len + r->len > im->stage_cap)) {
+        import_flush(im, upto);
+    }
+    if (im->stage_len == 0) im->stage_start = r->start;
+
+    unsigned char *dst = im->stage + (size_t)im->stage_len * clus_size;
+    unsigned int room = r->len * clus_size;
+    unsigned int n = f->size - r->offset < room ? f->size - r->offset : room;
+    memcpy(dst, f->data + r->offset, n);
+    memset(dst + n, 0, room - n);
+    im->stage_len += r->len;
+}
+
+// allocates chains for the ready files [lo, hi) under one fat_lock and
+// stages their data
+static void import_batch(IMPORT *im, unsigned int lo, unsigned int hi) {
+    fat32_fs *fs = im->fs;
+    unsigned int clus_size = cluster_size(fs);
+
+    import_reserve(im, lo, hi);
+
+    im->nruns = 0;
+    pthread_rwlock_wrlock(&fs->fat_lock);
+    for (unsigned int i = lo; i < hi; i++) {
+        IMPORT_FILE *f = &im->files[i];
+        if (f->state != IMPORT_READY) continue;
+        if (im->full || im->broken) {
+            f->state = IMPORT_FAILED;
+            continue;
+        }
+
+        unsigned int want = (f->size + clus_size - 1) / clus_size;
+        unsigned int done = 0;
+        unsigned int last = 0;
+        unsigned int first_run = im->nruns;
+        while (done < want) {
+            if (im->nruns == im->runs_cap) {
+                unsigned int cap = im->runs_cap ? im->runs_cap * 2 : 256;
+                IMPORT_RUN *p = realloc(im->runs, cap * sizeof(IMPORT_RUN));
+                if (!p) break;
+                im->runs = p;
+                im->runs_cap = cap;
+            }
+            unsigned int start;
+            unsigned int got = alloc_run(fs, last ? last + 1 : im->goal, want - done, &start);
+            if (got == 0) {
+                im->full = 1;
+                break;
+            }
+            fat_link_run(fs, start, got);
+            if (last) write_cluster(fs, last, start);
+            else f->first = start;
+
+            IMPORT_RUN *r = &im->runs[im->nruns++];
+            r->file = i;
+            r->start = start;
+            r->len = got;
+            r->offset = done * clus_size;
+            done += got;
+            last = start + got - 1;
+        }
+        if (done < want) {
+            // freed by import_link() with the other failures
+            f->state = IMPORT_FAILED;
+            im->nruns = first_run;
+            continue;
+        }
+        if (last) im->goal = last + 1;
+    }
+    pthread_rwlock_unlock(&fs->fat_lock);
+
+    for (unsigned int k = 0; k < im->nruns; k++) {
+        import_stage(im, &im->runs[k], lo);
+    }
+    for (unsigned int i = lo; i < hi; i++) {
+        if (im->files[i].state == IMPORT_READY) STAT_ADD(fs, file_bytes, im->files[i].size);
+        free(im->files[i].data);
+        im->files[i].data = NULL;
+    }
+}
+
+// streams a file too large to stage straight from the host
+static void import_large(IMPORT *im, unsigned int i) {
+    fat32_fs *fs = im->fs;
+    IMPORT_FILE *f = &im->files[i];
+    unsigned int clus_size = cluster_size(fs);
+
+    import_flush(im, i);
+    import_reserve(im, i, i + 1);
+
+    OPEN_INODE tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    FILE *in = fopen(f->host, "rb");
+    unsigned char *buf = malloc(IO_MAX_CHUNK);
+    unsigned int done = 0;
+    unsigned int need = (f->size + clus_size - 1) / clus_size;
+    pthread_rwlock_rdlock(&fs->fat_lock);
+    int room = need <= fs->free_count;
+    pthread_rwlock_unlock(&fs->fat_lock);
+
+    // a file that does not fit fails alone; smaller ones may still fit
+    if (in && buf && room && f->reserved && !im->full && !im->broken) {
+        if (extents_reserve(fs, &tmp, need - 1) == 0) im->full = 1;
+        if (tmp.n_clusters > 0) f->first = extents_lookup(&tmp, 0);
+
+        while (!im->full && done < f->size) {
+            unsigned int want = f->size - done < IO_MAX_CHUNK ? f->size - done : IO_MAX_CHUNK;
+            if (fread(buf, 1, want, in) != want ||
+                file_write_data(fs, &tmp, done, buf, want) != 0) {
+                break;
+            }
+            done += want;
+        }
+        if (tmp.n_clusters > 0) im->goal = extents_lookup(&tmp, tmp.n_clusters - 1) + 1;
+    }
+    if (done < f->size) f->state = IMPORT_FAILED;
+    STAT_ADD(fs, file_bytes, done);
+
+    extents_clear(&tmp);
+    free(buf);
+    if (in) fclose(in);
+    import_link(im, i, i + 1);
+}
+
+// takes the files in order as the readers finish them
+static void import_commit(IMPORT *im) {
+    unsigned int i = 0;
+    while (i < im->nfiles) {
+        pthread_mutex_lock(&im->lock);
+        while (im->files[i].state == IMPORT_WAIT) {
+            pthread_cond_wait(&im->ready, &im->lock);
+        }
+        int large = im->files[i].size > IMPORT_SMALL;
+        unsigned int end = i + 1;
+        while (!large && end < im->nfiles && end - i < IMPORT_BATCH &&
+               im->files[end].state != IMPORT_WAIT && im->files[end].size <= IMPORT_SMALL) {
+            end++;
+        }
+        pthread_mutex_unlock(&im->lock);
+
+        unsigned long staged = 0;
+        if (large) {
+            import_large(im, i);
+        } else {
+            import_batch(im, i, end);
+            for (unsigned int k = i; k < end; k++) staged += im->files[k].size;
+        }
+
+        pthread_mutex_lock(&im->lock);
+        im->inflight -= staged;
+        im->committed = end;
+        pthread_cond_broadcast(&im->room);
+        pthread_mutex_unlock(&im->lock);
+        i = end;
+    }
+    import_flush(im, im->nfiles);
+}
+
+static void import_free(IMPORT *im) {
+    for (unsigned int i = 0; i < im->nfiles; i++) {
+        free(im->files[i].host);
+        free(im->files[i].data);
+    }
+    free(im->files);
+    free(im->runs);
+    free(im->stage);
+    pthread_mutex_destroy(&im->lock);
+    pthread_cond_destroy(&im->ready);
+    pthread_cond_destroy(&im->room);
+}
+
+// copies the contents of the host directory host into the image directory
+// path (NULL = the current one), merging with directories already there
+void import_cmd(fat32_fs *fs, char *host, char *path) {
+    if (!host) {
+        report_error(fs, "import requires [HOSTDIR] [DIRNAME].\n");
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct stat st;
+    if (stat(host, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        report_error(fs, "%s is not a host directory.\n", host);
+        return;
+    }
+    unsigned int dir;
+    if (path_dir_cmd(fs, path, &dir, NULL) != 0) {
+        return;
+    }
+
+    IMPORT im;
+    memset(&im, 0, sizeof(im));
+    im.fs = fs;
+    pthread_mutex_init(&im.lock, NULL);
+    pthread_cond_init(&im.ready, NULL);
+    pthread_cond_init(&im.room, NULL);
+    im.stage_cap = IO_MAX_CHUNK / cluster_size(fs);
+    im.stage = malloc(IO_MAX_CHUNK);
+
+    if (!im.stage || import_scan(&im, host, dir) != 0) {
+        import_free(&im);
+        report_error(fs, "could not allocate memory for import.\n");
+        return;
+    }
+
+    unsigned int threads = io_cpu_count();
+    if (threads > IMPORT_MAX_THREADS) threads = IMPORT_MAX_THREADS;
+    pthread_t tid[IMPORT_MAX_THREADS];
+    for (unsigned int t = 0; t < threads; t++) {
+        pthread_create(&tid[t], NULL, import_reader, &im);
+    }
+    import_commit(&im);
+    for (unsigned int t = 0; t < threads; t++) {
+        pthread_join(tid[t], NULL);
+    }
+
+    if (im.full) {
+        report_error(fs, "the volume is full; not everything was imported.\n");
+    } else if (im.broken) {
+        report_error(fs, "writing to the image failed; not everything was imported.\n");
+    }
+    printf("imported %lu file%s and %lu director%s", im.imported,
+           im.imported == 1 ? "" : "s", im.dirs, im.dirs == 1 ? "y" : "ies");
+    if (im.skipped > 0) printf(", skipped %lu hidden or special", im.skipped);
+    if (im.failed > 0) printf(", %lu failed", im.failed);
+    printf("\n");
+    report_transfer("import", im.bytes, seconds_since(&start));
+    import_free(&im);
+}
+
+//tree walks
+
+// tree, find and du walk the subtree of a directory with a pool of
+// workers. each worker keeps a deque of directories waiting to be scanned:
+// it pushes the subdirectories it finds and takes the newest back itself,
+// while a worker that runs dry steals the oldest entry of another deque,
+// usually the top of a large unvisited subtree. output is written a
+// directory at a time as scans finish, so it streams but is not sorted.
+#define WALK_MAX_THREADS 32
+
+enum { WALK_TREE, WALK_FIND, WALK_DU };
+
+// directory of a walk, freed once it and everything below it are done
+typedef struct WALK_DIR {
+    struct WALK_DIR *parent;
+    unsigned int first;
+    unsigned int pending;       // its own scan plus unfinished subdirectories
+    unsigned long bytes;        // du: bytes allocated in the subtree
+    char path[];                // canonical, "/A/B/"
+} WALK_DIR;
+
+typedef struct {
+    pthread_mutex_t lock;
+    WALK_DIR **items;
+    unsigned int lo, hi;        // thieves take at lo, the owner at hi
+    unsigned int cap;
+} WALK_DEQUE;
+
+typedef struct WALK WALK;
+
+typedef struct {
+    WALK *wk;
+    unsigned int index;
+    pthread_t tid;
+    WALK_DEQUE dq;
+    unsigned char *buf;         // directory cluster, unless mapped
+    char *out;                  // output for the directory being scanned
+    size_t out_len;
+    size_t out_cap;
+} WALK_WORKER;
+
+struct WALK {
+    fat32_fs *fs;
+    int kind;
+    const char *pattern;        // find: upper-cased shell pattern
+    FILE *out;
+    WALK_WORKER *workers;
+    unsigned int nthreads;
+
+    // directories not finished yet and those sitting in a deque. idle
+    // workers sleep on `more` until something is queued or all are done.
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    unsigned long pending;
+    unsigned long queued;
+    unsigned int idle;
+
+    int failed;
+    unsigned long dirs;
+    unsigned long files;
+    unsigned long file_bytes;   // tree: DIR_FileSize of the files
+    unsigned long alloc_bytes;  // tree: clusters of files and directories
+    unsigned long skipped;      // directories nested past PATH_MAX_LEN
+};
+
+// clusters in the chain starting at first. stops at anything that is not
+// a data cluster; a chain that loops is cut off at the volume size.
+static unsigned int walk_chain_length(fat32_fs *fs, unsigned int first) {
+    unsigned int n = 0;
+    unsigned int c = first;
+
+    pthread_rwlock_rdlock(&fs->fat_lock);
+    while (c >= 2 && c <= fs->max_cluster && n <= fs->max_cluster) {
+        n++;
+        c = fs->fat_table[c] & 0x0FFFFFFF;
+    }
+    pthread_rwlock_unlock(&fs->fat_lock);
+    STAT_ADD(fs, fat_lookups, n);
+    return n;
+}
+
+// a directory cluster: straight from the mapping, or read from the image
+// past the cluster cache, so the workers neither queue up on cache_lock
+// nor evict what the shell is using
+static DIR_ENTRY *walk_view(fat32_fs *fs, unsigned int cluster, unsigned char *scratch) {
+    if (fs->image_map) {
+        return (DIR_ENTRY *)map_cluster(fs, cluster);
+    }
+    if (cache_sync_range(fs, cluster, 1, 0) != 0 ||
+        image_read(fs, cluster_offset(fs, cluster), scratch, cluster_size(fs)) != 0) {
+        return NULL;
+    }
+    return (DIR_ENTRY *)scratch;
+}
+
+static void walk_printf(WALK_WORKER *w, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(w->out + w->out_len, w->out_cap - w->out_len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+
+    if (w->out_len + n >= w->out_cap) {
+        size_t cap = (w->out_len + n + 1) * 2;
+        char *p = realloc(w->out, cap);
+        if (!p) {
+            w->wk->failed = 1;
+            return;
+        }
+        w->out = p;
+        w->out_cap = cap;
+        va_start(ap, fmt);
+        vsnprintf(w->out + w->out_len, w->out_cap - w->out_len, fmt, ap);
+        va_end(ap);
+    }
+    w->out_len += n;
+}
+
+// one fwrite per directory: stdio keeps it in one piece
+static void walk_flush(WALK_WORKER *w) {
+    if (w->out_len > 0) fwrite(w->out, 1, w->out_len, w->wk->out);
+    w->out_len = 0;
+}
+
+static int walk_push(WALK_WORKER *w, WALK_DIR *d) {
+    WALK *wk = w->wk;
+    WALK_DEQUE *dq = &w->dq;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->hi == dq->cap) {
+        if (dq->lo > 0) {
+            memmove(dq->items, dq->items + dq->lo, (dq->hi - dq->lo) * sizeof(WALK_DIR *));
+            dq->hi -= dq->lo;
+            dq->lo = 0;
+        } else {
+            unsigned int cap = dq->cap ? dq->cap * 2 : 64;
+            WALK_DIR **p = realloc(dq->items, cap * sizeof(WALK_DIR *));
+            if (!p) {
+                pthread_mutex_unlock(&dq->lock);
+                return -1;
+            }
+            dq->items = p;
+            dq->cap = cap;
+        }
+    }
+    dq->items[dq->hi++] = d;
+    pthread_mutex_unlock(&dq->lock);
+
+    __atomic_add_fetch(&wk->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&wk->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&wk->lock);
+        pthread_cond_signal(&wk->more);
+        pthread_mutex_unlock(&wk->lock);
+    }
+    return 0;
+}
+
+// newest directory of the own deque (owner) or oldest of another (thief)
+static WALK_DIR *walk_take(WALK_DEQUE *dq, int steal) {
+    WALK_DIR *d = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->hi > dq->lo) {
+        d = steal ? dq->items[dq->lo++] : dq->items[--dq->hi];
+        if (dq->lo == dq->hi) dq->lo = dq->hi = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return d;
+}
+
+static WALK_DIR *walk_next(WALK_WORKER *w) {
+    WALK *wk = w->wk;
+    WALK_DIR *d = walk_take(&w->dq, 0);
+    for (unsigned int i = 1; !d && i < wk->nthreads; i++) {
+        d = walk_take(&wk->workers[(w->index + i) % wk->nthreads].dq, 1);
+    }
+    if (d) __atomic_sub_fetch(&wk->queued, 1, __ATOMIC_SEQ_CST);
+    return d;
+}
+
+// queues a subdirectory found while scanning d
+static void walk_descend(WALK_WORKER *w, WALK_DIR *d, const char *name, unsigned int first) {
+    WALK *wk = w->wk;
+    size_t plen = strlen(d->path);
+    size_t nlen = strlen(name);
+
+    if (plen + nlen + 2 > PATH_MAX_LEN) {
+        // also ends directories that contain themselves
+        __atomic_add_fetch(&wk->skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    WALK_DIR *c = malloc(sizeof(WALK_DIR) + plen + nlen + 2);
+    if (!c) {
+        wk->failed = 1;
+        return;
+    }
+    c->parent = d;
+    c->first = first;
+    c->pending = 1;
+    c->bytes = 0;
+    memcpy(c->path, d->path, plen);
+    memcpy(c->path + plen, name, nlen);
+    strcpy(c->path + plen + nlen, "/");
+
+    __atomic_add_fetch(&d->pending, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&wk->pending, 1, __ATOMIC_SEQ_CST);
+    if (walk_push(w, c) != 0) {
+        wk->failed = 1;
+        __atomic_sub_fetch(&d->pending, 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&wk->pending, 1, __ATOMIC_SEQ_CST);
+        free(c);
+    }
+}
+
+// lists one directory and queues its subdirectories
+static void walk_scan(WALK_WORKER *w, WALK_DIR *d) {
+    WALK *wk = w->wk;
+    fat32_fs *fs = wk->fs;
+    unsigned int size = cluster_size(fs);
+    unsigned int per_cluster = size / sizeof(DIR_ENTRY);
+    unsigned long dirs = 0, files = 0, file_bytes = 0;
+    unsigned int length = walk_chain_length(fs, d->first);
+    unsigned long alloc = (unsigned long)length * size;
+
+    if (wk->kind == WALK_TREE) walk_printf(w, "%s\n", d->path);
+
+    pthread_rwlock_rdlock(dir_lock(fs, d->first));
+    unsigned int cluster = d->first;
+    for (unsigned int k = 0; k < length; k++) {
+        if (k > 0) cluster = fat_get(fs, cluster);
+        DIR_ENTRY *entries = walk_view(fs, cluster, w->buf);
+        if (!entries) {
+            wk->failed = 1;
+            break;
+        }
+
+        unsigned int i;
+        for (i = 0; i < per_cluster; i++) {
+            DIR_ENTRY *e = &entries[i];
+            if (e->DIR_Name[0] == 0x00) break;
+            if (!is_valid_entry(e)) continue;
+            if (e->DIR_Attr & 0x08) continue;       // volume label
+            if (e->DIR_Name[0] == '.') continue;    // "." and ".."
+
+            char name[12];
+            memcpy(name, e->DIR_Name, 11);
+            name[11] = '\0';
+            for (int j = 10; j >= 0 && name[j] == ' '; j--) name[j] = '\0';
+
+            unsigned int first = ((unsigned int)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO;
+            int is_dir = (e->DIR_Attr & ATTR_DIRECTORY) != 0;
+
+            if (wk->kind == WALK_FIND && fnmatch(wk->pattern, name, 0) == 0) {
+                walk_printf(w, "%s%s%s\n", d->path, name, is_dir ? "/" : "");
+            }
+            if (is_dir) {
+                dirs++;
+                if (wk->kind == WALK_TREE) walk_printf(w, "  %s/\n", name);
+                if (first >= 2 && first <= fs->max_cluster) walk_descend(w, d, name, first);
+                continue;
+            }
+
+            // what the file holds on disk, whatever its entry claims
+            unsigned long used = (unsigned long)walk_chain_length(fs, first) * size;
+            files++;
+            file_bytes += e->DIR_FileSize;
+            alloc += used;
+            if (wk->kind == WALK_TREE) {
+                walk_printf(w, "  %-11s %10u %10lu\n", name, e->DIR_FileSize, used);
+            }
+        }
+        if (i < per_cluster) break;
+    }
+    pthread_rwlock_unlock(dir_lock(fs, d->first));
+
+    __atomic_add_fetch(&d->bytes, alloc, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&wk->dirs, dirs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&wk->files, files, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&wk->file_bytes, file_bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&wk->alloc_bytes, alloc, __ATOMIC_RELAXED);
+    walk_flush(w);
+}
+
+// ends d's own scan. a directory whose whole subtree is done adds its
+// total to its parent (du prints it then) and is freed, which may finish
+// the parent in turn.
+static void walk_finish(WALK *wk, WALK_DIR *d) {
+    while (d && __atomic_sub_fetch(&d->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        WALK_DIR *parent = d->parent;
+        if (wk->kind == WALK_DU) {
+            fprintf(wk->out, "%12lu  %s\n", d->bytes, d->path);
+        }
+        if (parent) __atomic_add_fetch(&parent->bytes, d->bytes, __ATOMIC_SEQ_CST);
+        free(d);
+        d = parent;
+    }
+}
+
+static void *walk_thread(void *arg) {
+    WALK_WORKER *w = arg;
+    WALK *wk = w->wk;
+
+    while (1) {
+        WALK_DIR *d = walk_next(w);
+        if (d) {
+            walk_scan(w, d);
+            walk_finish(wk, d);
+            if (__atomic_sub_fetch(&wk->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&wk->lock);
+                pthread_cond_broadcast(&wk->more);
+                pthread_mutex_unlock(&wk->lock);
+            }
+            continue;
+        }
+
+        // announce being idle before looking at `queued`, so a push either
+        // is seen here or sees us waiting and signals
+        pthread_mutex_lock(&wk->lock);
+        __atomic_add_fetch(&wk->idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&wk->queued, __ATOMIC_SEQ_CST) == 0 &&
+               __atomic_load_n(&wk->pending, __ATOMIC_SEQ_CST) > 0) {
+            pthread_cond_wait(&wk->more, &wk->lock);
+        }
+        __atomic_sub_fetch(&wk->idle, 1, __ATOMIC_SEQ_CST);
+        int done = __atomic_load_n(&wk->pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&wk->lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+static void walk_free(WALK *wk) {
+    for (unsigned int i = 0; i < wk->nthreads; i++) {
+        free(wk->workers[i].dq.items);
+        pthread_mutex_destroy(&wk->workers[i].dq.lock);
+        free(wk->workers[i].buf);
+        free(wk->workers[i].out);
+    }
+    free(wk->workers);
+    pthread_mutex_destroy(&wk->lock);
+    pthread_cond_destroy(&wk->more);
+}
+
+// walks the tree below path (NULL = the current directory) with one
+// worker per CPU
+static void walk_cmd(fat32_fs *fs, int kind, const char *path, const char *pattern) {
+    static const char *names[] = { "tree", "find", "du" };
+    char canon[PATH_MAX_LEN];
+    unsigned int first;
+    if (path_dir_cmd(fs, path, &first, canon) != 0) {
+        return;
+    }
+
+    WALK wk;
+    memset(&wk, 0, sizeof(wk));
+    wk.fs = fs;
+    wk.kind = kind;
+    wk.pattern = pattern;
+    wk.out = stdout;
+    pthread_mutex_init(&wk.lock, NULL);
+    pthread_cond_init(&wk.more, NULL);
+
+    unsigned int threads = io_cpu_count();
+    if (threads > WALK_MAX_THREADS) threads = WALK_MAX_THREADS;
+    wk.workers = calloc(threads, sizeof(WALK_WORKER));
+    WALK_DIR *root = malloc(sizeof(WALK_DIR) + strlen(canon) + 1);
+    int ok = wk.workers && root;
+    for (unsigned int i = 0; wk.workers && i < threads; i++) {
+        WALK_WORKER *w = &wk.workers[i];
+        w->wk = &wk;
+        w->index = i;
+        pthread_mutex_init(&w->dq.lock, NULL);
+        wk.nthreads++;
+        if (!fs->image_map && (w->buf = malloc(cluster_size(fs))) == NULL) ok = 0;
+    }
+    if (ok) {
+        root->parent = NULL;
+        root->first = first;
+        root->pending = 1;
+        root->bytes = 0;
+        strcpy(root->path, canon);
+        wk.pending = 1;
+        ok = walk_push(&wk.workers[0], root) == 0;
+    }
+    if (!ok) {
+        free(root);
+        walk_free(&wk);
+        report_error(fs, "could not allocate memory for %s.\n", names[kind]);
+        return;
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_create(&wk.workers[i].tid, NULL, walk_thread, &wk.workers[i]);
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_join(wk.workers[i].tid, NULL);
+    }
+
+    if (kind == WALK_TREE) {
+        fprintf(wk.out, "%lu director%s, %lu file%s, %lu bytes (%lu allocated)\n",
+                wk.dirs, wk.dirs == 1 ? "y" : "ies", wk.files, wk.files == 1 ? "" : "s",
+                wk.file_bytes, wk.alloc_bytes);
+    }
+    if (wk.skipped > 0) {
+        report_error(fs, "%lu director%s nested too deep skipped.\n", wk.skipped,
+                     wk.skipped == 1 ? "y" : "ies");
+    }
+    if (wk.failed) {
+        report_error(fs, "%s could not read the whole tree.\n", names[kind]);
+    }
+    walk_free(&wk);
+}
+
+void tree_cmd(fat32_fs *fs, char *path) {
+    walk_cmd(fs, WALK_TREE, path, NULL);
+}
+
+void find_cmd(fat32_fs *fs, char *pattern, char *path) {
+    if (!pattern) {
+        report_error(fs, "find needs a pattern.\n");
+        return;
+    }
+    // names are stored upper case
+    char *upper = strdup(pattern);
+    if (!upper) {
+        report_error(fs, "could not allocate memory for find.\n");
+        return;
+    }
+    for (char *p = upper; *p; p++) *p = (char)toupper((unsigned char)*p);
+    walk_cmd(fs, WALK_FIND, path, upper);
+    free(upper);
+}
+
+void du_cmd(fat32_fs *fs, char *path) {
+    walk_cmd(fs, WALK_DU, path, NULL);
+}
+
+//fsck
+
+// owner ids pack the walking thread into the top bits and the index of the
+// entry's record below them; 0 means unclaimed
+#define FSCK_MAX_THREADS 32
+#define FSCK_ID_BITS     26
+#define FSCK_LOST        0xFFFFFFFF     // owner of allocated, unreachable clusters
+#define FSCK_FAT_CHUNK   64             // FAT sectors compared per read
+
+// one directory entry found by the walk
+typedef struct {
+    unsigned int parent;        // owner id of the containing directory, 0 for root
+    unsigned char name[11];
+    unsigned char attr;
+    DIR_POS pos;                // where the entry itself is stored
+    unsigned int first;
+    unsigned int size;
+    unsigned int length;        // clusters claimed for it
+} FSCK_REC;
+
+enum { FSCK_CROSSLINK, FSCK_BAD_CHAIN, FSCK_LOOP, FSCK_SIZE, FSCK_PREALLOC };
+
+typedef struct {
+    int kind;
+    unsigned int id;
+    unsigned int other;         // cross-link: the entry owning the cluster
+    unsigned int cluster;       // cluster (or FAT value) where it went wrong
+    unsigned int keep;          // last cluster worth keeping, 0 = none
+} FSCK_ISSUE;
+
+// directory waiting to be scanned
+typedef struct {
+    unsigned int id;
+    unsigned int first;
+    unsigned int length;
+} FSCK_DIR;
+
+typedef struct FSCK FSCK;
+
+typedef struct {
+    FSCK *ck;
+    unsigned int index;
+    pthread_t tid;
+    FSCK_REC *recs;
+    unsigned int nrecs;
+    unsigned int recs_cap;
+    unsigned char *buf;
+    unsigned int lo, hi;        // range for the FAT scans
+    unsigned long count;        // lost clusters, or differing FAT sectors
+    unsigned long free;
+    unsigned long bad;          // clusters marked bad (0x0FFFFFF7)
+} FSCK_WORKER;
+
+struct FSCK {
+    fat32_fs *fs;
+    unsigned int *owner;        // per cluster
+    FSCK_WORKER *workers;
+    unsigned int nthreads;
+    int fat_copy;               // FAT copy being compared with copy 0
+    int verbose;                // list preallocated files too
+
+    // directories left to scan and problems found, shared by the walkers
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    FSCK_DIR *stack;
+    unsigned int nstack;
+    unsigned int stack_cap;
+    unsigned int busy;
+    int failed;
+    FSCK_ISSUE *issues;
+    unsigned int nissues;
+    unsigned int issues_cap;
+};
+
+// FAT entry without the lookup counter, which the workers would fight over
+static unsigned int fsck_next(fat32_fs *fs, unsigned int cluster) {
+    return fs->fat_table[cluster] & 0x0FFFFFFF;
+}
+
+static FSCK_REC *fsck_rec(FSCK *ck, unsigned int id) {
+    id--;
+    return &ck->workers[id >> FSCK_ID_BITS].recs[id & ((1u << FSCK_ID_BITS) - 1)];
+}
+
+static void fsck_issue(FSCK *ck, int kind, unsigned int id, unsigned int other,
+                       unsigned int cluster, unsigned int keep) {
+    pthread_mutex_lock(&ck->lock);
+    if (ck->nissues == ck->issues_cap) {
+        unsigned int cap = ck->issues_cap ? ck->issues_cap * 2 : 64;
+        FSCK_ISSUE *p = realloc(ck->issues, cap * sizeof(FSCK_ISSUE));
+        if (!p) {
+            ck->failed = 1;
+            pthread_mutex_unlock(&ck->lock);
+            return;
+        }
+        ck->issues = p;
+        ck->issues_cap = cap;
+    }
+    FSCK_ISSUE *is = &ck->issues[ck->nissues++];
+    is->kind = kind;
+    is->id = id;
+    is->other = other;
+    is->cluster = cluster;
+    is->keep = keep;
+    pthread_mutex_unlock(&ck->lock);
+}
+
+// the caller holds ck->lock
+static int fsck_push(FSCK *ck, unsigned int id, unsigned int first, unsigned int length) {
+    if (ck->nstack == ck->stack_cap) {
+        unsigned int cap = ck->stack_cap ? ck->stack_cap * 2 : 64;
+        FSCK_DIR *p = realloc(ck->stack, cap * sizeof(FSCK_DIR));
+        if (!p) return -1;
+        ck->stack = p;
+        ck->stack_cap = cap;
+    }
+    ck->stack[ck->nstack].id = id;
+    ck->stack[ck->nstack].first = first;
+    ck->stack[ck->nstack].length = length;
+    ck->nstack++;
+    return 0;
+}
+
+// new record for the walking thread; returns its owner id or 0
+static unsigned int fsck_new_rec(FSCK_WORKER *w) {
+    if (w->nrecs == w->recs_cap) {
+        unsigned int cap = w->recs_cap ? w->recs_cap * 2 : 256;
+        if (cap > (1u << FSCK_ID_BITS)) return 0;
+        FSCK_REC *p = realloc(w->recs, cap * sizeof(FSCK_REC));
+        if (!p) return 0;
+        w->recs = p;
+        w->recs_cap = cap;
+    }
+    memset(&w->recs[w->nrecs], 0, sizeof(FSCK_REC));
+    return ((w->index << FSCK_ID_BITS) | w->nrecs++) + 1;
+}
+
+// follows a chain and claims every cluster of it for `id`. stops at the
+// first cluster that is out of range, free, bad or already claimed.
+// returns the number of clusters claimed; *clean is 1 when the chain
+// ended with a proper end-of-chain mark.
+static unsigned int fsck_claim(FSCK *ck, unsigned int id, unsigned int first, int *clean) {
+    fat32_fs *fs = ck->fs;
+    unsigned int cluster = first;
+    unsigned int keep = 0;
+    unsigned int length = 0;
+
+    *clean = 0;
+    if (cluster < 2 || cluster > fs->max_cluster) {
+        fsck_issue(ck, FSCK_BAD_CHAIN, id, 0, cluster, 0);
+        return 0;
+    }
+    while (1) {
+        unsigned int prev = 0;
+        if (!__atomic_compare_exchange_n(&ck->owner[cluster], &prev, id, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            fsck_issue(ck, prev == id ? FSCK_LOOP : FSCK_CROSSLINK, id, prev, cluster, keep);
+            return length;
+        }
+        length++;
+
+        unsigned int next = fsck_next(fs, cluster);
+        if (next >= 0x0FFFFFF8) {
+            *clean = 1;
+            return length;
+        }
+        if (next < 2 || next > fs->max_cluster) {
+            // free, reserved, bad (0x0FFFFFF7) or pointing off the volume
+            fsck_issue(ck, FSCK_BAD_CHAIN, id, 0, next, cluster);
+            return length;
+        }
+        keep = cluster;
+        cluster = next;
+    }
+}
+
+// records every entry of one directory, claims its chain and queues the
+// subdirectories it holds
+static void fsck_scan_dir(FSCK_WORKER *w, const FSCK_DIR *dir) {
+    FSCK *ck = w->ck;
+    fat32_fs *fs = ck->fs;
+    unsigned int size = cluster_size(fs);
+    unsigned int per_cluster = size / sizeof(DIR_ENTRY);
+    unsigned int cluster = dir->first;
+
+    for (unsigned int k = 0; k < dir->length; k++) {
+        if (k > 0) cluster = fsck_next(fs, cluster);
+        if (image_read(fs, cluster_offset(fs, cluster), w->buf, size) != 0) {
+            ck->failed = 1;
+            return;
+        }
+
+        for (unsigned int i = 0; i < per_cluster; i++) {
+            DIR_ENTRY *e = (DIR_ENTRY *)(w->buf + i * sizeof(DIR_ENTRY));
+            if (e->DIR_Name[0] == 0x00) return;
+            if (!is_valid_entry(e)) continue;
+            if (e->DIR_Attr & 0x08) continue;       // volume label
+            if (e->DIR_Name[0] == '.') continue;    // "." and ".."
+
+            unsigned int id = fsck_new_rec(w);
+            if (id == 0) {
+                ck->failed = 1;
+                return;
+            }
+            FSCK_REC *r = &w->recs[w->nrecs - 1];
+            r->parent = dir->id;
+            memcpy(r->name, e->DIR_Name, 11);
+            r->attr = e->DIR_Attr;
+            r->pos.cluster = cluster;
+            r->pos.index = (int)i;
+            r->first = ((unsigned int)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO;
+            r->size = e->DIR_FileSize;
+
+            int clean = 1;
+            if (r->first != 0 || (r->attr & ATTR_DIRECTORY)) {
+                r->length = fsck_claim(ck, id, r->first, &clean);
+            }
+
+            if (r->attr & ATTR_DIRECTORY) {
+                if (r->length > 0) {
+                    pthread_mutex_lock(&ck->lock);
+                    if (fsck_push(ck, id, r->first, r->length) != 0) ck->failed = 1;
+                    pthread_cond_signal(&ck->more);
+                    pthread_mutex_unlock(&ck->lock);
+                }
+            } else if (clean && r->size > (unsigned long)r->length * size) {
+                fsck_issue(ck, FSCK_SIZE, id, 0, 0, 0);
+            } else if (clean && ck->verbose && (unsigned long)r->length * size >=
+                                                (unsigned long)r->size + size) {
+                // clusters past the size are fallocate reservations, not
+                // a problem; listed only on request
+                fsck_issue(ck, FSCK_PREALLOC, id, 0, 0, 0);
+            }
+        }
+    }
+}
+
+static void *fsck_walk_thread(void *arg) {
+    FSCK_WORKER *w = arg;
+    FSCK *ck = w->ck;
+
+    pthread_mutex_lock(&ck->lock);
+    while (1) {
+        while (ck->nstack == 0 && ck->busy > 0) {
+            pthread_cond_wait(&ck->more, &ck->lock);
+        }
+        if (ck->nstack == 0) break;
+
+        FSCK_DIR dir = ck->stack[--ck->nstack];
+        ck->busy++;
+        pthread_mutex_unlock(&ck->lock);
+
+        fsck_scan_dir(w, &dir);
+
+        pthread_mutex_lock(&ck->lock);
+        ck->busy--;
+    }
+    // nothing queued and nobody scanning: wake the others so they finish
+    pthread_cond_broadcast(&ck->more);
+    pthread_mutex_unlock(&ck->lock);
+    return NULL;
+}
+
+// marks allocated clusters that no entry reached and counts free and bad
+// ones
+static void *fsck_lost_thread(void *arg) {
+    FSCK_WORKER *w = arg;
+    fat32_fs *fs = w->ck->fs;
+
+    for (unsigned int c = w->lo; c < w->hi; c++) {
+        unsigned int next = fsck_next(fs, c);
+        if (next == 0) {
+            w->free++;
+        } else if (next == 0x0FFFFFF7) {
+            // bad clusters belong to nobody and must stay allocated
+            w->bad++;
+        } else if (w->ck->owner[c] == 0) {
+            w->ck->owner[c] = FSCK_LOST;
+            w->count++;
+        }
+    }
+    return NULL;
+}
+
+// counts sectors of FAT copy ck->fat_copy that differ from copy 0
+static void *fsck_fat_thread(void *arg) {
+    FSCK_WORKER *w = arg;
+    fat32_fs *fs = w->ck->fs;
+    unsigned int bps = fs->bpb.BPB_BytsPerSec;
+    uint64_t copy_off =
+        fs->fat_start_off + (uint64_t)w->ck->fat_copy * fs->bpb.BPB_FATSz32 * bps;
+    unsigned int chunk = FSCK_FAT_CHUNK;
+    unsigned char *a = w->buf;
+    unsigned char *b = w->buf + chunk * bps;
+
+    w->count = 0;
+    for (unsigned int sec = w->lo; sec < w->hi; sec += chunk) {
+        unsigned int n = (w->hi - sec < chunk) ? w->hi - sec : chunk;
+        if (image_read(fs, fs->fat_start_off + (uint64_t)sec * bps, a, n * bps) != 0 ||
+            image_read(fs, copy_off + (uint64_t)sec * bps, b, n * bps) != 0) {
+            w->ck->failed = 1;
+            return NULL;
+        }
+        for (unsigned int i = 0; i < n; i++) {
+            if (memcmp(a + i * bps, b + i * bps, bps) != 0) w->count++;
+        }
+    }
+    return NULL;
+}
+
+// runs fn on every worker, giving each a slice of [lo, hi)
+static void fsck_run(FSCK *ck, void *(*fn)(void *), unsigned int lo, unsigned int hi) {
+    unsigned int per = (hi - lo + ck->nthreads - 1) / ck->nthreads;
+    for (unsigned int i = 0; i < ck->nthreads; i++) {
+        FSCK_WORKER *w = &ck->workers[i];
+        w->lo = lo + i * per < hi ? lo + i * per : hi;
+        w->hi = w->lo + per < hi ? w->lo + per : hi;
+        pthread_create(&w->tid, NULL, fn, w);
+    }
+    for (unsigned int i = 0; i < ck->nthreads; i++) {
+        pthread_join(ck->workers[i].tid, NULL);
+    }
+}
+
+// full path of a record, directories with a trailing '/'
+static void fsck_path(FSCK *ck, unsigned int id, char *out, size_t len) {
+    FSCK_REC *r = fsck_rec(ck, id);
+    if (r->parent == 0) {
+        snprintf(out, len, "/");
+        return;
+    }
+    fsck_path(ck, r->parent, out, len);
+
+    char name[12];
+    memcpy(name, r->name, 11);
+    name[11] = '\0';
+    for (int j = 10; j >= 0 && name[j] == ' '; j--) name[j] = '\0';
+
+    size_t used = strlen(out);
+    snprintf(out + used, len - used, "%s%s", name,
+             (r->attr & ATTR_DIRECTORY) ? "/" : "");
+}
+
+static void fsck_print_issue(FSCK *ck, const FSCK_ISSUE *is, FILE *out) {
+    char path[1024];
+    char other[1024];
+    fsck_path(ck, is->id, path, sizeof(path));
+
+    switch (is->kind) {
+    case FSCK_CROSSLINK:
+        fsck_path(ck, is->other, other, sizeof(other));
+        fprintf(out, "cross-link: %s and %s share cluster %u\n", path, other, is->cluster);
+        break;
+    case FSCK_LOOP:
+        fprintf(out, "chain loop: %s returns to cluster %u\n", path, is->cluster);
+        break;
+    case FSCK_BAD_CHAIN:
+        fprintf(out, "bad chain: %s leads to cluster 0x%08X\n", path, is->cluster);
+        break;
+    case FSCK_SIZE: {
+        FSCK_REC *r = fsck_rec(ck, is->id);
+        fprintf(out, "size mismatch: %s is %u bytes but has %u cluster(s)\n",
+                path, r->size, r->length);
+        break;
+    }
+    case FSCK_PREALLOC: {
+        FSCK_REC *r = fsck_rec(ck, is->id);
+        fprintf(out, "preallocated: %s is %u bytes and has %u cluster(s)\n",
+                path, r->size, r->length);
+        break;
+    }
+    }
+}
+
+// cuts a broken chain after its last good cluster. the caller holds
+// fat_lock for writing; the entry itself is fixed by fsck_fix_entry().
+static void fsck_fix_chain(FSCK *ck, const FSCK_ISSUE *is) {
+    if (is->kind != FSCK_SIZE && is->kind != FSCK_PREALLOC && is->keep != 0) {
+        write_cluster(ck->fs, is->keep, FAT32_EOC);
+    }
+}
+
+// makes an entry agree with what is left of its chain: the size is clipped
+// to the clusters kept, and a directory without any cluster is removed.
+// returns 1 when the entry was removed.
+static int fsck_fix_entry(FSCK *ck, const FSCK_ISSUE *is) {
+    fat32_fs *fs = ck->fs;
+    FSCK_REC *r = fsck_rec(ck, is->id);
+    if (r->parent == 0) return 0;   // the root has no entry to fix
+    if (is->kind == FSCK_PREALLOC) return 0;
+
+    DIR_ENTRY entry;
+    if (cache_read(fs, r->pos.cluster, r->pos.index * sizeof(DIR_ENTRY),
+                   &entry, sizeof(entry)) != 0) {
+        return 0;
+    }
+
+    if (r->length == 0) {
+        if (r->attr & ATTR_DIRECTORY) {
+            dir_remove(fs, fsck_rec(ck, r->parent)->first, &r->pos);
+            return 1;
+        }
+        entry.DIR_FstClusHI = 0;
+        entry.DIR_FstClusLO = 0;
+    }
+    unsigned long max = (unsigned long)r->length * cluster_size(fs);
+    if (!(r->attr & ATTR_DIRECTORY) && entry.DIR_FileSize > max) {
+        entry.DIR_FileSize = (unsigned int)max;
+    }
+    dir_put(fs, &r->pos, &entry);
+    return 0;
+}
+
+static void fsck_free(FSCK *ck) {
+    for (unsigned int i = 0; i < ck->nthreads; i++) {
+        free(ck->workers[i].recs);
+        free(ck->workers[i].buf);
+    }
+    free(ck->workers);
+    free(ck->owner);
+    free(ck->stack);
+    free(ck->issues);
+    pthread_mutex_destroy(&ck->lock);
+    pthread_cond_destroy(&ck->more);
+}
+
+// checks the whole volume: every chain reachable from the root is walked
+// and claimed cluster by cluster, so cross-linked, looping or broken
+// chains, files longer than their chain, allocated clusters nobody owns
+// and FAT copies that disagree all show up. clusters marked bad are
+// counted but never freed; chains longer than their file hold fallocate
+// reservations and are left alone. directories are scanned in
+// parallel by `threads` workers (0 = one per CPU). the image must not
+// change meanwhile, so every other call waits until the check is done.
+// returns the number of problems found, or -1 when the check failed.
+int fat32_fsck(fat32_fs *fs, int flags, unsigned int threads, FILE *out) {
+    FSCK ck;
+    memset(&ck, 0, sizeof(ck));
+    ck.fs = fs;
+    pthread_mutex_init(&ck.lock, NULL);
+    pthread_cond_init(&ck.more, NULL);
+
+    if (threads == 0) threads = io_cpu_count();
+    if (threads > FSCK_MAX_THREADS) threads = FSCK_MAX_THREADS;
+
+    // each worker's buffer holds a directory cluster or two FAT chunks
+    unsigned int buf_size = cluster_size(fs);
+    if (buf_size < 2 * FSCK_FAT_CHUNK * fs->bpb.BPB_BytsPerSec) {
+        buf_size = 2 * FSCK_FAT_CHUNK * fs->bpb.BPB_BytsPerSec;
+    }
+
+    ck.nthreads = threads;
+    ck.workers = calloc(threads, sizeof(FSCK_WORKER));
+    ck.owner = calloc((size_t)fs->max_cluster + 1, sizeof(unsigned int));
+    int ok = ck.workers && ck.owner;
+    for (unsigned int i = 0; ok && i < threads; i++) {
+        ck.workers[i].ck = &ck;
+        ck.workers[i].index = i;
+        ck.workers[i].buf = malloc(buf_size);
+        if (!ck.workers[i].buf) ok = 0;
+    }
+    if (!ok) {
+        if (!ck.workers) ck.nthreads = 0;
+        fsck_free(&ck);
+        report_error(fs, "could not allocate memory for fsck.\n");
+        return -1;
+    }
+
+    int repair = (flags & FAT32_FSCK_REPAIR) != 0;
+    ck.verbose = (flags & FAT32_FSCK_VERBOSE) != 0;
+
+    // shut everybody else out, then bring the image up to date so the
+    // workers can read it directly
+    pthread_rwlock_wrlock(&fs->open_lock);
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++) {
+        pthread_rwlock_wrlock(&fs->dir_locks[i]);
+    }
+    if (repair && fs->open_ninodes > 0) {
+        fprintf(out, "files are open, checking only\n");
+        repair = 0;
+    }
+    if ((cache_flush(fs) != 0 || fat_flush(fs) != 0) && repair) {
+        fprintf(out, "cached clusters or the FAT could not be written, checking only\n");
+        repair = 0;
+    }
+    pthread_rwlock_wrlock(&fs->fat_lock);
+
+    // the root has no entry; give it a record so paths end there
+    unsigned int root = fsck_new_rec(&ck.workers[0]);
+    FSCK_REC *r = &ck.workers[0].recs[0];
+    r->attr = ATTR_DIRECTORY;
+    r->first = fs->bpb.BPB_RootClus;
+    int clean;
+    r->length = fsck_claim(&ck, root, r->first, &clean);
+    if (r->length > 0) fsck_push(&ck, root, r->first, r->length);
+
+    fsck_run(&ck, fsck_walk_thread, 0, 0);
+
+    unsigned long lost = 0;
+    unsigned long free_clusters = 0;
+    unsigned long bad_clusters = 0;
+    if (!ck.failed) {
+        fsck_run(&ck, fsck_lost_thread, 2, fs->max_cluster + 1);
+        for (unsigned int i = 0; i < threads; i++) {
+            lost += ck.workers[i].count;
+            free_clusters += ck.workers[i].free;
+            bad_clusters += ck.workers[i].bad;
+        }
+    }
+
+    unsigned long preallocated = 0;
+    for (unsigned int i = 0; i < ck.nissues; i++) {
+        if (ck.issues[i].kind == FSCK_PREALLOC) preallocated++;
+    }
+    unsigned long problems = ck.nissues - preallocated + (lost > 0);
+    unsigned int bad_copies = 0;
+    int first_bad = 0;
+    unsigned long bad_sectors = 0;
+    for (int copy = 1; !ck.failed && copy < fs->bpb.BPB_NumFATs; copy++) {
+        ck.fat_copy = copy;
+        fsck_run(&ck, fsck_fat_thread, 0, fs->bpb.BPB_FATSz32);
+
+        unsigned long differ = 0;
+        for (unsigned int i = 0; i < threads; i++) differ += ck.workers[i].count;
+        if (differ > 0) {
+            if (bad_copies == 0) first_bad = copy;
+            bad_copies++;
+            bad_sectors += differ;
+        }
+    }
+    problems += bad_copies;
+
+    if (ck.failed) {
+        pthread_rwlock_unlock(&fs->fat_lock);
+        for (int i = DIR_LOCK_STRIPES - 1; i >= 0; i--) {
+            pthread_rwlock_unlock(&fs->dir_locks[i]);
+        }
+        pthread_rwlock_unlock(&fs->open_lock);
+        fsck_free(&ck);
+        report_error(fs, "fsck could not read the whole volume.\n");
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < ck.nissues; i++) {
+        fsck_print_issue(&ck, &ck.issues[i], out);
+    }
+    if (lost > 0) {
+        fprintf(out, "lost clusters: %lu\n", lost);
+    }
+    if (bad_clusters > 0) {
+        fprintf(out, "bad clusters: %lu\n", bad_clusters);
+    }
+    if (bad_copies > 0) {
+        fprintf(out, "FAT copies differ from FAT 0 in %lu sector(s), first copy %d\n",
+                bad_sectors, first_bad);
+    }
+
+    if (repair && problems > 0) {
+        for (unsigned int i = 0; i < ck.nissues; i++) {
+            fsck_fix_chain(&ck, &ck.issues[i]);
+        }
+        for (unsigned int c = 2; lost > 0 && c <= fs->max_cluster; c++) {
+            if (ck.owner[c] == FSCK_LOST) write_cluster(fs, c, 0);
+        }
+        if (bad_copies > 0) {
+            // rewrite every copy from the in-memory table
+            memset(fs->fat_dirty, 1, fs->bpb.BPB_FATSz32);
+            fs->fat_has_dirty = 1;
+        }
+    }
+    pthread_rwlock_unlock(&fs->fat_lock);
+
+    unsigned long removed = 0;
+    int unsaved = 0;
+    if (repair && problems > 0) {
+        for (unsigned int i = 0; i < ck.nissues; i++) {
+            removed += fsck_fix_entry(&ck, &ck.issues[i]);
+        }
+        // removed directories may still be cached under their paths
+        if (removed > 0) dentry_drop(fs, "/");
+        unsaved = fat32_sync(fs) != 0;
+    }
+
+    for (int i = DIR_LOCK_STRIPES - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&fs->dir_locks[i]);
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+
+    unsigned long entries = 0;
+    for (unsigned int i = 0; i < threads; i++) entries += ck.workers[i].nrecs;
+    fprintf(out, "%lu entries, %lu free clusters, %lu problem(s)%s\n",
+            entries - 1, free_clusters, problems,
+            problems == 0 ? "" : repair ? ", repaired" : "");
+    if (removed > 0) {
+        fprintf(out, "%lu director%s without clusters removed\n", removed, removed == 1 ? "y" : "ies");
+    }
+
+    fsck_free(&ck);
+    if (unsaved) {
+        report_error(fs, "fsck could not write all of its repairs.\n");
+        return -1;
+    }
+    return (int)(problems > 0x7FFFFFFF ? 0x7FFFFFFF : problems);
+}
+
+void fsck_cmd(fat32_fs *fs, char *arg) {
+    int flags = 0;
+    if (arg && strcmp(arg, "-r") == 0) {
+        flags |= FAT32_FSCK_REPAIR;
+    } else if (arg && strcmp(arg, "-v") == 0) {
+        flags |= FAT32_FSCK_VERBOSE;
+    } else if (arg) {
+        report_error(fs, "fsck only accepts -r or -v.\n");
+        return;
+    }
+    fat32_fsck(fs, flags, 0, stdout);
+}
+
+//defrag
+
+// defrag makes chains contiguous with the volume shut off, as fsck does.
+// the plan comes from the FAT: one walk of the tree records every chain,
+// then chains are moved a run at a time with large copies inside the
+// image. the FAT and the entries pointing at moved chains are rewritten
+// in batches (commits). clusters a chain has left are not reused before
+// the commit that stops the old chain from referring to them, so the
+// image is consistent after each commit.
+
+#define DEFRAG_NONE     0xFFFFFFFF      // parent of the root
+#define DEFRAG_PINNED   0xFFFFFFFF      // owner of clusters that never move
+#define DEFRAG_VACATED  0xFFFFFFFE      // owner of clusters left since the last commit
+
+// a file or directory with a chain
+typedef struct {
+    unsigned int parent;        // index of the containing directory, DEFRAG_NONE for the root
+    unsigned int slot;          // the entry: cluster of the parent's chain holding it
+    unsigned int index;         // and its slot there
+    unsigned int first;         // first cluster as found by the walk
+    unsigned int *chain;        // where each cluster of the chain is now
+    unsigned int length;
+    unsigned int child_lo;      // directories: the objects of their entries
+    unsigned int child_hi;
+    unsigned char name[11];
+    unsigned char attr;
+    int moved;                  // chain changed since the last commit
+} DEFRAG_OBJ;
+
+// directory slot to point at a cluster
+typedef struct {
+    unsigned int cluster;
+    unsigned int index;
+    unsigned int value;
+} DEFRAG_FIX;
+
+typedef struct {
+    fat32_fs *fs;
+    int dry;                    // plan only: nothing is copied or written
+    DEFRAG_OBJ *objs;
+    unsigned int nobjs;
+    unsigned int objs_cap;
+    unsigned int *owner;        // per cluster: object index + 1, 0 when free
+    unsigned int *where;        // per cluster: position in the owner's chain
+    unsigned int *moved;        // objects moved since the last commit
+    unsigned int nmoved;
+    unsigned int *vacated;      // clusters left since the last commit
+    unsigned long nvacated;
+    unsigned long vacated_cap;
+    DEFRAG_FIX *fixes;
+    unsigned int nfixes;
+    unsigned int fixes_cap;
+    unsigned char *buf;         // one cluster
+    unsigned int cursor;        // where the search for free space resumes
+    unsigned long clusters;     // clusters moved
+    unsigned long copies;
+    unsigned long commits;
+    int failed;
+    int unsaved;                // the FAT could not be written back
+} DEFRAG;
+
+static unsigned int defrag_fragments(const DEFRAG_OBJ *o) {
+    unsigned int n = o->length > 0;
+    for (unsigned int k = 1; k < o->length; k++) {
+        if (o->chain[k] != o->chain[k - 1] + 1) n++;
+    }
+    return n;
+}
+
+// clusters of o's chain from pos on that lie in a row, at most max
+static unsigned int defrag_run(const DEFRAG_OBJ *o, unsigned int pos, unsigned int max) {
+    unsigned int n = 1;
+    while (n < max && pos + n < o->length && o->chain[pos + n] == o->chain[pos] + n) n++;
+    return n;
+}
+
+// new object; returns its index or DEFRAG_NONE
+static unsigned int defrag_new_obj(DEFRAG *dg) {
+    if (dg->nobjs == dg->objs_cap) {
+        unsigned int cap = dg->objs_cap ? dg->objs_cap * 2 : 256;
+        DEFRAG_OBJ *p = realloc(dg->objs, cap * sizeof(DEFRAG_OBJ));
+        if (!p) return DEFRAG_NONE;
+        dg->objs = p;
+        dg->objs_cap = cap;
+    }
+    memset(&dg->objs[dg->nobjs], 0, sizeof(DEFRAG_OBJ));
+    return dg->nobjs++;
+}
+
+// records the chain of object i starting at first and claims its
+// clusters. returns -1 when the chain is not sound (leaves the volume,
+// crosses another chain or itself, or ends without an end-of-chain mark);
+// fsck deals with those.
+static int defrag_claim(DEFRAG *dg, unsigned int i, unsigned int first) {
+    fat32_fs *fs = dg->fs;
+    DEFRAG_OBJ *o = &dg->objs[i];
+    unsigned int cap = 0;
+    unsigned int c = first;
+
+    while (1) {
+        if (c < 2 || c > fs->max_cluster || dg->owner[c] != 0) return -1;
+        if (o->length == cap) {
+            cap = cap ? cap * 2 : 8;
+            unsigned int *p = realloc(o->chain, cap * sizeof(unsigned int));
+            if (!p) return -1;
+            o->chain = p;
+        }
+        dg->owner[c] = i + 1;
+        dg->where[c] = o->length;
+        o->chain[o->length++] = c;
+
+        unsigned int next = fs->fat_table[c] & 0x0FFFFFFF;
+        if (next >= 0x0FFFFFF8) return 0;
+        c = next;
+    }
+}
+
+// records the entries of directory d as objects and claims their chains
+static int defrag_scan(DEFRAG *dg, unsigned int d) {
+    fat32_fs *fs = dg->fs;
+    unsigned int size = cluster_size(fs);
+    unsigned int per_cluster = size / sizeof(DIR_ENTRY);
+
+    dg->objs[d].child_lo = dg->nobjs;
+    for (unsigned int k = 0; k < dg->objs[d].length; k++) {
+        if (image_read(fs, cluster_offset(fs, dg->objs[d].chain[k]), dg->buf, size) != 0) {
+            return -1;
+        }
+        for (unsigned int j = 0; j < per_cluster; j++) {
+            DIR_ENTRY *e = (DIR_ENTRY *)(dg->buf + j * sizeof(DIR_ENTRY));
+            if (e->DIR_Name[0] == 0x00) goto done;
+            if (!is_valid_entry(e)) continue;
+            if (e->DIR_Attr & 0x08) continue;       // volume label
+            if (e->DIR_Name[0] == '.') continue;    // "." and ".."
+
+            unsigned int first = ((unsigned int)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO;
+            if (first == 0) {
+                if (e->DIR_Attr & ATTR_DIRECTORY) return -1;
+                continue;                           // empty file
+            }
+            unsigned int i = defrag_new_obj(dg);
+            if (i == DEFRAG_NONE) return -1;
+            DEFRAG_OBJ *o = &dg->objs[i];
+            o->parent = d;
+            o->slot = k;
+            o->index = j;
+            o->first = first;
+            memcpy(o->name, e->DIR_Name, 11);
+            o->attr = e->DIR_Attr;
+            if (defrag_claim(dg, i, first) != 0) return -1;
+        }
+    }
+done:
+    dg->objs[d].child_hi = dg->nobjs;
+    return 0;
+}
+
+// full path of an object, directories with a trailing '/'
+static void defrag_path(DEFRAG *dg, unsigned int i, char *out, size_t len) {
+    DEFRAG_OBJ *o = &dg->objs[i];
+    if (o->parent == DEFRAG_NONE) {
+        snprintf(out, len, "/");
+        return;
+    }
+    defrag_path(dg, o->parent, out, len);
+
+    char name[12];
+    memcpy(name, o->name, 11);
+    name[11] = '\0';
+    for (int j = 10; j >= 0 && name[j] == ' '; j--) name[j] = '\0';
+
+    size_t used = strlen(out);
+    snprintf(out + used, len - used, "%s%s", name, (o->attr & ATTR_DIRECTORY) ? "/" : "");
+}
+
+static int defrag_fix(DEFRAG *dg, unsigned int cluster, unsigned int index, unsigned int value) {
+    if (dg->nfixes == dg->fixes_cap) {
+        unsigned int cap = dg->fixes_cap ? dg->fixes_cap * 2 : 256;
+        DEFRAG_FIX *p = realloc(dg->fixes, cap * sizeof(DEFRAG_FIX));
+        if (!p) return -1;
+        dg->fixes = p;
+        dg->fixes_cap = cap;
+    }
+    DEFRAG_FIX *f = &dg->fixes[dg->nfixes++];
+    f->cluster = cluster;
+    f->index = index;
+    f->value = value;
+    return 0;
+}
+
+static int defrag_fix_cmp(const void *a, const void *b) {
+    const DEFRAG_FIX *x = a, *y = b;
+    if (x->cluster != y->cluster) return x->cluster < y->cluster ? -1 : 1;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// points the entries of the objects moved since the last commit at their
+// first clusters, together with "." of moved directories and ".." of the
+// directories inside them. each directory cluster is read and written
+// once, however many of its entries change.
+static void defrag_write_entries(DEFRAG *dg) {
+    fat32_fs *fs = dg->fs;
+    unsigned int size = cluster_size(fs);
+
+    dg->nfixes = 0;
+    for (unsigned int m = 0; m < dg->nmoved; m++) {
+        unsigned int i = dg->moved[m];
+        DEFRAG_OBJ *o = &dg->objs[i];
+        // the root keeps its first cluster and has no entry
+        if (o->parent == DEFRAG_NONE) continue;
+
+        DEFRAG_OBJ *p = &dg->objs[o->parent];
+        int err = defrag_fix(dg, p->chain[o->slot], o->index, o->chain[0]);
+        if (o->attr & ATTR_DIRECTORY) {
+            err |= defrag_fix(dg, o->chain[0], 0, o->chain[0]);
+            for (unsigned int c = o->child_lo; c < o->child_hi; c++) {
+                DEFRAG_OBJ *child = &dg->objs[c];
+                if (child->attr & ATTR_DIRECTORY) {
+                    err |= defrag_fix(dg, child->chain[0], 1, o->chain[0]);
+                }
+            }
+        }
+        if (err) {
+            dg->failed = 1;
+            return;
+        }
+    }
+    qsort(dg->fixes, dg->nfixes, sizeof(DEFRAG_FIX), defrag_fix_cmp);
+
+    for (unsigned int f = 0; f < dg->nfixes;) {
+        unsigned int cluster = dg->fixes[f].cluster;
+        uint64_t off = cluster_offset(fs, cluster);
+        if (image_read(fs, off, dg->buf, size) != 0) {
+            dg->failed = 1;
+            return;
+        }
+        for (; f < dg->nfixes && dg->fixes[f].cluster == cluster; f++) {
+            DIR_ENTRY *e = (DIR_ENTRY *)(dg->buf + dg->fixes[f].index * sizeof(DIR_ENTRY));
+            e->DIR_FstClusHI = (unsigned short)(dg->fixes[f].value >> 16);
+            e->DIR_FstClusLO = (unsigned short)(dg->fixes[f].value & 0xFFFF);
+        }
+        if (image_write(fs, off, dg->buf, size) != 0) {
+            dg->failed = 1;
+            return;
+        }
+    }
+}
+
+// makes the moves since the last commit permanent: entries are pointed at
+// the new chains, the chains are linked in the FAT and the clusters they
+// left are freed, after which those may be reused
+static void defrag_commit(DEFRAG *dg) {
+    fat32_fs *fs = dg->fs;
+    if (dg->nmoved == 0 && dg->nvacated == 0) return;
+
+    if (!dg->dry) {
+        defrag_write_entries(dg);
+
+        pthread_rwlock_wrlock(&fs->fat_lock);
+        for (unsigned int m = 0; m < dg->nmoved; m++) {
+            DEFRAG_OBJ *o = &dg->objs[dg->moved[m]];
+            for (unsigned int k = 0; k < o->length; k++) {
+                write_cluster(fs, o->chain[k], k + 1 < o->length ? o->chain[k + 1] : FAT32_EOC);
+            }
+        }
+        for (unsigned long v = 0; v < dg->nvacated; v++) {
+            write_cluster(fs, dg->vacated[v], 0);
+        }
+        pthread_rwlock_unlock(&fs->fat_lock);
+        if (fat_flush(fs) != 0) dg->failed = dg->unsaved = 1;
+    }
+
+    for (unsigned int m = 0; m < dg->nmoved; m++) {
+        dg->objs[dg->moved[m]].moved = 0;
+    }
+    for (unsigned long v = 0; v < dg->nvacated; v++) {
+        dg->owner[dg->vacated[v]] = 0;
+    }
+    dg->nmoved = 0;
+    dg->nvacated = 0;
+    dg->commits++;
+}
+
+// moves n clusters of object i's chain from position pos on, which lie
+// in a row, to the free clusters from dest on
+static int defrag_move(DEFRAG *dg, unsigned int i, unsigned int pos, unsigned int n, unsigned int dest) {
+    fat32_fs *fs = dg->fs;
+    DEFRAG_OBJ *o = &dg->objs[i];
+    unsigned int from = o->chain[pos];
+
+    if (dg->nvacated + n > dg->vacated_cap) {
+        unsigned long cap = dg->vacated_cap ? dg->vacated_cap : 1024;
+        while (cap < dg->nvacated + n) cap *= 2;
+        unsigned int *p = realloc(dg->vacated, cap * sizeof(unsigned int));
+        if (!p) {
+            dg->failed = 1;
+            return -1;
+        }
+        dg->vacated = p;
+        dg->vacated_cap = cap;
+    }
+
+    if (!dg->dry) {
+        unsigned int size = cluster_size(fs);
+        unsigned int step = IO_MAX_CHUNK / size ? IO_MAX_CHUNK / size : 1;
+        for (unsigned int k = 0; k < n; k += step) {
+            unsigned int m = n - k < step ? n - k : step;
+            if (image_copy(fs, cluster_offset(fs, from + k), cluster_offset(fs, dest + k),
+                           m * size) != 0) {
+                dg->failed = 1;
+                return -1;
+            }
+        }
+    }
+
+    for (unsigned int k = 0; k < n; k++) {
+        dg->owner[from + k] = DEFRAG_VACATED;
+        dg->vacated[dg->nvacated++] = from + k;
+        dg->owner[dest + k] = i + 1;
+        dg->where[dest + k] = pos + k;
+        o->chain[pos + k] = dest + k;
+    }
+    if (!o->moved) {
+        o->moved = 1;
+        dg->moved[dg->nmoved++] = i;
+    }
+    dg->clusters += n;
+    dg->copies++;
+    return 0;
+}
+
+// first run of free clusters outside [lo, hi) between from and the end of
+// the volume. with `whole` only a run of want clusters will do, otherwise
+// the first run found is taken, cut to want. returns its length or 0.
+static unsigned int defrag_find_from(DEFRAG *dg, unsigned int from, unsigned int want, int whole,
+                                     unsigned int lo, unsigned int hi, unsigned int *start) {
+    unsigned int run = 0;
+    for (unsigned int c = from; c <= dg->fs->max_cluster; c++) {
+        if (dg->owner[c] == 0 && (c < lo || c >= hi)) {
+            if (run++ == 0) *start = c;
+            if (run == want) return run;
+        } else if (run > 0) {
+            if (!whole) return run;
+            run = 0;
+        }
+    }
+    return whole ? 0 : run;
+}
+
+// like defrag_find_from, going on from the cursor and wrapping around once
+static unsigned int defrag_find(DEFRAG *dg, unsigned int want, int whole,
+                                unsigned int lo, unsigned int hi, unsigned int *start) {
+    unsigned int n = defrag_find_from(dg, dg->cursor, want, whole, lo, hi, start);
+    if (n == 0 && dg->cursor > 2) n = defrag_find_from(dg, 2, want, whole, lo, hi, start);
+    if (n > 0) dg->cursor = *start + n <= dg->fs->max_cluster ? *start + n : 2;
+    return n;
+}
+
+// moves every fragmented chain into a free run that holds it whole. a
+// chain that fits nowhere is left as it is.
+static void defrag_gather(DEFRAG *dg) {
+    // chains at least this long found no room since the last commit
+    unsigned int miss = 0;
+
+    // the root keeps its place
+    for (unsigned int i = 1; i < dg->nobjs && !dg->failed; i++) {
+        DEFRAG_OBJ *o = &dg->objs[i];
+        if (defrag_fragments(o) < 2 || (miss && o->length >= miss)) continue;
+
+        unsigned int start;
+        if (defrag_find(dg, o->length, 1, 0, 0, &start) == 0) {
+            if (dg->nvacated == 0) {
+                miss = o->length;
+                continue;
+            }
+            // what earlier moves left behind may hold it
+            defrag_commit(dg);
+            miss = 0;
+            if (defrag_find(dg, o->length, 1, 0, 0, &start) == 0) {
+                miss = o->length;
+                continue;
+            }
+        }
+        for (unsigned int k = 0; k < o->length && !dg->failed;) {
+            unsigned int n = defrag_run(o, k, o->length);
+            if (defrag_move(dg, i, k, n, start + k) != 0) break;
+            k += n;
+        }
+    }
+}
+
+// puts object i's chain at the first clusters from *next on that hold it
+// whole, moving whatever is in the way out first, and advances *next past
+// it. returns -1 when there is no room left to make way.
+static int defrag_place(DEFRAG *dg, unsigned int i, unsigned int *next) {
+    fat32_fs *fs = dg->fs;
+    DEFRAG_OBJ *o = &dg->objs[i];
+    unsigned int p = *next;
+
+    // clusters that never move split the volume
+    for (unsigned int c = p; c < p + o->length; c++) {
+        if (c > fs->max_cluster) return -1;
+        if (dg->owner[c] == DEFRAG_PINNED) p = c + 1;
+    }
+    unsigned int end = p + o->length;
+
+    for (unsigned int c = p; c < end && !dg->failed;) {
+        unsigned int w = dg->owner[c];
+        if (w == 0 || (w == i + 1 && dg->where[c] == c - p)) {
+            c++;
+            continue;
+        }
+        if (w == DEFRAG_VACATED) {
+            defrag_commit(dg);
+            continue;
+        }
+        // out of the way, past the range, to be placed properly in its turn
+        DEFRAG_OBJ *other = &dg->objs[w - 1];
+        unsigned int pos = dg->where[c];
+        unsigned int n = defrag_run(other, pos, end - c);
+        unsigned int start;
+        if (dg->cursor < end) dg->cursor = end;
+        n = defrag_find(dg, n, 0, p, end, &start);
+        if (n == 0) {
+            if (dg->nvacated == 0) return -1;
+            defrag_commit(dg);
+            continue;
+        }
+        if (defrag_move(dg, w - 1, pos, n, start) != 0) return -1;
+        c += n;
+    }
+
+    // what was moved out of the range must be let go before it is reused
+    for (unsigned int c = p; c < end; c++) {
+        if (dg->owner[c] == DEFRAG_VACATED) {
+            defrag_commit(dg);
+            break;
+        }
+    }
+    for (unsigned int k = 0; k < o->length && !dg->failed;) {
+        if (o->chain[k] == p + k) {
+            k++;
+            continue;
+        }
+        unsigned int n = defrag_run(o, k, o->length);
+        if (defrag_move(dg, i, k, n, p + k) != 0) return -1;
+        k += n;
+    }
+    *next = end;
+    return dg->failed ? -1 : 0;
+}
+
+// packs the chains toward the start of the volume in the order of the
+// walk, each directory followed by its files, so the free space ends up
+// in one run at the end
+static void defrag_compact(DEFRAG *dg) {
+    unsigned int next = 2;
+
+    // a root that does not start the data area stays where it is
+    DEFRAG_OBJ *root = &dg->objs[0];
+    int root_fixed = root->chain[0] != 2;
+    for (unsigned int k = 0; root_fixed && k < root->length; k++) {
+        dg->owner[root->chain[k]] = DEFRAG_PINNED;
+    }
+
+    for (unsigned int d = 0; d < dg->nobjs; d++) {
+        DEFRAG_OBJ *dir = &dg->objs[d];
+        if (!(dir->attr & ATTR_DIRECTORY)) continue;
+        if ((d > 0 || !root_fixed) && defrag_place(dg, d, &next) != 0) return;
+        for (unsigned int c = dir->child_lo; c < dir->child_hi; c++) {
+            if (dg->objs[c].attr & ATTR_DIRECTORY) continue;
+            if (defrag_place(dg, c, &next) != 0) return;
+        }
+    }
+    // new allocations go after the packed chains
+    if (!dg->dry) {
+        pthread_rwlock_wrlock(&dg->fs->fat_lock);
+        dg->fs->next_free = next <= dg->fs->max_cluster ? next : 2;
+        pthread_rwlock_unlock(&dg->fs->fat_lock);
+    }
+}
+
+static void defrag_free(DEFRAG *dg) {
+    for (unsigned int i = 0; i < dg->nobjs; i++) free(dg->objs[i].chain);
+    free(dg->objs);
+    free(dg->owner);
+    free(dg->where);
+    free(dg->moved);
+    free(dg->vacated);
+    free(dg->fixes);
+    free(dg->buf);
+}
+
+// makes the chain of every file and directory contiguous where free space
+// allows; with FAT32_DEFRAG_COMPACT everything is packed toward the start
+// of the volume instead. FAT32_DEFRAG_DRY_RUN lists the fragmented files
+// and works out the moves without making them. the image must not change
+// meanwhile and no file may be open. returns the number of files and
+// directories left fragmented, or -1 when defrag could not run.
+int fat32_defrag(fat32_fs *fs, int flags, FILE *out) {
+    DEFRAG dg;
+    memset(&dg, 0, sizeof(dg));
+    dg.fs = fs;
+    dg.dry = (flags & FAT32_DEFRAG_DRY_RUN) != 0;
+    dg.cursor = 2;
+    dg.owner = calloc((size_t)fs->max_cluster + 1, sizeof(unsigned int));
+    dg.where = malloc(((size_t)fs->max_cluster + 1) * sizeof(unsigned int));
+    dg.buf = malloc(cluster_size(fs));
+    if (!dg.owner || !dg.where || !dg.buf) {
+        defrag_free(&dg);
+        report_error(fs, "could not allocate memory for defrag.\n");
+        return -1;
+    }
+
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    pthread_rwlock_wrlock(&fs->open_lock);
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++) {
+        pthread_rwlock_wrlock(&fs->dir_locks[i]);
+    }
+    const char *err = NULL;
+    if (!dg.dry && fs->open_ninodes > 0) {
+        err = "defrag needs every file closed.\n";
+        goto unlock;
+    }
+    if (cache_flush(fs) != 0 || fat_flush(fs) != 0) {
+        err = "cached clusters or the FAT could not be written.\n";
+        goto unlock;
+    }
+
+    // the root has no entry; it is object 0
+    pthread_rwlock_rdlock(&fs->fat_lock);
+    defrag_new_obj(&dg);
+    dg.objs[0].parent = DEFRAG_NONE;
+    dg.objs[0].attr = ATTR_DIRECTORY;
+    dg.objs[0].first = fs->bpb.BPB_RootClus;
+    int bad = defrag_claim(&dg, 0, dg.objs[0].first);
+    for (unsigned int d = 0; !bad && d < dg.nobjs; d++) {
+        if (dg.objs[d].attr & ATTR_DIRECTORY) bad = defrag_scan(&dg, d);
+    }
+    // allocated clusters nobody owns (lost or bad) stay put
+    for (unsigned int c = 2; !bad && c <= fs->max_cluster; c++) {
+        if (dg.owner[c] == 0 && (fs->fat_table[c] & 0x0FFFFFFF) != 0) dg.owner[c] = DEFRAG_PINNED;
+    }
+    pthread_rwlock_unlock(&fs->fat_lock);
+    if (bad) {
+        err = "defrag found damaged chains or ran out of memory; run fsck -r first.\n";
+        goto unlock;
+    }
+
+    unsigned int before = 0;
+    unsigned long fragments = 0;
+    for (unsigned int i = 0; i < dg.nobjs; i++) {
+        unsigned int n = defrag_fragments(&dg.objs[i]);
+        if (n < 2) continue;
+        before++;
+        fragments += n;
+        if (dg.dry) {
+            char path[1024];
+            defrag_path(&dg, i, path, sizeof(path));
+            fprintf(out, "%s: %u clusters in %u fragments\n", path, dg.objs[i].length, n);
+        }
+    }
+
+    dg.moved = malloc(dg.nobjs * sizeof(unsigned int));
+    if (!dg.moved) {
+        err = "could not allocate memory for defrag.\n";
+        goto unlock;
+    }
+    // cached clusters are about to move under the cache
+    if (!dg.dry) cache_sync_range(fs, 0, fs->max_cluster + 1, 1);
+
+    if (flags & FAT32_DEFRAG_COMPACT) defrag_compact(&dg);
+    else defrag_gather(&dg);
+    defrag_commit(&dg);
+
+    unsigned int after = 0;
+    for (unsigned int i = 0; i < dg.nobjs; i++) {
+        after += defrag_fragments(&dg.objs[i]) > 1;
+    }
+    if (!dg.dry) {
+        // the shell may be sitting in a directory that moved
+        for (unsigned int i = 0; i < dg.nobjs; i++) {
+            if ((dg.objs[i].attr & ATTR_DIRECTORY) && fs->current_cluster == dg.objs[i].first) {
+                fs->current_cluster = dg.objs[i].chain[0];
+                break;
+            }
+        }
+        // names are indexed and paths cached by first cluster and position
+        pthread_mutex_lock(&fs->dir_index_lock);
+        dir_index_drop_all(fs);
+        pthread_mutex_unlock(&fs->dir_index_lock);
+        dentry_drop(fs, "/");
+        if (fat32_sync(fs) != 0) dg.unsaved = 1;
+    }
+    if (dg.failed) err = "defrag could not move everything; the image is consistent.\n";
+    if (dg.unsaved) err = "defrag could not write the FAT back; run fsck.\n";
+
+    fprintf(out, "%u chains, %u fragmented in %lu fragments\n", dg.nobjs, before, fragments);
+    if (dg.dry) {
+        fprintf(out, "would move %lu clusters in %lu copies, leaving %u fragmented\n",
+                dg.clusters, dg.copies, after);
+    } else {
+        fprintf(out, "moved %lu clusters in %lu copies and %lu commits in %.3f s, %u left fragmented\n",
+                dg.clusters, dg.copies, dg.commits, seconds_since(&t0), after);
+    }
+
+unlock:
+    for (int i = DIR_LOCK_STRIPES - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&fs->dir_locks[i]);
+    }
+    pthread_rwlock_unlock(&fs->open_lock);
+    defrag_free(&dg);
+    if (err) {
+        report_error(fs, "%s", err);
+        return -1;
+    }
+    return (int)after;
+}
+
+void defrag_cmd(fat32_fs *fs, char *arg1, char *arg2) {
+    char *args[2] = { arg1, arg2 };
+    int flags = 0;
+    for (int i = 0; i < 2; i++) {
+        if (!args[i]) continue;
+        if (strcmp(args[i], "-n") == 0) {
+            flags |= FAT32_DEFRAG_DRY_RUN;
+        } else if (strcmp(args[i], "-c") == 0) {
+            flags |= FAT32_DEFRAG_COMPACT;
+        } else {
+            report_error(fs, "defrag only accepts -n and -c.\n");
+            return;
+        }
+    }
+    fat32_defrag(fs, flags, stdout);
+}
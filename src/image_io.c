@@ -0,0 +1,132 @@
+#define _POSIX_C_SOURCE 200809L
+// SEEK_DATA, SEEK_HOLE and copy_file_range()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "image_io.h"
+
+// system calls made on the image, for all mounts together
+static unsigned long io_calls;
+
+int io_pread(int fd, void *buf, size_t len, uint64_t offset) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+        __atomic_add_fetch(&io_calls, 1, __ATOMIC_RELAXED);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+int io_pwrite(int fd, const void *buf, size_t len, uint64_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+        __atomic_add_fetch(&io_calls, 1, __ATOMIC_RELAXED);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+long io_sendfile(int out_fd, int in_fd, size_t len, uint64_t offset) {
+    off_t off = (off_t)offset;
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = sendfile(out_fd, in_fd, &off, len - sent);
+        __atomic_add_fetch(&io_calls, 1, __ATOMIC_RELAXED);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        sent += (size_t)n;
+    }
+    return (sent == 0 && len > 0) ? -1 : (long)sent;
+}
+
+int io_copy_range(int fd, uint64_t from, uint64_t to, size_t len) {
+    loff_t in = (loff_t)from;
+    loff_t out = (loff_t)to;
+    while (len > 0) {
+        ssize_t n = copy_file_range(fd, &in, fd, &out, len, 0);
+        __atomic_add_fetch(&io_calls, 1, __ATOMIC_RELAXED);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len -= (size_t)n;
+    }
+    if (len == 0) return 0;
+
+    // kernels or filesystems without copy_file_range(): go through memory
+    size_t cap = len < (1u << 20) ? len : (1u << 20);
+    char *buf = malloc(cap);
+    if (!buf) return -1;
+    int err = 0;
+    while (!err && len > 0) {
+        size_t n = len < cap ? len : cap;
+        err = io_pread(fd, buf, n, (uint64_t)in) != 0 ||
+              io_pwrite(fd, buf, n, (uint64_t)out) != 0;
+        in += (loff_t)n;
+        out += (loff_t)n;
+        len -= n;
+    }
+    free(buf);
+    return err ? -1 : 0;
+}
+
+int io_size(int fd, uint64_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 0) return -1;
+    *size = (uint64_t)st.st_size;
+    return 0;
+}
+
+int io_copy_sparse(int in_fd, int out_fd) {
+    uint64_t size;
+    if (io_size(in_fd, &size) != 0 || ftruncate(out_fd, (off_t)size) != 0) return -1;
+
+    size_t cap = 1 << 20;
+    char *buf = malloc(cap);
+    if (!buf) return -1;
+
+    int err = 0;
+    off_t pos = 0;
+    while (!err && (uint64_t)pos < size) {
+        // filesystems without hole reporting see the whole file as data
+        off_t data = lseek(in_fd, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) break;
+        if (data < 0) data = pos;
+        off_t hole = lseek(in_fd, data, SEEK_HOLE);
+        if (hole < 0) hole = (off_t)size;
+
+        for (pos = data; !err && pos < hole;) {
+            size_t n = (uint64_t)(hole - pos) < cap ? (size_t)(hole - pos) : cap;
+            err = io_pread(in_fd, buf, n, (uint64_t)pos) != 0 ||
+                  io_pwrite(out_fd, buf, n, (uint64_t)pos) != 0;
+            pos += (off_t)n;
+        }
+    }
+    free(buf);
+    return err ? -1 : 0;
+}
+
+unsigned long io_syscalls(void) {
+    return __atomic_load_n(&io_calls, __ATOMIC_RELAXED);
+}
+
+int io_is_terminal(int fd) {
+    return isatty(fd);
+}
+
+unsigned int io_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned int)n : 1;
+}
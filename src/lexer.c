@@ -1,92 +1,99 @@
-#include "lexer.h"
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-/*
-int main()
-{
-	while (1) {
-		printf("> ");
-
-		// input contains the whole command
-		// tokens contains substrings from input split by spaces
-
-		char *input = get_input();
-		printf("whole input: %s\n", input);
-
-		tokenlist *tokens = get_tokens(input);
-		for (int i = 0; i < tokens->size; i++) {
-			printf("token %d: (%s)\n", i, tokens->items[i]);
-		}
-
-		free(input);
-		free_tokens(tokens);
-	}
-
-	return 0;
-}
-*/
-
-char *get_input(void) {
-	char *buffer = NULL;
-	int bufsize = 0;
-	char line[5];
-	while (fgets(line, 5, stdin) != NULL)
-	{
-		int addby = 0;
-		char *newln = strchr(line, '\n');
-		if (newln != NULL)
-			addby = newln - line;
-		else
-			addby = 5 - 1;
-		buffer = (char *)realloc(buffer, bufsize + addby);
-		memcpy(&buffer[bufsize], line, addby);
-		bufsize += addby;
-		if (newln != NULL)
-			break;
-	}
-	buffer = (char *)realloc(buffer, bufsize + 1);
-	buffer[bufsize] = 0;
-	return buffer;
-}
-
-tokenlist *new_tokenlist(void) {
-	tokenlist *tokens = (tokenlist *)malloc(sizeof(tokenlist));
-	tokens->size = 0;
-	tokens->items = (char **)malloc(sizeof(char *));
-	tokens->items[0] = NULL; /* make NULL terminated */
-	return tokens;
-}
-
-void add_token(tokenlist *tokens, char *item) {
-	int i = tokens->size;
-
-	tokens->items = (char **)realloc(tokens->items, (i + 2) * sizeof(char *));
-	tokens->items[i] = (char *)malloc(strlen(item) + 1);
-	tokens->items[i + 1] = NULL;
-	strcpy(tokens->items[i], item);
-
-	tokens->size += 1;
-}
-
-tokenlist *get_tokens(char *input) {
-	char *buf = (char *)malloc(strlen(input) + 1);
-	strcpy(buf, input);
-	tokenlist *tokens = new_tokenlist();
-	char *tok = strtok(buf, " ");
-	while (tok != NULL)
-	{
-		add_token(tokens, tok);
-		tok = strtok(NULL, " ");
-	}
-	free(buf);
-	return tokens;
-}
-
-void free_tokens(tokenlist *tokens) {
-	for (int i = 0; i < tokens->size; i++)
-		free(tokens->items[i]);
-	free(tokens->items);
-	free(tokens);
-}
+#define _POSIX_C_SOURCE 200809L
+
+#include "lexer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+int main()
+{
+	while (1) {
+		printf("> ");
+
+		// input contains the whole command
+		// tokens contains substrings from input split by spaces
+
+		char *input = get_input();
+		printf("whole input: %s\n", input);
+
+		tokenlist *tokens = get_tokens(input);
+		for (int i = 0; i < tokens->size; i++) {
+			printf("token %d: (%s)\n", i, tokens->items[i]);
+		}
+
+		free(input);
+		free_tokens(tokens);
+	}
+
+	return 0;
+}
+*/
+
+char *get_input(void) {
+	char *buffer = NULL;
+	size_t cap = 0;
+	if (read_line(stdin, &buffer, &cap) < 0) {
+		free(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+/* reads one line into *buffer (grown as needed and reused across calls),
+   without the trailing newline. returns its length, or -1 at end of input. */
+long read_line(FILE *in, char **buffer, size_t *cap) {
+	ssize_t len = getline(buffer, cap, in);
+	if (len < 0)
+		return -1;
+	if (len > 0 && (*buffer)[len - 1] == '\n')
+		(*buffer)[--len] = 0;
+	if (len > 0 && (*buffer)[len - 1] == '\r')
+		(*buffer)[--len] = 0;
+	return (long)len;
+}
+
+bool is_interactive(FILE *in) {
+	return isatty(fileno(in)) != 0;
+}
+
+tokenlist *new_tokenlist(void) {
+	tokenlist *tokens = (tokenlist *)malloc(sizeof(tokenlist));
+	tokens->size = 0;
+	tokens->items = (char **)malloc(sizeof(char *));
+	tokens->items[0] = NULL; /* make NULL terminated */
+	return tokens;
+}
+
+void add_token(tokenlist *tokens, char *item) {
+	int i = tokens->size;
+
+	tokens->items = (char **)realloc(tokens->items, (i + 2) * sizeof(char *));
+	tokens->items[i] = (char *)malloc(strlen(item) + 1);
+	tokens->items[i + 1] = NULL;
+	strcpy(tokens->items[i], item);
+
+	tokens->size += 1;
+}
+
+tokenlist *get_tokens(char *input) {
+	char *buf = (char *)malloc(strlen(input) + 1);
+	strcpy(buf, input);
+	tokenlist *tokens = new_tokenlist();
+	char *tok = strtok(buf, " ");
+	while (tok != NULL)
+	{
+		add_token(tokens, tok);
+		tok = strtok(NULL, " ");
+	}
+	free(buf);
+	return tokens;
+}
+
+void free_tokens(tokenlist *tokens) {
+	for (int i = 0; i < tokens->size; i++)
+		free(tokens->items[i]);
+	free(tokens->items);
+	free(tokens);
+}
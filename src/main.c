@@ -1,158 +1,130 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-#include "lexer.h"
-#include "fat32.h"
-
-int main(int argc, char *argv[]) {
-
-    // print an error message if user does not mount image file
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <fat32 image>\n", argv[0]);
-        return 1;
-    }
-
-    // open the FAT32 image
-    if (fat32_mount(argv[1]) != 0) {
-        fprintf(stderr, "Error: failed to open FAT32 image.\n");
-        return 1;
-    }
-
-    while (1) {
-        // print initial prompt
-        printf("%s%s> ", get_image_name(), get_current_path());
-
-        // get user input
-        char *input = get_input();
-        if (input == NULL) {
-            printf("\n");
-            break;
-        }
-
-        tokenlist *tokens = get_tokens(input);
-
-        if (tokens->size == 0) {
-            free(input);
-            free_tokens(tokens);
-            continue;
-        }
-
-        char *cmd  = tokens->items[0];
-        char *arg1 = (tokens->size > 1) ? tokens->items[1] : NULL;
-        char *arg2 = (tokens->size > 2) ? tokens->items[2] : NULL;
-
-        if (strcmp(cmd, "exit") == 0) {
-            free(input);
-            free_tokens(tokens);
-            break;
-        }
-
-        else if (strcmp(cmd, "info") == 0) {
-            info();
-        }
-
-        else if (strcmp(cmd, "ls") == 0) {
-            ls();
-        }
-
-        else if (strcmp(cmd, "cd") == 0) {
-            cd(arg1);
-        }
-
-        else if (strcmp(cmd, "creat") == 0) {
-            creat(arg1);
-        }
-
-        else if (strcmp(cmd, "mkdir") == 0) {
-            mkdir(arg1);
-        }
-
-        else if (strcmp(cmd, "open") == 0) {
-            open(arg1, arg2);
-        }
-
-        else if (strcmp(cmd, "close") == 0) {
-            close(arg1);
-        }
-
-        else if (strcmp(cmd, "lsof") == 0) {
-            lsof();
-        }
-
-        else if (strcmp(cmd, "lseek") == 0) {
-            if (!arg1 || !arg2) {
-                printf("Error: lseek requires [FILENAME] [OFFSET].\n");
-            } else {
-                unsigned int off = (unsigned int)strtoul(arg2, NULL, 10);
-                lseek(arg1, off);
-            }
-        }
-
-        else if (strcmp(cmd, "read") == 0) {
-            read(arg1, arg2);
-        }
-
-        else if (strcmp(cmd, "write") == 0) {
-            if (!arg1) {
-                printf("Error: write requires [FILENAME] [STRING].\n");
-            } else {
-                char *first_quote = strchr(input, '\"');
-                char *last_quote  = NULL;
-                if (first_quote != NULL) {
-                    last_quote = strrchr(first_quote + 1, '\"');
-                }
-
-                if (!first_quote || !last_quote ||
-                    last_quote <= first_quote + 1) {
-                    printf("Error: STRING must be enclosed in quotes.\n");
-                } else {
-                    size_t len = (size_t)(last_quote - first_quote - 1);
-                    char *str = (char *)malloc(len + 1);
-                    if (!str) {
-                        printf("Error: memory allocation failed.\n");
-                    } else {
-                        memcpy(str, first_quote + 1, len);
-                        str[len] = '\0';
-                        write_cmd(arg1, str);
-                        free(str);
-                    }
-                }
-            }
-        }
-
-        else if (strcmp(cmd, "mv") == 0) {
-            if (!arg1 || !arg2) {
-                printf("Error: mv requires [SRC] [DST].\n");
-            } else {
-                mv_cmd(arg1, arg2);
-            }
-        }
-
-        else if (strcmp(cmd, "rm") == 0) {
-            if (!arg1) {
-                printf("Error: rm requires [FILENAME].\n");
-            } else {
-                rm_cmd(arg1);
-            }
-        }
-
-        else if (strcmp(cmd, "rmdir") == 0) {
-            if (!arg1) {
-                printf("Error: rmdir requires [DIRNAME].\n");
-            } else {
-                rmdir_cmd(arg1);
-            }
-        }
-
-        else {
-            printf("Error: not a valid command\n");
-        }
-
-        free(input);
-        free_tokens(tokens);
-    }
-
-    fat32_unmount();
-    return 0;
-}
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lexer.h"
+#include "fat32.h"
+#include "shell.h"
+
+// stdio buffer size for script input and output in batch mode
+#define BATCH_BUFFER_SIZE (1 << 20)
+
+int main(int argc, char *argv[]) {
+
+    const char *image = NULL;
+    const char *script = NULL;
+    const char *stats_file = NULL;
+    const char *trace_file = NULL;
+    unsigned int cache_slots = 0;
+    int mount_flags = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            // number of cluster cache slots
+            cache_slots = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            // map the whole image instead of going through stdio
+            mount_flags |= FAT32_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            // write the I/O and latency statistics here on exit
+            stats_file = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            // record commands and image accesses for bin/replay
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            // run commands from a script ("-" for stdin) without prompts
+            script = argv[++i];
+        } else if (!image) {
+            image = argv[i];
+        } else {
+            image = NULL;
+            break;
+        }
+    }
+
+    // print an error message if user does not mount image file
+    if (!image) {
+        fprintf(stderr, "Usage: %s [-m] [-c cache_slots] [-b script] [-s stats_file] "
+                        "[-t trace_file] <fat32 image>\n", argv[0]);
+        return 1;
+    }
+
+    // open the FAT32 image
+    fat32_fs *fs = fat32_mount(image, mount_flags);
+    if (!fs) {
+        fprintf(stderr, "Error: failed to open FAT32 image.\n");
+        return 1;
+    }
+    if (cache_slots) {
+        cache_set_capacity(fs, cache_slots);
+    }
+    if (trace_file && fat32_trace_start(fs, trace_file) != 0) {
+        fprintf(stderr, "Error: cannot write trace %s.\n", trace_file);
+        fat32_unmount(fs);
+        return 1;
+    }
+
+    // batch mode: commands come from a script or a pipe, so prompts are
+    // suppressed, input and output are fully buffered and errors carry the
+    // script line number
+    FILE *in = stdin;
+    int batch = 0;
+    if (script) {
+        batch = 1;
+        if (strcmp(script, "-") != 0 && (in = fopen(script, "r")) == NULL) {
+            fprintf(stderr, "Error: cannot open script %s.\n", script);
+            fat32_unmount(fs);
+            return 1;
+        }
+    } else if (!is_interactive(stdin)) {
+        batch = 1;
+    }
+    if (batch) {
+        setvbuf(in, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+        setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+    }
+
+    char *input = NULL;
+    size_t input_cap = 0;
+    unsigned long line_no = 0;
+
+    while (1) {
+        // print initial prompt
+        if (!batch) {
+            printf("%s%s> ", get_image_name(fs), get_current_path(fs));
+        }
+
+        // get user input
+        if (read_line(in, &input, &input_cap) < 0) {
+            if (!batch) printf("\n");
+            break;
+        }
+        line_no++;
+        if (batch) set_error_line(fs, line_no);
+
+        if (shell_execute(fs, input)) {
+            break;
+        }
+    }
+
+    free(input);
+    if (in != stdin) fclose(in);
+    set_error_line(fs, 0);
+
+    if (stats_file) {
+        FILE *out = fopen(stats_file, "w");
+        if (out) {
+            shell_stats_dump(fs, out);
+            fclose(out);
+        } else {
+            fprintf(stderr, "Error: cannot write statistics to %s.\n", stats_file);
+        }
+    }
+    if (fat32_unmount(fs) != 0) {
+        fprintf(stderr, "Error: could not write everything back to the image.\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,342 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lexer.h"
+#include "fat32.h"
+#include "shell.h"
+
+// one entry per command of shell_execute(); the index is the command's
+// slot in the mount's latency table (at most FAT32_CMD_SLOTS)
+static const char *const cmd_names[] = {
+    "sync", "info", "ls", "cd", "creat", "mkdir",
+    "open", "close", "lsof", "lseek", "read", "write",
+    "fallocate", "mv", "rm", "rmdir", "fsck", "tree",
+    "find", "du", "put", "get",
+    "import", "defrag", "compact", "stats",
+};
+
+#define NUM_CMDS (sizeof(cmd_names) / sizeof(cmd_names[0]))
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// slot of a command in the latency table, -1 for lines that are not one
+static int cmd_slot(const char *name) {
+    for (size_t i = 0; i < NUM_CMDS; i++) {
+        if (strcmp(cmd_names[i], name) == 0) return (int)i;
+    }
+    return -1;
+}
+
+// p-th percentile in microseconds: the upper bound of the bucket holding
+// it, clamped to the slowest command seen so it never exceeds max
+static double cmd_stats_percentile(const FAT32_CMD_STATS *cs, double p) {
+    unsigned long want = (unsigned long)(cs->calls * p / 100.0 + 0.5);
+    unsigned long seen = 0;
+    int b = 0;
+    if (want == 0) want = 1;
+    for (; b < FAT32_LAT_BUCKETS - 1; b++) {
+        seen += cs->hist[b];
+        if (seen >= want) break;
+    }
+    double bound = (double)(1ul << b);
+    return bound < cs->max * 1e6 ? bound : cs->max * 1e6;
+}
+
+void shell_stats_reset(fat32_fs *fs) {
+    fat32_reset_stats(fs);
+}
+
+// image bytes written per byte of file data written, 0 before any write
+static double write_amplification(const FAT32_STATS *st) {
+    return st->file_bytes ? (double)st->bytes_written / st->file_bytes : 0;
+}
+
+void shell_stats_print(fat32_fs *fs, FILE *out) {
+    FAT32_STATS st;
+    fat32_get_stats(fs, &st);
+
+    fprintf(out, "image reads: %lu (%lu bytes), writes: %lu (%lu bytes)\n",
+            st.reads, st.bytes_read, st.writes, st.bytes_written);
+    fprintf(out, "FAT lookups: %lu, cluster reads: %lu, cluster allocations: %lu\n",
+            st.fat_lookups, st.cluster_reads, st.cluster_allocs);
+    fprintf(out, "cache: %lu hits, %lu misses, %lu bytes not written back\n",
+            st.cache_hits, st.cache_misses, st.dirty_bytes);
+    fprintf(out, "file data written: %lu bytes, write amplification: %.2f\n",
+            st.file_bytes, write_amplification(&st));
+
+    fprintf(out, "%-10s %8s %10s %10s %10s %10s\n",
+            "command", "calls", "mean us", "p50 us", "p99 us", "max us");
+    for (size_t i = 0; i < NUM_CMDS; i++) {
+        FAT32_CMD_STATS cs;
+        fat32_get_command_stats(fs, (unsigned int)i, &cs);
+        if (cs.calls == 0) continue;
+        fprintf(out, "%-10s %8lu %10.1f %10.1f %10.1f %10.1f\n", cmd_names[i], cs.calls,
+                cs.total / cs.calls * 1e6, cmd_stats_percentile(&cs, 50),
+                cmd_stats_percentile(&cs, 99), cs.max * 1e6);
+    }
+}
+
+// the same figures as JSON, for scripts; percentiles are bucket bounds
+// clamped to max
+void shell_stats_dump(fat32_fs *fs, FILE *out) {
+    FAT32_STATS st;
+    fat32_get_stats(fs, &st);
+
+    fprintf(out, "{\n  \"io\": {\"reads\": %lu, \"bytes_read\": %lu, \"writes\": %lu, "
+                 "\"bytes_written\": %lu, \"fat_lookups\": %lu, \"cluster_reads\": %lu, "
+                 "\"cluster_allocs\": %lu, \"cache_hits\": %lu, \"cache_misses\": %lu, "
+                 "\"dirty_bytes\": %lu, \"file_bytes\": %lu, \"write_amplification\": %.3f},\n",
+            st.reads, st.bytes_read, st.writes, st.bytes_written, st.fat_lookups,
+            st.cluster_reads, st.cluster_allocs, st.cache_hits, st.cache_misses,
+            st.dirty_bytes, st.file_bytes, write_amplification(&st));
+
+    fprintf(out, "  \"commands\": {");
+    int first = 1;
+    for (size_t i = 0; i < NUM_CMDS; i++) {
+        FAT32_CMD_STATS cs;
+        fat32_get_command_stats(fs, (unsigned int)i, &cs);
+        if (cs.calls == 0) continue;
+        fprintf(out, "%s\n    \"%s\": {\"calls\": %lu, \"mean_us\": %.2f, \"p50_us\": %.2f, "
+                     "\"p99_us\": %.2f, \"max_us\": %.2f, \"histogram\": [",
+                first ? "" : ",", cmd_names[i], cs.calls, cs.total / cs.calls * 1e6,
+                cmd_stats_percentile(&cs, 50), cmd_stats_percentile(&cs, 99), cs.max * 1e6);
+        // trailing empty buckets are left out
+        int last = FAT32_LAT_BUCKETS - 1;
+        while (last > 0 && cs.hist[last] == 0) last--;
+        for (int b = 0; b <= last; b++) {
+            fprintf(out, "%s%lu", b ? ", " : "", cs.hist[b]);
+        }
+        fprintf(out, "]}");
+        first = 0;
+    }
+    fprintf(out, "%s}\n}\n", first ? "" : "\n  ");
+}
+
+int shell_execute(fat32_fs *fs, char *line) {
+    tokenlist *tokens = get_tokens(line);
+
+    if (tokens->size == 0) {
+        free_tokens(tokens);
+        return 0;
+    }
+
+    char *cmd  = tokens->items[0];
+    char *arg1 = (tokens->size > 1) ? tokens->items[1] : NULL;
+    char *arg2 = (tokens->size > 2) ? tokens->items[2] : NULL;
+
+    if (strcmp(cmd, "exit") == 0) {
+        free_tokens(tokens);
+        return 1;
+    }
+
+    int slot = cmd_slot(cmd);
+    double start = now();
+    fat32_trace_command(fs, line);
+
+    if (strcmp(cmd, "stats") == 0) {
+        if (arg1 && strcmp(arg1, "reset") == 0) {
+            shell_stats_reset(fs);
+        } else if (arg1) {
+            report_error(fs, "stats takes no argument other than reset.\n");
+        } else {
+            shell_stats_print(fs, stdout);
+        }
+    }
+
+    else if (strcmp(cmd, "sync") == 0) {
+        if (fat32_sync(fs) != 0) {
+            report_error(fs, "could not write everything back to the image.\n");
+        }
+    }
+
+    else if (strcmp(cmd, "info") == 0) {
+        info_cmd(fs);
+    }
+
+    else if (strcmp(cmd, "ls") == 0) {
+        ls_cmd(fs, arg1);
+    }
+
+    else if (strcmp(cmd, "tree") == 0) {
+        tree_cmd(fs, arg1);
+    }
+
+    else if (strcmp(cmd, "find") == 0) {
+        if (!arg1) {
+            report_error(fs, "find requires [PATTERN] [DIRNAME].\n");
+        } else {
+            find_cmd(fs, arg1, arg2);
+        }
+    }
+
+    else if (strcmp(cmd, "du") == 0) {
+        du_cmd(fs, arg1);
+    }
+
+    else if (strcmp(cmd, "cd") == 0) {
+        cd_cmd(fs, arg1);
+    }
+
+    else if (strcmp(cmd, "creat") == 0) {
+        creat_cmd(fs, arg1);
+    }
+
+    else if (strcmp(cmd, "mkdir") == 0) {
+        mkdir_cmd(fs, arg1);
+    }
+
+    else if (strcmp(cmd, "open") == 0) {
+        open_cmd(fs, arg1, arg2);
+    }
+
+    else if (strcmp(cmd, "close") == 0) {
+        close_cmd(fs, arg1);
+    }
+
+    else if (strcmp(cmd, "lsof") == 0) {
+        lsof_cmd(fs);
+    }
+
+    else if (strcmp(cmd, "lseek") == 0) {
+        if (!arg1 || !arg2) {
+            report_error(fs, "lseek requires [FILENAME] [OFFSET].\n");
+        } else {
+            unsigned int off = (unsigned int)strtoul(arg2, NULL, 10);
+            lseek_cmd(fs, arg1, off);
+        }
+    }
+
+    else if (strcmp(cmd, "read") == 0) {
+        char *redir = (tokens->size > 3) ? tokens->items[3] : NULL;
+        char *host  = (tokens->size > 4) ? tokens->items[4] : NULL;
+
+        if (!arg1 || !arg2) {
+            report_error(fs, "read requires [FILENAME] [SIZE].\n");
+        } else if (redir && (strcmp(redir, ">") == 0 ||
+                             strcmp(redir, ">>") == 0)) {
+            // read FILE SIZE > hostfile
+            FILE *out = host ? fopen(host, redir[1] ? "ab" : "wb") : NULL;
+            if (!out) {
+                report_error(fs, "cannot open host file for writing.\n");
+            } else {
+                read_cmd(fs, arg1, (unsigned int)strtoul(arg2, NULL, 10), out);
+                fclose(out);
+            }
+        } else {
+            read_cmd(fs, arg1, (unsigned int)strtoul(arg2, NULL, 10), stdout);
+        }
+    }
+
+    else if (strcmp(cmd, "write") == 0) {
+        if (!arg1) {
+            report_error(fs, "write requires [FILENAME] [STRING].\n");
+        } else {
+            char *first_quote = strchr(line, '\"');
+            char *last_quote  = NULL;
+            if (first_quote != NULL) {
+                last_quote = strrchr(first_quote + 1, '\"');
+            }
+
+            if (!first_quote || !last_quote ||
+                last_quote <= first_quote + 1) {
+                report_error(fs, "STRING must be enclosed in quotes.\n");
+            } else {
+                size_t len = (size_t)(last_quote - first_quote - 1);
+                char *str = (char *)malloc(len + 1);
+                if (!str) {
+                    report_error(fs, "memory allocation failed.\n");
+                } else {
+                    memcpy(str, first_quote + 1, len);
+                    str[len] = '\0';
+                    write_cmd(fs, arg1, str);
+                    free(str);
+                }
+            }
+        }
+    }
+
+    else if (strcmp(cmd, "put") == 0) {
+        if (!arg1 || !arg2) {
+            report_error(fs, "put requires [HOSTFILE] [FILENAME].\n");
+        } else {
+            put_cmd(fs, arg1, arg2);
+        }
+    }
+
+    else if (strcmp(cmd, "get") == 0) {
+        if (!arg1 || !arg2) {
+            report_error(fs, "get requires [FILENAME] [HOSTFILE].\n");
+        } else {
+            get_cmd(fs, arg1, arg2);
+        }
+    }
+
+    else if (strcmp(cmd, "import") == 0) {
+        if (!arg1) {
+            report_error(fs, "import requires [HOSTDIR] [DIRNAME].\n");
+        } else {
+            import_cmd(fs, arg1, arg2);
+        }
+    }
+
+    else if (strcmp(cmd, "fallocate") == 0) {
+        if (!arg1 || !arg2) {
+            report_error(fs, "fallocate requires [FILENAME] [BYTES].\n");
+        } else {
+            fallocate_cmd(fs, arg1, (unsigned int)strtoul(arg2, NULL, 10));
+        }
+    }
+
+    else if (strcmp(cmd, "mv") == 0) {
+        if (!arg1 || !arg2) {
+            report_error(fs, "mv requires [SRC] [DST].\n");
+        } else {
+            mv_cmd(fs, arg1, arg2);
+        }
+    }
+
+    else if (strcmp(cmd, "rm") == 0) {
+        if (!arg1) {
+            report_error(fs, "rm requires [FILENAME].\n");
+        } else {
+            rm_cmd(fs, arg1);
+        }
+    }
+
+    else if (strcmp(cmd, "rmdir") == 0) {
+        if (!arg1) {
+            report_error(fs, "rmdir requires [DIRNAME].\n");
+        } else {
+            rmdir_cmd(fs, arg1);
+        }
+    }
+
+    else if (strcmp(cmd, "compact") == 0) {
+        compact_cmd(fs, arg1);
+    }
+
+    else if (strcmp(cmd, "fsck") == 0) {
+        fsck_cmd(fs, arg1);
+    }
+
+    else if (strcmp(cmd, "defrag") == 0) {
+        defrag_cmd(fs, arg1, arg2);
+    }
+
+    else {
+        report_error(fs, "not a valid command\n");
+    }
+
+    fat32_trace_command_end(fs);
+    if (slot >= 0) fat32_record_command(fs, (unsigned int)slot, now() - start);
+    free_tokens(tokens);
+    return 0;
+}
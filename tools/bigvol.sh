@@ -0,0 +1,83 @@
+#!/bin/sh
+# checks that offsets past 4 GB survive on the largest volume FAT32 allows.
+# a sparse 2 TB image is formatted, a file is written into the last
+# clusters of the volume and read back, the bytes are looked for at their
+# 64-bit offset in the image (and must not appear where a 32-bit
+# truncation would have put them), and fsck must find nothing wrong.
+#
+# usage: bigvol.sh [bin_dir] [image]
+set -e
+
+BIN=${1:-bin}
+IMG=${2:-$BIN/bigvol.img}
+WORK=$IMG.d
+CLUSTER_KB=64
+SIZE=200000                 # four clusters, the last one partial
+
+fail() {
+    echo "bigvol: $*" >&2
+    exit 1
+}
+
+# unsigned little-endian field of the image: u <offset> <bytes>
+u() {
+    od -An -tu$2 -j$1 -N$2 "$IMG" | tr -d ' '
+}
+
+# the image is removed however the check ends; a 2 TB file, even a
+# sparse one, is no thing to leave behind
+rm -rf "$IMG" "$WORK"
+trap 'rm -rf "$IMG" "$WORK"' EXIT
+mkdir -p "$WORK"
+truncate -s 2T "$IMG"
+
+# 2 TB is one sector more than a FAT32 volume can count, so the volume
+# stops a megabyte short of the end of the file
+"$BIN/fs_bench" gen -s 2097151 -k $CLUSTER_KB -f 0 -n 0 "$IMG" > /dev/null ||
+    fail "cannot format $IMG"
+truncate -s 2T "$IMG"
+
+spc=$(u 13 1)
+rsvd=$(u 14 2)
+nfats=$(u 16 1)
+total=$(u 32 4)
+fatsz=$(u 36 4)
+data=$((rsvd + nfats * fatsz))
+max_cluster=$(((total - data) / spc + 1))
+
+# point the FSInfo next-free hint at the last four clusters so the file
+# lands at the very end of the volume
+first=$((max_cluster - 3))
+printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $((first & 255)) $((first >> 8 & 255)) \
+    $((first >> 16 & 255)) $((first >> 24 & 255)))" |
+    dd of="$IMG" bs=1 seek=$((512 + 492)) conv=notrunc 2> /dev/null
+
+head -c $SIZE /dev/urandom > "$WORK/data"
+printf 'put %s BIG\n' "$WORK/data" > "$WORK/put.txt"
+printf 'get BIG %s\n' "$WORK/back" > "$WORK/get.txt"
+
+"$BIN/filesys" -b "$WORK/put.txt" "$IMG" > "$WORK/out.txt"
+! grep -q Error "$WORK/out.txt" || fail "$(cat "$WORK/out.txt")"
+
+for mode in "" -m; do
+    rm -f "$WORK/back"
+    "$BIN/filesys" $mode -b "$WORK/get.txt" "$IMG" > "$WORK/out.txt"
+    ! grep -q Error "$WORK/out.txt" || fail "$(cat "$WORK/out.txt")"
+    cmp -s "$WORK/data" "$WORK/back" || fail "data read back${mode:+ with $mode} differs"
+done
+
+# the file must sit where a 64-bit offset says, and nowhere near where the
+# offset cut to 32 bits would point
+sector=$((data + (first - 2) * spc))
+[ $((sector * 512)) -gt 4294967295 ] || fail "first cluster $first is below 4 GB"
+dd if="$IMG" bs=512 skip=$sector count=$(((SIZE + 511) / 512)) 2> /dev/null |
+    head -c $SIZE | cmp -s - "$WORK/data" || fail "data is not at byte $((sector * 512))"
+alias=$(((sector * 512) % 4294967296 / 512))
+if dd if="$IMG" bs=512 skip=$alias count=$(((SIZE + 511) / 512)) 2> /dev/null |
+    head -c $SIZE | cmp -s - "$WORK/data"; then
+    fail "data was written at byte $((alias * 512)), the offset truncated to 32 bits"
+fi
+
+"$BIN/fsck" "$IMG" > "$WORK/fsck.txt" || fail "fsck: $(cat "$WORK/fsck.txt")"
+
+echo "bigvol: 2 TB volume ok, clusters $first-$max_cluster at byte $((sector * 512))"
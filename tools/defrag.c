@@ -0,0 +1,54 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fat32.h"
+
+// defragments a FAT32 image without the shell: -n only lists the
+// fragmented files and plans the moves, -c also packs every chain at the
+// start of the volume. exit status: 0 when nothing is left fragmented, 1
+// when some chains could not be made contiguous, 2 when defrag could not
+// run.
+
+int main(int argc, char *argv[]) {
+    const char *image = NULL;
+    int mount_flags = 0;
+    int flags = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0) {
+            flags |= FAT32_DEFRAG_DRY_RUN;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            flags |= FAT32_DEFRAG_COMPACT;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            mount_flags |= FAT32_MOUNT_MMAP;
+        } else if (!image) {
+            image = argv[i];
+        } else {
+            image = NULL;
+            break;
+        }
+    }
+
+    if (!image) {
+        fprintf(stderr, "Usage: %s [-n] [-c] [-m] <fat32 image>\n", argv[0]);
+        return 2;
+    }
+
+    fat32_fs *fs = fat32_mount(image, mount_flags);
+    if (!fs) {
+        fprintf(stderr, "Error: failed to open FAT32 image.\n");
+        return 2;
+    }
+
+    int left = fat32_defrag(fs, flags, stdout);
+    if (fat32_unmount(fs) != 0) {
+        fprintf(stderr, "Error: could not write everything back to the image.\n");
+        return 2;
+    }
+
+    if (left < 0) return 2;
+    return left > 0 ? 1 : 0;
+}
@@ -0,0 +1,55 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fat32.h"
+
+// checks a FAT32 image without the shell. exit status: 0 when the image
+// is clean, 1 when problems were found (and repaired with -r), 2 when the
+// check could not run.
+
+int main(int argc, char *argv[]) {
+    const char *image = NULL;
+    int mount_flags = 0;
+    int flags = 0;
+    unsigned int threads = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            flags |= FAT32_FSCK_REPAIR;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            flags |= FAT32_FSCK_VERBOSE;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            mount_flags |= FAT32_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (!image) {
+            image = argv[i];
+        } else {
+            image = NULL;
+            break;
+        }
+    }
+
+    if (!image) {
+        fprintf(stderr, "Usage: %s [-r] [-v] [-m] [-j threads] <fat32 image>\n", argv[0]);
+        return 2;
+    }
+
+    fat32_fs *fs = fat32_mount(image, mount_flags);
+    if (!fs) {
+        fprintf(stderr, "Error: failed to open FAT32 image.\n");
+        return 2;
+    }
+
+    int problems = fat32_fsck(fs, flags, threads, stdout);
+    if (fat32_unmount(fs) != 0) {
+        fprintf(stderr, "Error: could not write everything back to the image.\n");
+        return 2;
+    }
+
+    if (problems < 0) return 2;
+    return problems > 0 ? 1 : 0;
+}
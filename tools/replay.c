@@ -0,0 +1,242 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fat32.h"
+#include "shell.h"
+#include "image_io.h"
+
+// re-runs a trace recorded with `filesys -t` against a copy of the image
+// it was recorded on, either as fast as possible or at the recorded pace
+// (-p), and compares latency and image I/O with the recording. the copy
+// is removed afterwards unless -k is given.
+
+#define MAX_LINE 65536
+
+typedef struct {
+    double *v;
+    unsigned long n;
+    unsigned long cap;
+} SAMPLES;
+
+typedef struct {
+    unsigned long commands;
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    SAMPLES latency;            // seconds per command
+} TOTALS;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t) {
+    double d = t - now();
+    if (d <= 0) return;
+    struct timespec ts;
+    ts.tv_sec = (time_t)d;
+    ts.tv_nsec = (long)((d - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+static void samples_add(SAMPLES *s, double v) {
+    if (s->n == s->cap) {
+        unsigned long cap = s->cap ? s->cap * 2 : 1024;
+        double *p = realloc(s->v, cap * sizeof(double));
+        if (!p) return;
+        s->v = p;
+        s->cap = cap;
+    }
+    s->v[s->n++] = v;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// p-th percentile in microseconds; sorts the samples
+static double samples_percentile(SAMPLES *s, double p) {
+    if (s->n == 0) return 0;
+    qsort(s->v, s->n, sizeof(double), cmp_double);
+    unsigned long i = (unsigned long)(s->n * p / 100.0);
+    return s->v[i < s->n ? i : s->n - 1] * 1e6;
+}
+
+static double samples_total(const SAMPLES *s) {
+    double t = 0;
+    for (unsigned long i = 0; i < s->n; i++) t += s->v[i];
+    return t;
+}
+
+// copies the image, keeping it sparse: multi-terabyte test images are
+// mostly holes
+static int copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    FILE *out = in ? fopen(to, "wb") : NULL;
+    int err = !in || !out || io_copy_sparse(fileno(in), fileno(out)) != 0;
+
+    if (in) fclose(in);
+    if (out && fclose(out) != 0) err = 1;
+    return err ? -1 : 0;
+}
+
+static void print_totals(const char *label, TOTALS *t) {
+    double total = samples_total(&t->latency);
+    fprintf(stderr, "%-9s %8lu %10.3f %10.1f %10.1f %9lu %12lu %9lu %12lu\n", label,
+            t->commands, total, samples_percentile(&t->latency, 50),
+            samples_percentile(&t->latency, 99), t->reads, t->bytes_read,
+            t->writes, t->bytes_written);
+}
+
+int main(int argc, char *argv[]) {
+    const char *trace_path = NULL;
+    const char *image = NULL;
+    const char *copy = NULL;
+    int paced = 0;
+    int keep = 0;
+    int verbose = 0;
+    int mount_flags = 0;
+    unsigned int cache_slots = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0) {
+            paced = 1;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            keep = 1;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            mount_flags |= FAT32_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            cache_slots = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            copy = argv[++i];
+        } else if (!trace_path) {
+            trace_path = argv[i];
+        } else if (!image) {
+            image = argv[i];
+        } else {
+            image = NULL;
+            break;
+        }
+    }
+
+    if (!trace_path || !image) {
+        fprintf(stderr, "Usage: %s [-p] [-m] [-c cache_slots] [-w copy] [-k] [-v] "
+                        "<trace> <fat32 image>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *trace = fat32_trace_open(trace_path);
+    if (!trace) {
+        fprintf(stderr, "Error: %s is not a trace.\n", trace_path);
+        return 1;
+    }
+
+    char copy_buf[4096];
+    if (!copy) {
+        snprintf(copy_buf, sizeof(copy_buf), "%s.replay", image);
+        copy = copy_buf;
+    }
+    if (copy_file(image, copy) != 0) {
+        fprintf(stderr, "Error: cannot copy %s to %s.\n", image, copy);
+        fclose(trace);
+        return 1;
+    }
+
+    fat32_fs *fs = fat32_mount(copy, mount_flags);
+    char *line = malloc(MAX_LINE);
+    if (!fs || !line) {
+        fprintf(stderr, "Error: failed to open FAT32 image.\n");
+        if (fs) fat32_unmount(fs);
+        if (!keep) remove(copy);
+        free(line);
+        fclose(trace);
+        return 1;
+    }
+    if (cache_slots) cache_set_capacity(fs, cache_slots);
+    shell_stats_reset(fs);
+
+    // command output is not part of the measurement
+    if (!verbose && !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "Warning: command output is not discarded.\n");
+    }
+
+    TOTALS rec, rep;
+    memset(&rec, 0, sizeof(rec));
+    memset(&rep, 0, sizeof(rep));
+
+    FAT32_TRACE_EVENT ev;
+    unsigned long cmd_time = 0;
+    int r;
+    double start = now();
+    while ((r = fat32_trace_next(trace, &ev, line, MAX_LINE)) == 1) {
+        switch (ev.type) {
+        case FAT32_TRACE_READ:
+        case FAT32_TRACE_SENDFILE:
+            rec.reads++;
+            rec.bytes_read += ev.length;
+            break;
+        case FAT32_TRACE_WRITE:
+            rec.writes++;
+            rec.bytes_written += ev.length;
+            break;
+        case FAT32_TRACE_COMMAND_END:
+            // the timestamps are finer than the stored duration
+            samples_add(&rec.latency, (ev.time_ns - cmd_time) / 1e9);
+            break;
+        case FAT32_TRACE_COMMAND: {
+            cmd_time = ev.time_ns;
+            if (paced) sleep_until(start + ev.time_ns / 1e9);
+            rec.commands++;
+            rep.commands++;
+            double t = now();
+            int done = shell_execute(fs, line);
+            samples_add(&rep.latency, now() - t);
+            if (done) goto finished;
+            break;
+        }
+        }
+    }
+finished:;
+    double elapsed = now() - start;
+
+    // the recording ends with what unmount wrote back, so write back here too
+    fat32_sync(fs);
+
+    FAT32_STATS st;
+    fat32_get_stats(fs, &st);
+    rep.reads = st.reads;
+    rep.writes = st.writes;
+    rep.bytes_read = st.bytes_read;
+    rep.bytes_written = st.bytes_written;
+
+    if (r < 0) {
+        fprintf(stderr, "Warning: %s is damaged, replayed what could be read.\n", trace_path);
+    }
+    fprintf(stderr, "replayed %lu commands in %.3f s, %.0f commands/s (%s)\n",
+            rep.commands, elapsed, elapsed > 0 ? rep.commands / elapsed : 0,
+            paced ? "recorded pace" : "as fast as possible");
+    fprintf(stderr, "%-9s %8s %10s %10s %10s %9s %12s %9s %12s\n", "", "commands",
+            "busy s", "p50 us", "p99 us", "reads", "bytes read", "writes", "bytes written");
+    print_totals("recorded", &rec);
+    print_totals("replayed", &rep);
+    fprintf(stderr, "\n");
+    shell_stats_print(fs, stderr);
+
+    fat32_unmount(fs);
+    if (!keep) remove(copy);
+    fclose(trace);
+    free(line);
+    free(rec.latency.v);
+    free(rep.latency.v);
+    return 0;
+}